@@ -0,0 +1,470 @@
+#ifndef RESQUE_EDGE_INDEX_H
+#define RESQUE_EDGE_INDEX_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <geos/geom/Envelope.h>
+#include <geos/geom/Geometry.h>
+#include <geos/geom/LineString.h>
+#include <geos/geom/Polygon.h>
+#include <geos/geom/CoordinateSequence.h>
+
+#include "orientation.h"
+
+// st_touches and st_adjacent between two polygons or multipolygons from
+// their boundaries, without the topology graph GEOS builds for every pair.
+// The ring edges, each turned to run with the interior on its left, are
+// bucketed into a grid of cells; relate() meets the edges of two indexes
+// cell by cell and sorts every pair of edges that meet:
+//   - a proper crossing means the interiors overlap;
+//   - a shared stretch run the same way means so too, while one run both
+//     ways (neighbouring cells of a tessellation) is a touch;
+//   - any other contact is at a vertex of one of the edges.
+// Without a crossing, the interiors overlap exactly when a stretch of one
+// boundary between two contacts, shared stretches aside, lies inside the
+// other geometry, which the midpoint of the stretch tells. The polygons
+// must be valid, as for GEOS. Orientation comes from orient2d(); a turn it
+// cannot tell leaves the pair to GEOS.
+
+#define EDGES_UNKNOWN -1
+#define EDGES_DISJOINT 0    // no common point
+#define EDGES_TOUCH 1       // common points, none inside both
+#define EDGES_OVERLAP 2     // common interior points
+#define EDGES_MEET 3        // common points, see relate()
+
+// average number of edges per cell
+#define EDGE_INDEX_EDGES_PER_CELL 4
+
+class EdgeIndex {
+public:
+    // valid() is false unless geom is a non empty polygon or multipolygon
+    // with no ring of zero area
+    explicit EdgeIndex(const geos::geom::Geometry *geom)
+        : min_x(0), min_y(0), max_x(0), max_y(0), cell_width(1), cell_height(1),
+          columns(1), rows(1), areal(false), integral(true)
+    {
+        using namespace geos::geom;
+
+        if (geom == NULL || geom->isEmpty()) {
+            return;
+        }
+        bool ok = true;
+        if (geom->getGeometryTypeId() == GEOS_POLYGON) {
+            ok = add_polygon(static_cast<const Polygon*>(geom));
+        }
+        else if (geom->getGeometryTypeId() == GEOS_MULTIPOLYGON) {
+            for (size_t i = 0; ok && i < geom->getNumGeometries(); i++) {
+                ok = add_polygon(static_cast<const Polygon*>(geom->getGeometryN(i)));
+            }
+        }
+        else {
+            return;
+        }
+        if (!ok || edges.empty()) {
+            edges.clear();
+            return;
+        }
+
+        const Envelope *env = geom->getEnvelopeInternal();
+        min_x = env->getMinX();
+        min_y = env->getMinY();
+        max_x = env->getMaxX();
+        max_y = env->getMaxY();
+        areal = true;
+
+        size_t side = (size_t) std::sqrt((double) (edges.size() / EDGE_INDEX_EDGES_PER_CELL)) + 1;
+        columns = max_x > min_x ? side : 1;
+        rows = max_y > min_y ? side : 1;
+        cell_width = max_x > min_x ? (max_x - min_x) / columns : 1;
+        cell_height = max_y > min_y ? (max_y - min_y) / rows : 1;
+        cells.resize(columns * rows);
+
+        for (size_t e = 0; e < edges.size(); e++) {
+            const Edge &edge = edges[e];
+            size_t x_hi = column_of(edge.max_x());
+            size_t y_hi = row_of(edge.max_y());
+            for (size_t y = row_of(edge.min_y()); y <= y_hi; y++) {
+                for (size_t x = column_of(edge.min_x()); x <= x_hi; x++) {
+                    cells[y * columns + x].push_back(e);
+                }
+            }
+        }
+    }
+
+    bool valid() const { return areal; }
+
+    // EDGES_DISJOINT, EDGES_TOUCH or EDGES_OVERLAP between the geometry
+    // and that of other, or EDGES_UNKNOWN when floating point cannot tell.
+    // With meet_only, a pair with a common point is EDGES_MEET, found at
+    // the first contact: enough for st_adjacent.
+    int relate(const EdgeIndex &other, bool meet_only) const
+    {
+        if (!areal || !other.areal || max_x < other.min_x || other.max_x < min_x
+                || max_y < other.min_y || other.max_y < min_y) {
+            return EDGES_DISJOINT;
+        }
+        bool exact = integral && other.integral;
+
+        std::vector<Split> mine;
+        std::vector<Split> theirs;
+        bool contact = false;
+        for (size_t e = 0; e < edges.size(); e++) {
+            const Edge &a = edges[e];
+            if (a.max_x() < other.min_x || a.min_x() > other.max_x
+                    || a.max_y() < other.min_y || a.min_y() > other.max_y) {
+                continue;
+            }
+            size_t x_lo = other.column_of(a.min_x());
+            size_t x_hi = other.column_of(a.max_x());
+            size_t y_lo = other.row_of(a.min_y());
+            size_t y_hi = other.row_of(a.max_y());
+            for (size_t y = y_lo; y <= y_hi; y++) {
+                for (size_t x = x_lo; x <= x_hi; x++) {
+                    const std::vector<size_t> &cell = other.cells[y * other.columns + x];
+                    for (size_t i = 0; i < cell.size(); i++) {
+                        const Edge &b = other.edges[cell[i]];
+                        if (a.max_x() < b.min_x() || b.max_x() < a.min_x()
+                                || a.max_y() < b.min_y() || b.max_y() < a.min_y()) {
+                            continue;
+                        }
+                        // a pair of edges in several cells counts in the
+                        // cell of the lower left corner of their common box
+                        if (other.column_of(std::max(a.min_x(), b.min_x())) != x
+                                || other.row_of(std::max(a.min_y(), b.min_y())) != y) {
+                            continue;
+                        }
+                        int met = meet(a, e, b, cell[i], exact, mine, theirs);
+                        if (met == MET_UNKNOWN) {
+                            return EDGES_UNKNOWN;
+                        }
+                        if (met == MET_OVERLAP) {
+                            return meet_only ? EDGES_MEET : EDGES_OVERLAP;
+                        }
+                        if (met == MET_CONTACT && meet_only) {
+                            return EDGES_MEET;
+                        }
+                        contact = contact || met == MET_CONTACT;
+                    }
+                }
+            }
+        }
+
+        int inside = stretches_inside(other, mine, exact);
+        if (inside == EDGES_DISJOINT) {
+            inside = other.stretches_inside(*this, theirs, exact);
+        }
+        if (inside == EDGES_UNKNOWN) {
+            return EDGES_UNKNOWN;
+        }
+        if (inside == EDGES_OVERLAP) {
+            return meet_only ? EDGES_MEET : EDGES_OVERLAP;
+        }
+        if (!contact) {
+            return EDGES_DISJOINT;
+        }
+        return meet_only ? EDGES_MEET : EDGES_TOUCH;
+    }
+
+private:
+    struct Edge {
+        double x1, y1, x2, y2;
+
+        double min_x() const { return x1 < x2 ? x1 : x2; }
+        double max_x() const { return x1 < x2 ? x2 : x1; }
+        double min_y() const { return y1 < y2 ? y1 : y2; }
+        double max_y() const { return y1 < y2 ? y2 : y1; }
+        // the position of x, y along the edge, for ordering points on it
+        double along(double x, double y) const {
+            return std::fabs(x2 - x1) >= std::fabs(y2 - y1)
+                ? (x - x1) / (x2 - x1) : (y - y1) / (y2 - y1);
+        }
+    };
+
+    // a contact at x, y, t along the edge; a shared stretch goes on from
+    // there to t_end
+    struct Split {
+        size_t edge;
+        double t;
+        double t_end;
+        double x, y;
+
+        bool operator<(const Split &other) const {
+            return edge < other.edge || (edge == other.edge && t < other.t);
+        }
+    };
+
+    enum { MET_NONE, MET_CONTACT, MET_OVERLAP, MET_UNKNOWN };
+
+    std::vector<Edge> edges;
+    std::vector<std::vector<size_t> > cells;
+    double min_x, min_y, max_x, max_y;
+    double cell_width, cell_height;
+    size_t columns, rows;
+    bool areal;
+    bool integral;          // every coordinate an integer up to 2^24
+
+    size_t column_of(double x) const
+    {
+        double c = std::floor((x - min_x) / cell_width);
+        if (c < 0) {
+            return 0;
+        }
+        if (c >= columns) {
+            return columns - 1;
+        }
+        return (size_t) c;
+    }
+
+    size_t row_of(double y) const
+    {
+        double r = std::floor((y - min_y) / cell_height);
+        if (r < 0) {
+            return 0;
+        }
+        if (r >= rows) {
+            return rows - 1;
+        }
+        return (size_t) r;
+    }
+
+    static bool in_box(const Edge &e, double x, double y)
+    {
+        return x >= e.min_x() && x <= e.max_x() && y >= e.min_y() && y <= e.max_y();
+    }
+
+    static void add_split(std::vector<Split> &splits, const Edge &e, size_t edge,
+            double x, double y)
+    {
+        Split s = {edge, e.along(x, y), e.along(x, y), x, y};
+        splits.push_back(s);
+    }
+
+    // Sorts edge a (number ea of this index) against edge b (number eb of
+    // the other) and records the contacts on either.
+    static int meet(const Edge &a, size_t ea, const Edge &b, size_t eb, bool exact,
+            std::vector<Split> &mine, std::vector<Split> &theirs)
+    {
+        int o1 = orient2d(a.x1, a.y1, a.x2, a.y2, b.x1, b.y1, exact);
+        int o2 = orient2d(a.x1, a.y1, a.x2, a.y2, b.x2, b.y2, exact);
+        int o3 = orient2d(b.x1, b.y1, b.x2, b.y2, a.x1, a.y1, exact);
+        int o4 = orient2d(b.x1, b.y1, b.x2, b.y2, a.x2, a.y2, exact);
+        if (o1 == TURN_UNKNOWN || o2 == TURN_UNKNOWN || o3 == TURN_UNKNOWN || o4 == TURN_UNKNOWN) {
+            return MET_UNKNOWN;
+        }
+        if (o1 * o2 < 0 && o3 * o4 < 0) {
+            return MET_OVERLAP;
+        }
+
+        if (o1 == 0 && o2 == 0) {
+            // on one line: the common stretch, if any, between the inner
+            // two of the four ends
+            double lo = std::max(std::min(a.along(a.x1, a.y1), a.along(a.x2, a.y2)),
+                    std::min(a.along(b.x1, b.y1), a.along(b.x2, b.y2)));
+            double hi = std::min(std::max(a.along(a.x1, a.y1), a.along(a.x2, a.y2)),
+                    std::max(a.along(b.x1, b.y1), a.along(b.x2, b.y2)));
+            if (lo > hi) {
+                return MET_NONE;
+            }
+            if (lo < hi && (a.x2 - a.x1) * (b.x2 - b.x1) + (a.y2 - a.y1) * (b.y2 - b.y1) > 0) {
+                // the interiors lie on the same side
+                return MET_OVERLAP;
+            }
+            // the ends of the common stretch are ends of a or b
+            double px[4] = {a.x1, a.x2, b.x1, b.x2};
+            double py[4] = {a.y1, a.y2, b.y1, b.y2};
+            int first = 0;
+            int last = 0;
+            for (int k = 3; k >= 0; k--) {
+                if (a.along(px[k], py[k]) == lo) {
+                    first = k;
+                }
+                if (a.along(px[k], py[k]) == hi) {
+                    last = k;
+                }
+            }
+            add_split(mine, a, ea, px[first], py[first]);
+            add_split(theirs, b, eb, px[first], py[first]);
+            if (lo == hi) {
+                return MET_CONTACT;
+            }
+            add_split(mine, a, ea, px[last], py[last]);
+            add_split(theirs, b, eb, px[last], py[last]);
+            // the stretch between them is on the boundary of both, b may
+            // run it the other way
+            double t1 = b.along(px[first], py[first]);
+            double t2 = b.along(px[last], py[last]);
+            int start = t1 <= t2 ? first : last;
+            Split on_a = {ea, lo, hi, px[first], py[first]};
+            Split on_b = {eb, std::min(t1, t2), std::max(t1, t2), px[start], py[start]};
+            mine.push_back(on_a);
+            theirs.push_back(on_b);
+            return MET_CONTACT;
+        }
+
+        // anything else meets at an end of a or of b
+        bool met = false;
+        if (o1 == 0 && in_box(a, b.x1, b.y1)) {
+            add_split(mine, a, ea, b.x1, b.y1);
+            met = true;
+        }
+        if (o2 == 0 && in_box(a, b.x2, b.y2)) {
+            add_split(mine, a, ea, b.x2, b.y2);
+            met = true;
+        }
+        if (o3 == 0 && in_box(b, a.x1, a.y1)) {
+            add_split(theirs, b, eb, a.x1, a.y1);
+            met = true;
+        }
+        if (o4 == 0 && in_box(b, a.x2, a.y2)) {
+            add_split(theirs, b, eb, a.x2, a.y2);
+            met = true;
+        }
+        return met ? MET_CONTACT : MET_NONE;
+    }
+
+    // EDGES_OVERLAP when a stretch of the edges of this index between two
+    // of the contacts in splits lies inside other, EDGES_DISJOINT when none
+    // does, EDGES_UNKNOWN when a midpoint cannot be located.
+    int stretches_inside(const EdgeIndex &other, std::vector<Split> &splits, bool exact) const
+    {
+        std::sort(splits.begin(), splits.end());
+        size_t s = 0;
+        for (size_t e = 0; e < edges.size(); e++) {
+            const Edge &edge = edges[e];
+            size_t first = s;
+            while (s < splits.size() && splits[s].edge == e) {
+                s++;
+            }
+            if (edge.max_x() < other.min_x || edge.min_x() > other.max_x
+                    || edge.max_y() < other.min_y || edge.min_y() > other.max_y) {
+                continue;
+            }
+
+            // from the start of the edge through the contacts to its end
+            double x = edge.x1;
+            double y = edge.y1;
+            double t = 0.0;
+            double shared_until = -1.0;
+            for (size_t k = first; k <= s; k++) {
+                double next_x = k < s ? splits[k].x : edge.x2;
+                double next_y = k < s ? splits[k].y : edge.y2;
+                double next_t = k < s ? splits[k].t : 1.0;
+                if (next_t > t && next_t > shared_until) {
+                    int location = other.locate((x + next_x) / 2, (y + next_y) / 2, exact);
+                    if (location == EDGES_UNKNOWN || location == EDGES_TOUCH) {
+                        // a midpoint on the boundary is a contact missed
+                        return EDGES_UNKNOWN;
+                    }
+                    if (location == EDGES_OVERLAP) {
+                        return EDGES_OVERLAP;
+                    }
+                }
+                if (k < s) {
+                    shared_until = std::max(shared_until, splits[k].t_end);
+                    if (next_t >= t) {
+                        x = next_x;
+                        y = next_y;
+                        t = next_t;
+                    }
+                }
+            }
+        }
+        return EDGES_DISJOINT;
+    }
+
+    // EDGES_OVERLAP inside, EDGES_TOUCH on the boundary, EDGES_DISJOINT
+    // outside or EDGES_UNKNOWN, counting the crossings of a ray towards +x
+    int locate(double x, double y, bool exact) const
+    {
+        if (x < min_x || x > max_x || y < min_y || y > max_y) {
+            return EDGES_DISJOINT;
+        }
+        size_t row = row_of(y);
+        size_t from = column_of(x);
+        bool inside = false;
+        for (size_t c = from; c < columns; c++) {
+            const std::vector<size_t> &cell = cells[row * columns + c];
+            for (size_t i = 0; i < cell.size(); i++) {
+                const Edge &e = edges[cell[i]];
+                // an edge in several cells of the row counts in the first
+                if (std::max(column_of(e.min_x()), from) != c) {
+                    continue;
+                }
+                bool crosses = (e.y1 > y) != (e.y2 > y);
+                if (!crosses && !in_box(e, x, y)) {
+                    continue;
+                }
+                int side = e.y1 < e.y2
+                    ? orient2d(e.x1, e.y1, e.x2, e.y2, x, y, exact)
+                    : orient2d(e.x2, e.y2, e.x1, e.y1, x, y, exact);
+                if (side == TURN_UNKNOWN) {
+                    return EDGES_UNKNOWN;
+                }
+                if (side == 0 && in_box(e, x, y)) {
+                    return EDGES_TOUCH;
+                }
+                // left of an upward edge, the ray crosses it; half open in
+                // y so a vertex on the ray is counted once
+                if (crosses && side > 0) {
+                    inside = !inside;
+                }
+            }
+        }
+        return inside ? EDGES_OVERLAP : EDGES_DISJOINT;
+    }
+
+    // false for a ring of zero area
+    bool add_ring(const geos::geom::LineString *ring, bool shell)
+    {
+        const geos::geom::CoordinateSequence *coords = ring->getCoordinatesRO();
+        size_t n = coords->getSize();
+        double area = 0.0;
+        for (size_t i = 0; i < n; i++) {
+            double v[2] = {coords->getX(i), coords->getY(i)};
+            for (int k = 0; k < 2; k++) {
+                integral = integral && exact_coordinate(v[k]);
+            }
+            if (i > 0) {
+                area += (coords->getX(i - 1) - coords->getX(0)) * (v[1] - coords->getY(0))
+                    - (coords->getY(i - 1) - coords->getY(0)) * (v[0] - coords->getX(0));
+            }
+        }
+        if (area == 0) {
+            return false;
+        }
+
+        // the interior to the left: shells counterclockwise, holes clockwise
+        bool reverse = (area > 0) != shell;
+        for (size_t i = 1; i < n; i++) {
+            Edge e;
+            e.x1 = coords->getX(reverse ? i : i - 1);
+            e.y1 = coords->getY(reverse ? i : i - 1);
+            e.x2 = coords->getX(reverse ? i - 1 : i);
+            e.y2 = coords->getY(reverse ? i - 1 : i);
+            if (e.x1 != e.x2 || e.y1 != e.y2) {
+                edges.push_back(e);
+            }
+        }
+        return true;
+    }
+
+    bool add_polygon(const geos::geom::Polygon *poly)
+    {
+        if (poly->isEmpty()) {
+            return true;
+        }
+        if (!add_ring(poly->getExteriorRing(), true)) {
+            return false;
+        }
+        for (size_t i = 0; i < poly->getNumInteriorRing(); i++) {
+            if (!add_ring(poly->getInteriorRingN(i), false)) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+#endif
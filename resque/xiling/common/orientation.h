@@ -0,0 +1,55 @@
+#ifndef RESQUE_ORIENTATION_H
+#define RESQUE_ORIENTATION_H
+
+#include <cmath>
+
+// Which side of a line a point lies on, the one floating point test the
+// point locator, the edge index and the canonical WKT form share.
+//
+// The sign of the orient2d determinant (b - a) x (c - a) is certain once
+// its magnitude exceeds Shewchuk's error bound, about 3.3e-16 times the sum
+// of the magnitudes of its two products; 1e-15 leaves a margin. Nearer to
+// zero the sign is TURN_UNKNOWN, which the callers leave to GEOS. Two
+// cases take no rounding at all:
+//   - a product with a zero factor, and a difference of two equal values,
+//     are exact, so an axis parallel configuration is decided as it is;
+//   - integer coordinates up to 2^24, such as the pixel coordinates of a
+//     slide image, and halves of them such as the midpoints of their
+//     edges, keep the differences, the products and the determinant
+//     within the 53 bits of a double; exact_coordinate() tells them, and
+//     a caller whose three points are all such passes exact.
+
+#define TURN_UNKNOWN 2
+
+// an integer up to 2^24, see above
+inline bool exact_coordinate(double v)
+{
+    return std::fabs(v) <= 16777216.0 && v == std::floor(v);
+}
+
+// The turn a, b, c: 1 left, -1 right, 0 on a line, TURN_UNKNOWN when
+// floating point cannot tell the sign.
+inline int orient2d(double ax, double ay, double bx, double by, double cx, double cy,
+        bool exact)
+{
+    double dx1 = bx - ax;
+    double dy1 = by - ay;
+    double dx2 = cx - ax;
+    double dy2 = cy - ay;
+    double left = dx1 * dy2;
+    double right = dy1 * dx2;
+    double det = left - right;
+    if (exact || ((dx1 == 0 || dy2 == 0) && (dy1 == 0 || dx2 == 0))) {
+        return det > 0 ? 1 : (det < 0 ? -1 : 0);
+    }
+    double bound = 1e-15 * (std::fabs(left) + std::fabs(right));
+    if (det > bound) {
+        return 1;
+    }
+    if (det < -bound) {
+        return -1;
+    }
+    return TURN_UNKNOWN;
+}
+
+#endif
@@ -0,0 +1,233 @@
+#ifndef RESQUE_POINT_LOCATOR_H
+#define RESQUE_POINT_LOCATOR_H
+
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <geos/geom/Envelope.h>
+#include <geos/geom/Geometry.h>
+#include <geos/geom/LineString.h>
+#include <geos/geom/Polygon.h>
+#include <geos/geom/CoordinateSequence.h>
+
+#include "orientation.h"
+#include "spatial_predicates.h"
+
+// Point in polygon tests against a fixed polygon or multipolygon without
+// going through GEOS. The ring edges are bucketed into horizontal bands of
+// equal height; a point only looks at the edges of its band, counting the
+// crossings of a ray towards +x. Which side of an edge a point lies on
+// comes from orient2d(); a point too close to an edge to tell is
+// POINT_UNKNOWN, for GEOS to decide.
+
+#define POINT_UNKNOWN -1
+#define POINT_EXTERIOR 0
+#define POINT_INTERIOR 1
+#define POINT_BOUNDARY 2
+
+// average number of edges per band
+#define POINT_LOCATOR_EDGES_PER_BAND 4
+
+class PointLocator {
+public:
+    // valid() is false unless geom is a non empty polygon or multipolygon
+    explicit PointLocator(const geos::geom::Geometry *geom)
+        : min_x(0), min_y(0), max_x(0), max_y(0), band_height(0), areal(false),
+          integral(true)
+    {
+        using namespace geos::geom;
+
+        if (geom == NULL || geom->isEmpty()) {
+            return;
+        }
+        if (geom->getGeometryTypeId() == GEOS_POLYGON) {
+            add_polygon(static_cast<const Polygon*>(geom));
+        }
+        else if (geom->getGeometryTypeId() == GEOS_MULTIPOLYGON) {
+            for (size_t i = 0; i < geom->getNumGeometries(); i++) {
+                add_polygon(static_cast<const Polygon*>(geom->getGeometryN(i)));
+            }
+        }
+        else {
+            return;
+        }
+
+        const Envelope *env = geom->getEnvelopeInternal();
+        min_x = env->getMinX();
+        min_y = env->getMinY();
+        max_x = env->getMaxX();
+        max_y = env->getMaxY();
+        areal = !edges.empty();
+
+        size_t num_bands = edges.size() / POINT_LOCATOR_EDGES_PER_BAND + 1;
+        band_height = (max_y - min_y) / num_bands;
+        if (band_height <= 0) {
+            num_bands = 1;
+            band_height = 1;
+        }
+        bands.resize(num_bands);
+
+        for (size_t e = 0; e < edges.size(); e++) {
+            const Edge &edge = edges[e];
+            size_t lo = band_of(edge.y1 < edge.y2 ? edge.y1 : edge.y2);
+            size_t hi = band_of(edge.y1 < edge.y2 ? edge.y2 : edge.y1);
+            for (size_t b = lo; b <= hi; b++) {
+                bands[b].push_back(e);
+            }
+        }
+    }
+
+    bool valid() const { return areal; }
+
+    // POINT_EXTERIOR, POINT_INTERIOR, POINT_BOUNDARY or POINT_UNKNOWN
+    int locate(double x, double y) const
+    {
+        if (!areal || x < min_x || x > max_x || y < min_y || y > max_y) {
+            return POINT_EXTERIOR;
+        }
+
+        const std::vector<size_t> &band = bands[band_of(y)];
+        bool exact = integral && exact_coordinate(x) && exact_coordinate(y);
+        bool inside = false;
+
+        for (size_t i = 0; i < band.size(); i++) {
+            const Edge &e = edges[band[i]];
+
+            // half open in y so a vertex on the ray is counted once
+            bool crosses = (e.y1 > y) != (e.y2 > y);
+            bool near = x >= (e.x1 < e.x2 ? e.x1 : e.x2) && x <= (e.x1 < e.x2 ? e.x2 : e.x1)
+                && y >= (e.y1 < e.y2 ? e.y1 : e.y2) && y <= (e.y1 < e.y2 ? e.y2 : e.y1);
+            if (!crosses && !near) {
+                continue;
+            }
+
+            // the side of the point from the edge taken upwards
+            int side = e.y1 < e.y2
+                ? orient2d(e.x1, e.y1, e.x2, e.y2, x, y, exact)
+                : orient2d(e.x2, e.y2, e.x1, e.y1, x, y, exact);
+            if (side == TURN_UNKNOWN) {
+                return POINT_UNKNOWN;
+            }
+            if (side == 0 && near) {
+                return POINT_BOUNDARY;
+            }
+            // left of an upward edge, the ray crosses it
+            if (crosses && side > 0) {
+                inside = !inside;
+            }
+        }
+
+        return inside ? POINT_INTERIOR : POINT_EXTERIOR;
+    }
+
+    // locations[k] = locate(xs[k], ys[k])
+    void locate(const double *xs, const double *ys, size_t n, int *locations) const
+    {
+        for (size_t k = 0; k < n; k++) {
+            locations[k] = locate(xs[k], ys[k]);
+        }
+    }
+
+private:
+    struct Edge {
+        double x1, y1, x2, y2;
+    };
+
+    std::vector<Edge> edges;
+    std::vector<std::vector<size_t> > bands;
+    double min_x, min_y, max_x, max_y;
+    double band_height;
+    bool areal;
+    bool integral;          // every vertex an integer up to 2^24
+
+    size_t band_of(double y) const
+    {
+        double b = std::floor((y - min_y) / band_height);
+        if (b < 0) {
+            return 0;
+        }
+        if (b >= bands.size()) {
+            return bands.size() - 1;
+        }
+        return (size_t) b;
+    }
+
+    void add_ring(const geos::geom::LineString *ring)
+    {
+        const geos::geom::CoordinateSequence *coords = ring->getCoordinatesRO();
+        for (size_t i = 1; i < coords->getSize(); i++) {
+            Edge e;
+            e.x1 = coords->getX(i - 1);
+            e.y1 = coords->getY(i - 1);
+            e.x2 = coords->getX(i);
+            e.y2 = coords->getY(i);
+            edges.push_back(e);
+            integral = integral && exact_coordinate(e.x1) && exact_coordinate(e.y1)
+                && exact_coordinate(e.x2) && exact_coordinate(e.y2);
+        }
+    }
+
+    void add_polygon(const geos::geom::Polygon *poly)
+    {
+        if (poly->isEmpty()) {
+            return;
+        }
+        add_ring(poly->getExteriorRing());
+        for (size_t i = 0; i < poly->getNumInteriorRing(); i++) {
+            add_ring(poly->getInteriorRingN(i));
+        }
+    }
+};
+
+// true when the WKT text is a single POINT
+inline bool is_point_wkt(const std::string &wkt)
+{
+    size_t i = wkt.find_first_not_of(" \t");
+    return i != std::string::npos && strncasecmp(wkt.c_str() + i, "POINT", 5) == 0;
+}
+
+// predicates answered from a point location alone
+inline bool point_fast_path(int jp)
+{
+    switch (jp) {
+    case ST_INTERSECTS:
+    case ST_ADJACENT:
+    case ST_DISJOINT:
+    case ST_TOUCHES:
+    case ST_CONTAINS:
+    case ST_WITHIN:
+    case ST_CROSSES:
+    case ST_OVERLAPS:
+    case ST_EQUALS:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// jp between a point and a polygon, from the location of the point, which
+// must not be POINT_UNKNOWN; point_left says the point is the first
+// argument of jp
+inline bool point_predicate(int jp, bool point_left, int location)
+{
+    switch (jp) {
+    case ST_INTERSECTS:
+    case ST_ADJACENT:
+        return location != POINT_EXTERIOR;
+    case ST_DISJOINT:
+        return location == POINT_EXTERIOR;
+    case ST_TOUCHES:
+        return location == POINT_BOUNDARY;
+    case ST_CONTAINS:
+        return !point_left && location == POINT_INTERIOR;
+    case ST_WITHIN:
+        return point_left && location == POINT_INTERIOR;
+    default:
+        // a point never crosses, overlaps or equals a polygon
+        return false;
+    }
+}
+
+#endif
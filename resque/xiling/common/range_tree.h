@@ -0,0 +1,139 @@
+#ifndef RESQUE_RANGE_TREE_H
+#define RESQUE_RANGE_TREE_H
+
+#include <algorithm>
+#include <vector>
+
+// Finds the boxes that lie inside a query box, or that hold it, the
+// candidates of st_contains and st_within. A box lies inside another when
+// its lower left corner does and its upper right corner is dominated by
+// the other's; a static 2-D range tree over the lower left corners answers
+// the first part, and every corner it reports is checked for the second.
+// A box holding the query has its lower left corner in the window below
+// and left of the query's, no farther than the widest and the highest
+// box. The tree is layered: the corners are sorted by x and, at level k,
+// every aligned block of 2^k of them is also kept sorted by y, so a query
+// takes the O(log n) blocks covering its x range and a binary search in
+// each. The tree goes over the smaller side, either query serves.
+
+struct RangeBox {
+    double min_x;
+    double min_y;
+    double max_x;
+    double max_y;
+};
+
+class BoxRangeTree {
+public:
+    // boxes must outlive the tree
+    explicit BoxRangeTree(const std::vector<RangeBox> &boxes)
+        : boxes(boxes), max_width(0.0), max_height(0.0)
+    {
+        size_t n = boxes.size();
+        std::vector<size_t> order(n);
+        for (size_t i = 0; i < n; i++) {
+            order[i] = i;
+            max_width = std::max(max_width, boxes[i].max_x - boxes[i].min_x);
+            max_height = std::max(max_height, boxes[i].max_y - boxes[i].min_y);
+        }
+        std::sort(order.begin(), order.end(), ByMinX(boxes));
+
+        xs.resize(n);
+        levels.push_back(std::vector<Corner>(n));
+        for (size_t i = 0; i < n; i++) {
+            xs[i] = boxes[order[i]].min_x;
+            levels[0][i].y = boxes[order[i]].min_y;
+            levels[0][i].box = order[i];
+        }
+
+        // level k merges the pairs of blocks of level k - 1
+        for (size_t width = 1; width < n; width *= 2) {
+            const std::vector<Corner> &below = levels.back();
+            std::vector<Corner> level(n);
+            for (size_t lo = 0; lo < n; lo += 2 * width) {
+                size_t mid = std::min(lo + width, n);
+                size_t hi = std::min(lo + 2 * width, n);
+                std::merge(below.begin() + lo, below.begin() + mid,
+                        below.begin() + mid, below.begin() + hi, level.begin() + lo);
+            }
+            levels.push_back(std::vector<Corner>());
+            levels.back().swap(level);
+        }
+    }
+
+    // appends the indexes of the boxes inside q, in no particular order
+    void contained(const RangeBox &q, std::vector<size_t> &hits) const
+    {
+        RangeBox corners = q;
+        search(corners, q, false, hits);
+    }
+
+    // appends the indexes of the boxes holding q, in no particular order
+    void containing(const RangeBox &q, std::vector<size_t> &hits) const
+    {
+        RangeBox corners = {q.max_x - max_width, q.max_y - max_height, q.min_x, q.min_y};
+        search(corners, q, true, hits);
+    }
+
+private:
+    struct Corner {
+        double y;
+        size_t box;
+
+        bool operator<(const Corner &other) const {
+            return y < other.y;
+        }
+    };
+
+    struct ByMinX {
+        const std::vector<RangeBox> &boxes;
+        explicit ByMinX(const std::vector<RangeBox> &boxes) : boxes(boxes) {}
+        bool operator()(size_t a, size_t b) const {
+            return boxes[a].min_x < boxes[b].min_x;
+        }
+    };
+
+    // the boxes whose lower left corner lies in corners and whose upper
+    // right corner is dominated by q's (inside) or dominates it (holding)
+    void search(const RangeBox &corners, const RangeBox &q, bool holding,
+            std::vector<size_t> &hits) const
+    {
+        size_t lo = std::lower_bound(xs.begin(), xs.end(), corners.min_x) - xs.begin();
+        size_t hi = std::upper_bound(xs.begin(), xs.end(), corners.max_x) - xs.begin();
+
+        // the largest aligned blocks covering [lo, hi)
+        while (lo < hi) {
+            size_t k = 0;
+            while (k + 1 < levels.size() && lo % ((size_t) 2 << k) == 0
+                    && lo + ((size_t) 2 << k) <= hi) {
+                k++;
+            }
+            size_t width = (size_t) 1 << k;
+
+            const std::vector<Corner> &level = levels[k];
+            Corner first = {corners.min_y, 0};
+            std::vector<Corner>::const_iterator c =
+                std::lower_bound(level.begin() + lo, level.begin() + lo + width, first);
+            for (; c != level.begin() + lo + width && c->y <= corners.max_y; c++) {
+                const RangeBox &b = boxes[c->box];
+                bool hit = holding
+                    ? b.max_x >= q.max_x && b.max_y >= q.max_y
+                    : b.max_x <= q.max_x && b.max_y <= q.max_y;
+                if (hit) {
+                    hits.push_back(c->box);
+                }
+            }
+            lo += width;
+        }
+    }
+
+    const std::vector<RangeBox> &boxes;
+    double max_width;
+    double max_height;
+    std::vector<double> xs;
+    // levels[k]: the corners in x order, every aligned block of 2^k of
+    // them sorted by y
+    std::vector<std::vector<Corner> > levels;
+};
+
+#endif
@@ -0,0 +1,160 @@
+#ifndef RESQUE_SPATIAL_PREDICATES_H
+#define RESQUE_SPATIAL_PREDICATES_H
+
+#include <cstring>
+
+#include <geos/geom/Envelope.h>
+#include <geos/geom/Geometry.h>
+#include <geos/geom/prep/PreparedGeometry.h>
+
+// The spatial predicates understood by resque and map_contains. The first
+// geometry is the left argument: st_contains(a, b) is "a contains b".
+
+// Constants
+#define ST_INTERSECTS 1
+#define ST_TOUCHES 2
+#define ST_CROSSES 3
+#define ST_CONTAINS 4
+#define ST_ADJACENT 5
+#define ST_DISJOINT 6
+#define ST_EQUALS 7
+#define ST_DWITHIN 8
+#define ST_WITHIN 9
+#define ST_OVERLAPS 10
+
+// returns 0 for an unknown name
+inline int get_predicate(const char *name)
+{
+    if (strcmp(name, "st_intersects") == 0) {
+	    return ST_INTERSECTS;
+    }
+    else if (strcmp(name, "st_touches") == 0) {
+	    return ST_TOUCHES;
+    }
+    else if (strcmp(name, "st_crosses") == 0) {
+	    return ST_CROSSES;
+    }
+    else if (strcmp(name, "st_contains") == 0) {
+	    return ST_CONTAINS;
+    }
+    else if (strcmp(name, "st_adjacent") == 0) {
+	    return ST_ADJACENT;
+    }
+    else if (strcmp(name, "st_disjoint") == 0) {
+	    return ST_DISJOINT;
+    }
+    else if (strcmp(name, "st_equals") == 0) {
+	    return ST_EQUALS;
+    }
+    else if (strcmp(name, "st_dwithin") == 0) {
+	    return ST_DWITHIN;
+    }
+    else if (strcmp(name, "st_within") == 0) {
+	    return ST_WITHIN;
+    }
+    else if (strcmp(name, "st_overlaps") == 0) {
+	    return ST_OVERLAPS;
+    }
+    return 0;
+}
+
+inline bool is_symmetric(int predicate)
+{
+    // contains and within are the only predicates where swapping the
+    // arguments changes the answer
+    switch (predicate) {
+    case ST_CONTAINS:
+    case ST_WITHIN:
+        return false;
+    default:
+        return true;
+    }
+}
+
+// Necessary condition on the two envelopes; distance is the st_dwithin
+// distance.
+inline bool envelope_filter(const geos::geom::Envelope* env1, const geos::geom::Envelope* env2,
+        const int jp, double distance)
+{
+    switch (jp) {
+    case ST_CONTAINS:
+        return env1->contains(env2);
+    case ST_WITHIN:
+        return env2->contains(env1);
+    case ST_EQUALS:
+        return env1->equals(env2);
+    case ST_DWITHIN:
+        return env1->distance(env2) <= distance;
+    case ST_DISJOINT:
+        return true;
+    default:
+        return env1->intersects(env2);
+    }
+}
+
+inline bool join_with_predicate(const geos::geom::Geometry* geom1, const geos::geom::Geometry* geom2,
+        const geos::geom::Envelope* env1, const geos::geom::Envelope* env2,
+        const int jp, double distance)
+{
+    if (!envelope_filter(env1, env2, jp, distance)) {
+        return false;
+    }
+
+    switch (jp) {
+    case ST_INTERSECTS:
+        return geom1->intersects(geom2);
+    case ST_TOUCHES:
+        return geom1->touches(geom2);
+    case ST_CROSSES:
+        return geom1->crosses(geom2);
+    case ST_CONTAINS:
+        return geom1->contains(geom2);
+    case ST_ADJACENT:
+        return !geom1->disjoint(geom2);
+    case ST_DISJOINT:
+        return geom1->disjoint(geom2);
+    case ST_EQUALS:
+        return geom1->equals(geom2);
+    case ST_DWITHIN:
+        return geom1->isWithinDistance(geom2, distance);
+    case ST_WITHIN:
+        return geom1->within(geom2);
+    case ST_OVERLAPS:
+        return geom1->overlaps(geom2);
+    default:
+        return false;
+    }
+}
+
+// Same as join_with_predicate() with a prepared left geometry. The envelope
+// filter is left to the caller.
+inline bool prepared_predicate(const geos::geom::prep::PreparedGeometry* prep1,
+        const geos::geom::Geometry* geom2, const int jp, double distance)
+{
+    switch (jp) {
+    case ST_INTERSECTS:
+        return prep1->intersects(geom2);
+    case ST_TOUCHES:
+        return prep1->touches(geom2);
+    case ST_CROSSES:
+        return prep1->crosses(geom2);
+    case ST_CONTAINS:
+        return prep1->contains(geom2);
+    case ST_ADJACENT:
+        return prep1->intersects(geom2);
+    case ST_DISJOINT:
+        return prep1->disjoint(geom2);
+    case ST_EQUALS:
+        return prep1->getGeometry().equals(geom2);
+    case ST_DWITHIN:
+        return prep1->getGeometry().isWithinDistance(geom2, distance);
+    case ST_WITHIN:
+        return prep1->within(geom2);
+    case ST_OVERLAPS:
+        return prep1->overlaps(geom2);
+    default:
+        return false;
+    }
+}
+
+#endif
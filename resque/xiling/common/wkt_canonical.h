@@ -0,0 +1,291 @@
+#ifndef RESQUE_WKT_CANONICAL_H
+#define RESQUE_WKT_CANONICAL_H
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+
+#include "orientation.h"
+
+// Hash of the canonical form of a WKT geometry, read from the text without
+// building a geometry. Two topologically equal geometries hash the same:
+// every ring drops its repeated vertices and those in the middle of a
+// straight edge, runs counterclockwise as a shell and clockwise as a hole,
+// and starts at its smallest vertex; the holes of a polygon, the parts of
+// a multipolygon and the points of a multipoint are sorted. Different
+// geometries may still collide, so a match needs an exact test.
+
+typedef std::pair<double, double> canonical_point;
+typedef std::vector<canonical_point> canonical_ring;
+// the shell first, then the holes
+typedef std::vector<canonical_ring> canonical_polygon;
+
+struct wkt_cursor {
+    const char *p;
+    const char *end;
+
+    void skip_space() {
+        while (p < end && isspace((unsigned char) *p)) {
+            p++;
+        }
+    }
+
+    bool take(char c) {
+        skip_space();
+        if (p < end && *p == c) {
+            p++;
+            return true;
+        }
+        return false;
+    }
+
+    bool peek(char c) {
+        skip_space();
+        return p < end && *p == c;
+    }
+
+    bool number(double &value) {
+        skip_space();
+        char *next = NULL;
+        value = strtod(p, &next);
+        if (next == p || next > end || value != value || value == HUGE_VAL || value == -HUGE_VAL) {
+            return false;
+        }
+        p = next;
+        return true;
+    }
+
+    bool point(canonical_point &xy) {
+        return number(xy.first) && number(xy.second);
+    }
+
+    // ( x y, x y, ... )
+    bool points(canonical_ring &ring) {
+        if (!take('(')) {
+            return false;
+        }
+        do {
+            canonical_point xy;
+            if (!point(xy)) {
+                return false;
+            }
+            ring.push_back(xy);
+        } while (take(','));
+        return take(')');
+    }
+
+    bool polygon(canonical_polygon &poly) {
+        if (!take('(')) {
+            return false;
+        }
+        do {
+            poly.push_back(canonical_ring());
+            if (!points(poly.back())) {
+                return false;
+            }
+        } while (take(','));
+        return take(')');
+    }
+};
+
+// The turn a, b, c, see orient2d().
+inline int canonical_turn(const canonical_point &a, const canonical_point &b,
+        const canonical_point &c)
+{
+    return orient2d(a.first, a.second, b.first, b.second, c.first, c.second, false);
+}
+
+// Brings a closed ring to its canonical form; false when it is degenerate
+// or its form cannot be vouched for.
+inline bool canonical_ring_form(canonical_ring &ring, bool shell)
+{
+    if (ring.size() < 4 || ring.front() != ring.back()) {
+        return false;
+    }
+    ring.pop_back();
+
+    canonical_ring distinct;
+    for (size_t i = 0; i < ring.size(); i++) {
+        if (ring[i] != ring[(i + 1) % ring.size()]) {
+            distinct.push_back(ring[i]);
+        }
+    }
+
+    // a vertex on the straight line between its neighbours goes; removing
+    // it leaves its neighbours' turns alone, so one pass finds them all
+    canonical_ring corners;
+    size_t n = distinct.size();
+    for (size_t i = 0; i < n && n >= 3; i++) {
+        const canonical_point &a = distinct[(i + n - 1) % n];
+        const canonical_point &b = distinct[i];
+        const canonical_point &c = distinct[(i + 1) % n];
+        int turn = canonical_turn(a, b, c);
+        if (turn == TURN_UNKNOWN) {
+            return false;
+        }
+        if (turn == 0) {
+            // a spike, where the ring turns back, is no valid ring
+            if ((b.first - a.first) * (c.first - b.first)
+                    + (b.second - a.second) * (c.second - b.second) <= 0) {
+                return false;
+            }
+            continue;
+        }
+        corners.push_back(b);
+    }
+    if (corners.size() < 3) {
+        return false;
+    }
+
+    // twice the signed area, relative to the first corner
+    double area = 0.0;
+    double magnitude = 0.0;
+    const canonical_point &o = corners[0];
+    for (size_t i = 1; i + 1 < corners.size(); i++) {
+        double term = (corners[i].first - o.first) * (corners[i + 1].second - o.second)
+            - (corners[i].second - o.second) * (corners[i + 1].first - o.first);
+        area += term;
+        magnitude += fabs(term);
+    }
+    if (fabs(area) <= 1e-12 * magnitude) {
+        return false;
+    }
+    if ((area > 0) != shell) {
+        reverse(corners.begin(), corners.end());
+    }
+
+    // a ring touching itself has no single smallest vertex
+    size_t start = min_element(corners.begin(), corners.end()) - corners.begin();
+    if (count(corners.begin(), corners.end(), corners[start]) != 1) {
+        return false;
+    }
+    rotate(corners.begin(), corners.begin() + start, corners.end());
+    ring.swap(corners);
+    return true;
+}
+
+inline uint64_t canonical_fnv(uint64_t h, const void *data, size_t len)
+{
+    const unsigned char *bytes = (const unsigned char*) data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= bytes[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+inline uint64_t canonical_hash_points(uint64_t h, const canonical_ring &points)
+{
+    uint64_t n = points.size();
+    h = canonical_fnv(h, &n, sizeof(n));
+    for (size_t i = 0; i < points.size(); i++) {
+        // -0.0 is 0.0
+        double xy[2] = {points[i].first + 0.0, points[i].second + 0.0};
+        h = canonical_fnv(h, xy, sizeof(xy));
+    }
+    return h;
+}
+
+// The hash of the WKT at [pos, pos + len) of text. False for other types
+// than POINT, MULTIPOINT, POLYGON and MULTIPOLYGON, for EMPTY and Z/M
+// geometries, for anything unreadable or degenerate, and when floating
+// point cannot decide a turn of a ring: such a geometry has no canonical
+// form here and must be compared the slow way.
+inline bool wkt_canonical_hash(const std::string &text, size_t pos, size_t len, uint64_t &hash)
+{
+    if (pos + len > text.length()) {
+        return false;
+    }
+    wkt_cursor in;
+    in.p = text.data() + pos;
+    in.end = in.p + len;
+
+    in.skip_space();
+    std::string type;
+    while (in.p < in.end && isalpha((unsigned char) *in.p)) {
+        type += toupper((unsigned char) *in.p++);
+    }
+    // a Z, M or ZM tag, or EMPTY
+    in.skip_space();
+    if (in.p < in.end && isalpha((unsigned char) *in.p)) {
+        return false;
+    }
+
+    // a one part multi geometry equals its part
+    canonical_ring points;
+    std::vector<canonical_polygon> polygons;
+    bool ok;
+    if (type == "POINT") {
+        points.resize(1);
+        ok = in.take('(') && in.point(points[0]) && in.take(')');
+    }
+    else if (type == "MULTIPOINT") {
+        ok = in.take('(');
+        do {
+            canonical_point xy;
+            bool nested = in.take('(');
+            ok = ok && in.point(xy) && (!nested || in.take(')'));
+            points.push_back(xy);
+        } while (ok && in.take(','));
+        ok = ok && in.take(')');
+    }
+    else if (type == "POLYGON") {
+        polygons.resize(1);
+        ok = in.polygon(polygons[0]);
+    }
+    else if (type == "MULTIPOLYGON") {
+        ok = in.take('(');
+        do {
+            polygons.push_back(canonical_polygon());
+            ok = ok && in.polygon(polygons.back());
+        } while (ok && in.take(','));
+        ok = ok && in.take(')');
+    }
+    else {
+        return false;
+    }
+    in.skip_space();
+    if (!ok || in.p != in.end) {
+        return false;
+    }
+
+    uint64_t h = 14695981039346656037ULL;
+    if (polygons.empty()) {
+        sort(points.begin(), points.end());
+        points.erase(unique(points.begin(), points.end()), points.end());
+        h = canonical_fnv(h, "P", 1);
+        h = canonical_hash_points(h, points);
+        hash = h;
+        return true;
+    }
+
+    for (size_t k = 0; k < polygons.size(); k++) {
+        canonical_polygon &poly = polygons[k];
+        for (size_t r = 0; r < poly.size(); r++) {
+            if (!canonical_ring_form(poly[r], r == 0)) {
+                return false;
+            }
+        }
+        sort(poly.begin() + 1, poly.end());
+    }
+    sort(polygons.begin(), polygons.end());
+
+    h = canonical_fnv(h, "A", 1);
+    for (size_t k = 0; k < polygons.size(); k++) {
+        uint64_t rings = polygons[k].size();
+        h = canonical_fnv(h, &rings, sizeof(rings));
+        for (size_t r = 0; r < polygons[k].size(); r++) {
+            h = canonical_hash_points(h, polygons[k][r]);
+        }
+    }
+    hash = h;
+    return true;
+}
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef RESQUE_WKT_ENVELOPE_H
+#define RESQUE_WKT_ENVELOPE_H
+
+#include <string>
+#include <vector>
+#include <cctype>
+#include <cstdlib>
+
+// Bounding box of a WKT string, found by scanning its numbers without
+// building a geometry. Records whose box fails the filter never need a full
+// WKT parse.
+struct wkt_extent {
+    double min_x;
+    double min_y;
+    double max_x;
+    double max_y;
+    size_t num_points;
+};
+
+// Only 2-D coordinates are understood. Returns false for EMPTY geometries,
+// Z/M coordinates and anything unreadable; the caller then parses the
+// geometry the slow way.
+inline bool scan_wkt_envelope(const std::string &wkt, wkt_extent &ext)
+{
+    const char *p = wkt.c_str();
+    const char *end = p + wkt.length();
+    int ordinate = 0;   // position of the next number inside its coordinate
+    double x = 0.0;
+
+    ext.num_points = 0;
+
+    while (p < end) {
+        char c = *p;
+
+        if (isalpha((unsigned char) c)) {
+            while (p < end && isalpha((unsigned char) *p)) {
+                p++;
+            }
+            // POINT Z, POINTM, LINESTRING ZM, ... all end in Z or M; no 2-D
+            // type name does
+            char last = toupper((unsigned char) *(p - 1));
+            if (last == 'Z' || last == 'M') {
+                return false;
+            }
+            continue;
+        }
+
+        if (c == '(' || c == ')' || c == ',') {
+            if (ordinate == 1) {
+                return false;
+            }
+            ordinate = 0;
+            p++;
+            continue;
+        }
+
+        if (isspace((unsigned char) c)) {
+            p++;
+            continue;
+        }
+
+        char *next = NULL;
+        double value = strtod(p, &next);
+        if (next == p) {
+            return false;
+        }
+        p = next;
+
+        if (ordinate == 0) {
+            x = value;
+            ordinate = 1;
+        }
+        else if (ordinate == 1) {
+            if (ext.num_points == 0) {
+                ext.min_x = ext.max_x = x;
+                ext.min_y = ext.max_y = value;
+            }
+            else {
+                if (x < ext.min_x) ext.min_x = x;
+                if (x > ext.max_x) ext.max_x = x;
+                if (value < ext.min_y) ext.min_y = value;
+                if (value > ext.max_y) ext.max_y = value;
+            }
+            ext.num_points++;
+            ordinate = 2;
+        }
+        else {
+            // a third ordinate without a Z/M tag
+            return false;
+        }
+    }
+
+    return ordinate != 1 && ext.num_points > 0;
+}
+
+// Vertex count of the WKT at [pos, pos + len) of text without reading its
+// numbers: a coordinate ends at a comma or at the closing parenthesis of
+// its list, a comma or parenthesis right after ')' ends a ring or a part.
+inline size_t count_wkt_points(const std::string &text, size_t pos, size_t len)
+{
+    size_t points = 0;
+    char last = '(';
+
+    for (size_t i = pos; i < pos + len && i < text.length(); i++) {
+        char c = text[i];
+        if (c == ',' || c == ')') {
+            if (last != ')' && last != '(') {
+                points++;
+            }
+        }
+        if (!isspace((unsigned char) c)) {
+            last = c;
+        }
+    }
+    return points;
+}
+
+// Reads a precomputed box from four consecutive columns
+// fields[first] .. fields[first + 3] = xmin, ymin, xmax, ymax.
+inline bool read_mbr_columns(const std::vector<std::string> &fields, int first, wkt_extent &ext)
+{
+    if (first < 0 || (size_t) first + 3 >= fields.size()) {
+        return false;
+    }
+
+    double v[4];
+    for (int i = 0; i < 4; i++) {
+        const char *s = fields[first + i].c_str();
+        char *next = NULL;
+        v[i] = strtod(s, &next);
+        if (next == s) {
+            return false;
+        }
+    }
+
+    ext.min_x = v[0];
+    ext.min_y = v[1];
+    ext.max_x = v[2];
+    ext.max_y = v[3];
+    ext.num_points = 0;
+    return ext.min_x <= ext.max_x && ext.min_y <= ext.max_y;
+}
+
+#endif
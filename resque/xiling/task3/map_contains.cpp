@@ -2,9 +2,16 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <algorithm>
 #include <cmath>
 #include <stdlib.h> 
+#include <stdint.h>
 #include <fstream>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 
 // geos
@@ -12,20 +19,36 @@
 #include <geos/geom/GeometryFactory.h>
 #include <geos/geom/Geometry.h>
 #include <geos/geom/Point.h>
+#include <geos/geom/LinearRing.h>
+#include <geos/geom/CoordinateArraySequence.h>
+#include <geos/geom/prep/PreparedGeometry.h>
+#include <geos/geom/prep/PreparedGeometryFactory.h>
 #include <geos/io/WKTReader.h>
+#include <geos/util/GEOSException.h>
 #include <geos/opBuffer.h>
 
 // spatial index
 #include <spatialindex/SpatialIndex.h>
 
+#include "point_locator.h"
+#include "spatial_predicates.h"
+#include "wkt_envelope.h"
+
 using namespace std;
 using namespace geos;
 using namespace geos::io;
 using namespace geos::geom;
+using namespace geos::geom::prep;
 using namespace geos::operation::buffer; 
 
 #define OSM_SRID 4326
 
+// binary query files start with this tag, see parseBinaryQueries()
+#define QUERY_FILE_MAGIC "RQW1"
+
+// input records read and filtered together
+#define BATCH_SIZE 4096
+
 // data type declaration 
 typedef map<string, map<int, Geometry*> > polymap;
 typedef map<string,map<int, string> > datamap;
@@ -34,6 +57,24 @@ polymap polydata;
 datamap data;
 vector<Geometry*> query_polygon_set;
 
+// query_index holds the envelope of query_polygon_set[i] under id i,
+// prepared_query_set[i] is its prepared geometry and query_locators[i] 
+// answers point records
+vector<const PreparedGeometry*> prepared_query_set;
+vector<PointLocator*> query_locators;
+SpatialIndex::IStorageManager *query_storage = NULL;
+SpatialIndex::ISpatialIndex *query_index = NULL;
+
+// collects the ids of the query polygons whose envelope is hit
+class QueryVisitor : public SpatialIndex::IVisitor {
+public:
+    vector<SpatialIndex::id_type> hits;
+
+    void visitNode(const SpatialIndex::INode &n) {}
+    void visitData(const SpatialIndex::IData &d) { hits.push_back(d.getIdentifier()); }
+    void visitData(std::vector<const SpatialIndex::IData*> &v) {}
+};
+
 const string bar= "|";
 const string tab = "\t";
 const string comma = ",";
@@ -41,32 +82,92 @@ const string sep =  "\x02"; // ctrl+a
 
 int shape_idx_1 = -1;
 int shape_idx_2 = -1;
+// first of the xmin, ymin, xmax, ymax columns, counted like shape_idx_1;
+// -1 scans the WKT text for the box instead
+int mbr_idx_1 = -1;
+
+// a record is selected when PREDICATE(query polygon, record) holds for any
+// of the query polygons
+int PREDICATE = ST_CONTAINS;
+double dwithin_distance = 10.0;
 
 bool readQueryPolygon(string query_polygon);
-bool filterByContains();
+bool readQueryFile(const char *path);
+bool parseWKTQueries(const char *buf, size_t len);
+bool parseBinaryQueries(const char *buf, size_t len);
+bool buildQueryIndex();
+bool filterRecords();
+void filterBatch(const vector<string> &batch, WKTReader *wkt_reader, string &out);
 
-vector<string> split(string str, string separator);
+vector<string> split(const string &str, const string &separator);
 
 int main(int argc, char** argv)
 {
-    //cerr << endl;
-    //cerr << "argv[0] = " << argv[0] << endl;
-    //cerr << "argv[1] = " << argv[1] << endl;
-    //cerr << "argv[2] = " << argv[2] << endl;
+    static struct option long_options[] = {
+        {"query-file",  required_argument, 0, 'f'},
+        {"mbr-columns", required_argument, 0, 'm'},
+        {"predicate",   required_argument, 0, 'p'},
+        {"distance",    required_argument, 0, 'd'},
+        {0, 0, 0, 0}
+    };
+
+    const char *query_file = NULL;
+    int c;
+    while ((c = getopt_long(argc, argv, "f:m:p:d:", long_options, NULL)) != -1) {
+        switch (c) {
+        case 'f':
+            query_file = optarg;
+            break;
+        case 'm':
+            mbr_idx_1 = strtol(optarg, NULL, 10);
+            break;
+        case 'p':
+            PREDICATE = get_predicate(optarg);
+            if (PREDICATE == 0) {
+                cerr << "wrong predicate " << optarg << ", return" << endl;
+                return 1;
+            }
+            break;
+        case 'd':
+            dwithin_distance = strtod(optarg, NULL);
+            break;
+        default:
+            return 1;
+        }
+    }
 
-    if (argc < 3) {
+    if (argc - optind < (query_file == NULL ? 2 : 1)) {
         cerr << "usage: map_contains polygon [shape_idx 1]" << endl;
+        cerr << "       map_contains --query-file [file] [shape_idx 1]" << endl;
+        cerr << "  --predicate [st_xxx]  select records r with st_xxx(query polygon, r), "
+             << "default st_contains" << endl;
+        cerr << "  --distance [d]       st_dwithin distance, default " << dwithin_distance << endl;
+        cerr << "  --mbr-columns [idx]  xmin, ymin, xmax, ymax are precomputed "
+             << "in columns idx..idx+3" << endl;
 	    return 0;
     }
 
-    shape_idx_1 = strtol(argv[2], NULL, 10);
+    if (query_file == NULL) {
+        shape_idx_1 = strtol(argv[optind + 1], NULL, 10);
+
+        string query_polygon = argv[optind];
+        if (!readQueryPolygon(query_polygon)) {
+            return 1;
+        }
+    }
+    else {
+        shape_idx_1 = strtol(argv[optind], NULL, 10);
+
+        if (!readQueryFile(query_file)) {
+            return 1;
+        }
+    }
 
-    string query_polygon = argv[1];
-    if (!readQueryPolygon(query_polygon)) {
+    if (!buildQueryIndex()) {
         return 1;
     }
 
-    if (!filterByContains()) {
+    if (!filterRecords()) {
 	    return 1;
     }
 
@@ -102,56 +203,348 @@ bool readQueryPolygon(string query_polygon)
     return true;
 }
 
-bool filterByContains()
+// The query file is shipped through the distributed cache; it is mapped 
+// and parsed once. A file starting with QUERY_FILE_MAGIC is binary, 
+// anything else is read as one WKT polygon per line.
+bool readQueryFile(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        cerr << "cannot open query file " << path << endl;
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        cerr << "query polygon file is empty" << endl;
+        close(fd);
+        return false;
+    }
+
+    size_t len = st.st_size;
+    void *addr = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        cerr << "cannot map query file " << path << endl;
+        return false;
+    }
+
+    const char *buf = (const char *) addr;
+    bool success = false;
+    try {
+        if (len >= 4 && memcmp(buf, QUERY_FILE_MAGIC, 4) == 0) {
+            success = parseBinaryQueries(buf, len);
+        }
+        else {
+            success = parseWKTQueries(buf, len);
+        }
+    }
+    catch (geos::util::GEOSException& e) {
+        cerr << "bad query polygon in " << path << ": " << e.what() << endl;
+        success = false;
+    }
+
+    munmap(addr, len);
+    //cerr << "query_polygon_set size = " << query_polygon_set.size() << endl;
+    return success;
+}
+
+bool parseWKTQueries(const char *buf, size_t len)
+{
+    GeometryFactory *gf = new GeometryFactory(new PrecisionModel(), OSM_SRID);
+    WKTReader *wkt_reader = new WKTReader(gf);
+
+    const char *end = buf + len;
+    const char *line = buf;
+
+    while (line < end) {
+        const char *eol = (const char *) memchr(line, '\n', end - line);
+        if (eol == NULL) {
+            eol = end;
+        }
+
+        const char *last = eol;
+        if (last > line && *(last - 1) == '\r') {
+            last--;
+        }
+        if (last > line) {
+            query_polygon_set.push_back(wkt_reader->read(string(line, last - line)));
+        }
+        line = eol + 1;
+    }
+
+    return !query_polygon_set.empty();
+}
+
+bool readUInt32(const char *&p, const char *end, uint32_t &value)
+{
+    if (end - p < (ptrdiff_t) sizeof(uint32_t)) {
+        return false;
+    }
+    memcpy(&value, p, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+    return true;
+}
+
+// Binary layout, native byte order (see pack_windows.py):
+//   "RQW1" uint32 polygon_count
+//   per polygon: uint32 ring_count, the shell first, then the holes
+//   per ring:    uint32 point_count, point_count x (double x, double y)
+bool parseBinaryQueries(const char *buf, size_t len)
+{
+    GeometryFactory *gf = new GeometryFactory(new PrecisionModel(), OSM_SRID);
+
+    const char *end = buf + len;
+    const char *p = buf + 4;
+    uint32_t count = 0;
+
+    if (!readUInt32(p, end, count)) {
+        cerr << "truncated query file" << endl;
+        return false;
+    }
+
+    for (uint32_t c = 0; c < count; c++) {
+        uint32_t rings = 0;
+        if (!readUInt32(p, end, rings) || rings == 0) {
+            cerr << "truncated query file at polygon " << c << endl;
+            return false;
+        }
+
+        LinearRing *shell = NULL;
+        vector<Geometry*> *holes = new vector<Geometry*>();
+
+        for (uint32_t r = 0; r < rings; r++) {
+            uint32_t points = 0;
+            if (!readUInt32(p, end, points) 
+                    || (size_t) (end - p) < points * 2 * sizeof(double)) {
+                cerr << "truncated query file at polygon " << c << endl;
+                return false;
+            }
+
+            vector<Coordinate> *coords = new vector<Coordinate>(points);
+            for (uint32_t k = 0; k < points; k++) {
+                double xy[2];
+                memcpy(xy, p, sizeof(xy));
+                p += sizeof(xy);
+                (*coords)[k] = Coordinate(xy[0], xy[1]);
+            }
+
+            LinearRing *ring = gf->createLinearRing(new CoordinateArraySequence(coords));
+            if (r == 0) {
+                shell = ring;
+            }
+            else {
+                holes->push_back(ring);
+            }
+        }
+
+        query_polygon_set.push_back(gf->createPolygon(shell, holes));
+    }
+
+    return !query_polygon_set.empty();
+}
+
+bool buildQueryIndex()
+{
+    try {
+        SpatialIndex::id_type index_id;
+        query_storage = SpatialIndex::StorageManager::createNewMemoryStorageManager();
+        query_index = SpatialIndex::RTree::createNewRTree(*query_storage, 0.7, 100, 100, 2, 
+                SpatialIndex::RTree::RV_RSTAR, index_id);
+
+        for (size_t i = 0; i < query_polygon_set.size(); i++) {
+            const Envelope *env = query_polygon_set[i]->getEnvelopeInternal();
+            double low[2] = {env->getMinX(), env->getMinY()};
+            double high[2] = {env->getMaxX(), env->getMaxY()};
+            SpatialIndex::Region region(low, high, 2);
+
+            query_index->insertData(0, NULL, region, i);
+            prepared_query_set.push_back(PreparedGeometryFactory::prepare(query_polygon_set[i]));
+            query_locators.push_back(new PointLocator(query_polygon_set[i]));
+        }
+    }
+    catch (Tools::Exception& e) {
+        std::cerr << "******ERROR******" << std::endl;
+        std::string s = e.what();
+        std::cerr << s << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Selects the records of stdin that satisfy PREDICATE against at least one
+// query polygon. Records are handled in batches of BATCH_SIZE.
+bool filterRecords()
 {
     string input_line;
-    vector<string> fields;
+    vector<string> batch;
+    string out;
 
     GeometryFactory *gf = new GeometryFactory(new PrecisionModel(),OSM_SRID);
     WKTReader *wkt_reader = new WKTReader(gf);
-    Geometry *poly = NULL; 
 
-    //int index = 0;
+    batch.reserve(BATCH_SIZE);
     while (cin && getline(cin, input_line) && !cin.eof()) {
-        
-        fields = split(input_line, tab);
-
-        //cerr << "input_line: " << input_line << endl;
-        //cerr << "fields size = " << fields.size() << endl;
-        //cerr << "fields[0] = " << fields[0] << endl; 
-        //cerr << "fields[1] = " << fields[1] << endl; 
-        //cerr << "fields[2] = " << fields[2] << endl; 
-
-        poly = wkt_reader->read(fields[shape_idx_1+1]);
-
-        for (vector<Geometry *>::iterator iter = query_polygon_set.begin(); iter != query_polygon_set.end(); iter++) {
-            if ((*iter)->contains(poly)) {
-                cout << input_line << endl;
-                //index++;
-                break;
-            }
+        batch.push_back(input_line);
+
+        if (batch.size() == BATCH_SIZE) {
+            filterBatch(batch, wkt_reader, out);
+            cout << out;
+            batch.clear();
+            out.clear();
         }
-        fields.clear();
-        cerr.flush();
     }
-    //cerr << "index = " << index << endl;
+
+    if (!batch.empty()) {
+        filterBatch(batch, wkt_reader, out);
+        cout << out;
+    }
+    cout.flush();
     return true;
 }
 
-vector<string> split(string str, string separator)  
+// The whole batch is probed against the query index first; the candidate 
+// (query polygon, record) pairs are then refined grouped by query polygon, 
+// so each prepared geometry stays hot while its records are tested. Point
+// records are located in one batch per query polygon without being parsed.
+// Selected records are appended to out in input order.
+void filterBatch(const vector<string> &batch, WKTReader *wkt_reader, string &out)
+{
+    size_t n = batch.size();
+    vector<string> wkts(n);
+    vector<Envelope> envs(n);
+    vector<Geometry*> polys(n, (Geometry*) NULL);
+    vector<bool> selected(n, false);
+    vector<bool> points(n, false);
+    vector<pair<SpatialIndex::id_type, size_t> > candidates;
+
+    vector<string> fields;
+    wkt_extent ext;
+
+    for (size_t r = 0; r < n; r++) {
+        fields = split(batch[r], tab);
+        wkts[r] = fields[shape_idx_1+1];
+
+        // the record's box comes from its MBR columns or a scan of the WKT
+        // text; the geometry itself is only parsed for a candidate
+        bool have_box = mbr_idx_1 >= 0 
+            ? read_mbr_columns(fields, mbr_idx_1 + 1, ext) 
+            : scan_wkt_envelope(wkts[r], ext);
+        if (have_box) {
+            envs[r].init(ext.min_x, ext.max_x, ext.min_y, ext.max_y);
+        }
+        else {
+            polys[r] = wkt_reader->read(wkts[r]);
+            envs[r] = *polys[r]->getEnvelopeInternal();
+        }
+        points[r] = !envs[r].isNull() && envs[r].getWidth() == 0 && envs[r].getHeight() == 0
+            && is_point_wkt(wkts[r]);
+
+        // every query polygon is a candidate for st_disjoint
+        if (PREDICATE == ST_DISJOINT) {
+            for (size_t q = 0; q < query_polygon_set.size(); q++) {
+                candidates.push_back(make_pair((SpatialIndex::id_type) q, r));
+            }
+            continue;
+        }
+
+        Envelope probe(envs[r]);
+        if (PREDICATE == ST_DWITHIN) {
+            probe.expandBy(dwithin_distance);
+        }
+        double low[2] = {probe.getMinX(), probe.getMinY()};
+        double high[2] = {probe.getMaxX(), probe.getMaxY()};
+        SpatialIndex::Region region(low, high, 2);
+        QueryVisitor visitor;
+        query_index->intersectsWithQuery(region, visitor);
+
+        for (size_t i = 0; i < visitor.hits.size(); i++) {
+            candidates.push_back(make_pair(visitor.hits[i], r));
+        }
+    }
+
+    sort(candidates.begin(), candidates.end());
+
+    vector<size_t> batch_points;
+    vector<double> xs;
+    vector<double> ys;
+    vector<int> locations;
+    bool fast = point_fast_path(PREDICATE);
+
+    for (size_t c = 0; c < candidates.size(); ) {
+        SpatialIndex::id_type id = candidates[c].first;
+        const PointLocator *locator = fast && query_locators[id]->valid() ? query_locators[id] : NULL;
+        batch_points.clear();
+        xs.clear();
+        ys.clear();
+
+        for (; c < candidates.size() && candidates[c].first == id; c++) {
+            size_t r = candidates[c].second;
+
+            if (selected[r] || !envelope_filter(query_polygon_set[id]->getEnvelopeInternal(), 
+                        &envs[r], PREDICATE, dwithin_distance)) {
+                continue;
+            }
+            if (locator != NULL && points[r]) {
+                batch_points.push_back(r);
+                xs.push_back(envs[r].getMinX());
+                ys.push_back(envs[r].getMinY());
+                continue;
+            }
+            if (polys[r] == NULL) {
+                polys[r] = wkt_reader->read(wkts[r]);
+            }
+            if (prepared_predicate(prepared_query_set[id], polys[r], PREDICATE, dwithin_distance)) {
+                selected[r] = true;
+            }
+        }
+
+        if (!batch_points.empty()) {
+            locations.resize(batch_points.size());
+            locator->locate(&xs[0], &ys[0], batch_points.size(), &locations[0]);
+            for (size_t k = 0; k < batch_points.size(); k++) {
+                size_t r = batch_points[k];
+                bool hit;
+                if (locations[k] != POINT_UNKNOWN) {
+                    hit = point_predicate(PREDICATE, false, locations[k]);
+                }
+                else {
+                    // too close to an edge to tell, GEOS decides
+                    if (polys[r] == NULL) {
+                        polys[r] = wkt_reader->read(wkts[r]);
+                    }
+                    hit = prepared_predicate(prepared_query_set[id], polys[r], PREDICATE, dwithin_distance);
+                }
+                if (hit) {
+                    selected[r] = true;
+                }
+            }
+        }
+    }
+
+    for (size_t r = 0; r < n; r++) {
+        if (selected[r]) {
+            out += batch[r];
+            out += '\n';
+        }
+        delete polys[r];
+    }
+}
+
+// single pass: the old version copied the rest of the string after every cut
+vector<string> split(const string &str, const string &separator)  
 {  
     vector<string> result;  
-    int cutAt;  
+    size_t start = 0;
+    size_t cutAt;  
 
-    while((cutAt = str.find_first_of(separator)) != str.npos) {  
-        if(cutAt >= 0) {  
-            result.push_back(str.substr(0, cutAt));  
-        }  
-        str = str.substr(cutAt + 1);  
+    while ((cutAt = str.find_first_of(separator, start)) != string::npos) {  
+        result.push_back(str.substr(start, cutAt - start));  
+        start = cutAt + 1;  
     }  
 
-    if(str.length() > 0) {  
-        result.push_back(str);  
+    if (start < str.length()) {  
+        result.push_back(str.substr(start));  
     }  
     return result;  
 }  
@@ -13,6 +13,17 @@ index=${3}
 
 hadoop dfs -rmr ${hdfsoutdir}
 
-hadoop jar ${hadooppath}/contrib/streaming/hadoop-streaming-*.jar -mapper 'cat - ' -reducer 'map_contains "'"${query_polygon}"'" '${index}'' -file /bin/cat -file ${enginepath} -input ${input} -output ${hdfsoutdir} -verbose -cmdenv LD_LIBRARY_PATH=/usr/local/lib:$LD_LIBRARY_PATH -jobconf mapred.job.name="map_contains"
+# a local file of query polygons (WKT lines or pack_windows.py output) is 
+# shipped with the job instead of being passed on the command line
+if [ -f "${query_polygon}" ]
+then
+    reducer='map_contains --query-file '$(basename ${query_polygon})' '${index}''
+    queryfile="-file ${query_polygon}"
+else
+    reducer='map_contains "'"${query_polygon}"'" '${index}''
+    queryfile=""
+fi
+
+hadoop jar ${hadooppath}/contrib/streaming/hadoop-streaming-*.jar -mapper 'cat - ' -reducer "${reducer}" -file /bin/cat -file ${enginepath} ${queryfile} -input ${input} -output ${hdfsoutdir} -verbose -cmdenv LD_LIBRARY_PATH=/usr/local/lib:$LD_LIBRARY_PATH -jobconf mapred.job.name="map_contains"
 
 make clean
@@ -0,0 +1,44 @@
+#! /usr/bin/python
+
+# Packs WKT query polygons (one per line, as accepted by
+# map_contains --query-file) into the binary query file format:
+#
+#   "RQW1" uint32 polygon_count
+#   per polygon: uint32 ring_count, the shell first, then the holes
+#   per ring:    uint32 point_count, point_count x (double x, double y)
+#
+# usage: pack_windows.py < windows.wkt > windows.bin
+
+import re
+import struct
+import sys
+
+
+def rings(wkt):
+    body = wkt.strip()
+    if not body.upper().startswith("POLYGON"):
+        raise ValueError("not a POLYGON: " + body[:40])
+    return re.findall(r"\(([^()]*)\)", body)
+
+
+def pack(ring):
+    points = [p.split() for p in ring.split(",")]
+    out = struct.pack("=I", len(points))
+    for p in points:
+        out += struct.pack("=dd", float(p[0]), float(p[1]))
+    return out
+
+
+def main():
+    polygons = [line for line in sys.stdin if line.strip()]
+
+    out = getattr(sys.stdout, "buffer", sys.stdout)
+    out.write(b"RQW1" + struct.pack("=I", len(polygons)))
+    for polygon in polygons:
+        rs = rings(polygon)
+        out.write(struct.pack("=I", len(rs)))
+        for r in rs:
+            out.write(pack(r))
+
+if __name__ == '__main__':
+    main()
@@ -31,4 +31,59 @@ else
 fi
 
 
+# test map contains with the query polygons read from a file
+
+echo -n "TEST: Map Contains Query File --- "
+
+cat ${dir}/data1.tsv | ./map_contains --query-file ${dir}/query_polygon.tsv 9 > ${dir}/map_contains_output.tsv
+
+diff ${dir}/map_contains_output.tsv ${dir}/map_contains_standard.tsv >/dev/null 2>&1
+
+if [ $? -ne 0 ]
+then
+    echo "failed."
+else
+    echo "passed."
+    rm ${dir}/map_contains_output.tsv
+fi
+
+
+# test map contains with a binary query file
+
+echo -n "TEST: Map Contains Binary Query File --- "
+
+./pack_windows.py < ${dir}/query_polygon.tsv > ${dir}/query_polygon.bin
+cat ${dir}/data1.tsv | ./map_contains --query-file ${dir}/query_polygon.bin 9 > ${dir}/map_contains_output.tsv
+
+diff ${dir}/map_contains_output.tsv ${dir}/map_contains_standard.tsv >/dev/null 2>&1
+
+if [ $? -ne 0 ]
+then
+    echo "failed."
+else
+    echo "passed."
+    rm ${dir}/map_contains_output.tsv ${dir}/query_polygon.bin
+fi
+
+
+# test the predicate option: against a single query polygon, st_intersects
+# and st_disjoint split the input in two
+
+echo -n "TEST: Map Contains Predicates --- "
+
+head -1 ${dir}/query_polygon.tsv > ${dir}/query_single.tsv
+cat ${dir}/data1.tsv | ./map_contains --query-file ${dir}/query_single.tsv --predicate st_intersects 9 > ${dir}/map_intersects_output.tsv
+cat ${dir}/data1.tsv | ./map_contains --query-file ${dir}/query_single.tsv --predicate st_disjoint 9 > ${dir}/map_disjoint_output.tsv
+
+cat ${dir}/map_intersects_output.tsv ${dir}/map_disjoint_output.tsv | sort | diff - <(sort ${dir}/data1.tsv) >/dev/null 2>&1
+
+if [ $? -ne 0 ]
+then
+    echo "failed."
+else
+    echo "passed."
+    rm ${dir}/query_single.tsv ${dir}/map_intersects_output.tsv ${dir}/map_disjoint_output.tsv
+fi
+
+
 make clean
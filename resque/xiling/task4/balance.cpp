@@ -0,0 +1,192 @@
+#include <iostream>
+#include <vector>
+#include <map>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <stdlib.h>
+#include <stdint.h>
+#include <getopt.h>
+
+// The balance command: reads the statistics sidecars written by
+// resque --stats and assigns the tiles to reducers by their vertices rather
+// than by the hash of their key. A reducer's runtime follows the vertices
+// of its tiles; hash partitioning ignores them and leaves some reducers
+// with many times the work of others.
+//
+// The manifest has one line per tile
+//
+//     tile reducer routing_key cost
+//
+// The map side emits routing_key in place of the tile key: the hash
+// partitioner of the streaming job sends it to the assigned reducer, and
+// resque joins it like any other tile key.
+
+using namespace std;
+
+const string tab = "\t";
+
+struct TileLoad {
+    string tile;
+    double cost;
+    int reducer;
+
+    // the most expensive tile first, ties by name
+    bool operator<(const TileLoad &other) const {
+        return cost > other.cost || (cost == other.cost && tile < other.tile);
+    }
+};
+
+// org.apache.hadoop.io.Text.hashCode() over the UTF-8 bytes, as the
+// HashPartitioner of a streaming job sees the key
+int text_hash(const string &key)
+{
+    int32_t hash = 1;
+    for (size_t i = 0; i < key.length(); i++) {
+        hash = (int32_t) ((uint32_t) hash * 31 + (uint32_t) (int32_t) (signed char) key[i]);
+    }
+    return hash;
+}
+
+int hash_partition(const string &key, int reducers)
+{
+    return (text_hash(key) & 0x7fffffff) % reducers;
+}
+
+// the tile itself when it already hashes to reducer, otherwise the first
+// tile#n that does
+string routing_key(const string &tile, int reducer, int reducers)
+{
+    if (hash_partition(tile, reducers) == reducer) {
+        return tile;
+    }
+    for (long n = 0; ; n++) {
+        std::stringstream key;
+        key << tile << '#' << n;
+        if (hash_partition(key.str(), reducers) == reducer) {
+            return key.str();
+        }
+    }
+}
+
+// Sums count x avg_vertices over the datasets of every tile.
+bool read_stats(const char *path, map<string, double> &costs)
+{
+    ifstream in(path);
+    if (!in) {
+        cerr << "cannot open statistics file " << path << endl;
+        return false;
+    }
+
+    string line;
+    long n = 0;
+    while (getline(in, line)) {
+        n++;
+        std::istringstream fields(line);
+        string tile;
+        int database_id;
+        long count;
+        long vertices;
+        double avg_vertices;
+        if (!getline(fields, tile, '\t') || !(fields >> database_id >> count >> vertices >> avg_vertices)) {
+            cerr << path << ":" << n << ": not a resque --stats line" << endl;
+            return false;
+        }
+        costs[tile] += count * avg_vertices;
+    }
+    return true;
+}
+
+void usage()
+{
+    cerr << "usage: balance [options] stats_file [stats_file...]" << endl;
+    cerr << "options:" << endl;
+    cerr << "  -r, --reducers [n]     number of reduce tasks (required)" << endl;
+    cerr << "  -o, --output [file]    where the manifest goes, stdout by default" << endl;
+    cerr << "the loads of the largest reducer with hash partitioning and with the "
+         << "manifest, and the mean load, go to stderr as" << endl;
+    cerr << "  hash_max balanced_max mean straggler_reduction" << endl;
+}
+
+int main(int argc, char** argv)
+{
+    static struct option long_options[] = {
+        {"reducers",        required_argument, 0, 'r'},
+        {"output",          required_argument, 0, 'o'},
+        {0, 0, 0, 0}
+    };
+
+    int reducers = 0;
+    const char *output = NULL;
+
+    int c;
+    while ((c = getopt_long(argc, argv, "r:o:", long_options, NULL)) != -1) {
+        switch (c) {
+        case 'r':
+            reducers = strtol(optarg, NULL, 10);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (reducers < 1 || optind == argc) {
+        usage();
+        return 1;
+    }
+
+    map<string, double> costs;
+    for (int i = optind; i < argc; i++) {
+        if (!read_stats(argv[i], costs)) {
+            return 1;
+        }
+    }
+
+    vector<TileLoad> tiles;
+    for (map<string, double>::iterator t = costs.begin(); t != costs.end(); t++) {
+        TileLoad load;
+        load.tile = t->first;
+        load.cost = t->second;
+        tiles.push_back(load);
+    }
+
+    // longest processing time first: each tile, the most expensive first,
+    // goes to the least loaded reducer
+    sort(tiles.begin(), tiles.end());
+    vector<double> loads(reducers, 0.0);
+    vector<double> hash_loads(reducers, 0.0);
+    double total = 0.0;
+    for (size_t i = 0; i < tiles.size(); i++) {
+        int least = min_element(loads.begin(), loads.end()) - loads.begin();
+        tiles[i].reducer = least;
+        loads[least] += tiles[i].cost;
+        hash_loads[hash_partition(tiles[i].tile, reducers)] += tiles[i].cost;
+        total += tiles[i].cost;
+    }
+
+    ofstream file;
+    if (output != NULL) {
+        file.open(output);
+    }
+    ostream &out = output != NULL ? file : cout;
+    for (size_t i = 0; i < tiles.size(); i++) {
+        out << tiles[i].tile << tab << tiles[i].reducer
+            << tab << routing_key(tiles[i].tile, tiles[i].reducer, reducers)
+            << tab << (long) tiles[i].cost << '\n';
+    }
+    out.flush();
+    if (!out) {
+        cerr << "cannot write the manifest" << endl;
+        return 1;
+    }
+
+    double hash_max = *max_element(hash_loads.begin(), hash_loads.end());
+    double balanced_max = *max_element(loads.begin(), loads.end());
+    cerr << (long) hash_max << tab << (long) balanced_max << tab << (long) (total / reducers)
+         << tab << (balanced_max > 0 ? hash_max / balanced_max : 1.0) << endl;
+    return 0;
+}
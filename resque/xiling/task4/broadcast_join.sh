@@ -0,0 +1,25 @@
+#! /bin/bash
+
+# map side spatial join: the small dataset is shipped to every mapper and
+# joined there against the large one, the job has no reduce phase
+
+make -f makefile
+
+hadooppath=/usr/local/hadoop-0.20.2
+enginepath=/Users/hixiaoxi/Documents/GitHub/hivesp/resque/xiling/task4/resque
+
+hdfsoutdir=/user/hixiaoxi/task4/output
+
+small=${1}
+input=${2}
+predicate=${3}
+index_1=${4}
+index_2=${5}
+
+hadoop dfs -rmr ${hdfsoutdir}
+
+mapper='resque --broadcast '$(basename ${small})' '${predicate}' '${index_1}' '${index_2}''
+
+hadoop jar ${hadooppath}/contrib/streaming/hadoop-streaming-*.jar -mapper "${mapper}" -numReduceTasks 0 -file ${enginepath} -file ${small} -input ${input} -output ${hdfsoutdir} -verbose -cmdenv LD_LIBRARY_PATH=/usr/local/lib:$LD_LIBRARY_PATH -jobconf mapred.job.name="broadcast_join"
+
+make clean
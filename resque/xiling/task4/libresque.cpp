@@ -0,0 +1,529 @@
+#include <iostream>
+#include <fstream>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <cstring>
+#include <iterator>
+#include <vector>
+
+// geos
+#include <geos/geom/Coordinate.h>
+#include <geos/geom/CoordinateArraySequence.h>
+#include <geos/geom/GeometryFactory.h>
+#include <geos/geom/LinearRing.h>
+#include <geos/geom/Polygon.h>
+
+#include "libresque.h"
+#include "resque_engine.h"
+
+using namespace std;
+using namespace geos;
+using namespace geos::geom;
+
+// The C API over resque_engine.h. No C++ exception leaves this file.
+
+// Sets join->error from the exception being handled, for the catch (...)
+// of every entry point.
+static void set_error(resque_join *join)
+{
+    try {
+        throw;
+    }
+    catch (std::bad_alloc&) {
+        join->error = "out of memory";
+    }
+    catch (std::exception& e) {
+        join->error = e.what();
+    }
+    catch (Tools::Exception& e) {
+        join->error = e.what();
+    }
+    catch (...) {
+        join->error = "unknown error";
+    }
+}
+
+static wkt_extent* mbr_extent(const double *mbr, wkt_extent &ext)
+{
+    if (mbr == NULL) {
+        return NULL;
+    }
+    ext.min_x = mbr[0];
+    ext.min_y = mbr[1];
+    ext.max_x = mbr[2];
+    ext.max_y = mbr[3];
+    ext.num_points = 0;
+    return &ext;
+}
+
+static int add(resque_join *join, const char *tile, int database_id, int object_id,
+        SpatialObject *obj)
+{
+    if (obj == NULL) {
+        return -1;
+    }
+    return add_object(join, tile, database_id, object_id, obj);
+}
+
+int resque_abi_version(void)
+{
+    return RESQUE_ABI_VERSION;
+}
+
+resque_join *resque_new(const char *predicates, int num_datasets)
+{
+    if (predicates == NULL || num_datasets < 1) {
+        return NULL;
+    }
+
+    // st_a,st_b,... chains the datasets: 1 st_a 2, 2 st_b 3, ...
+    vector<int> jps;
+    string names = predicates;
+    size_t start = 0;
+    while (start <= names.length()) {
+        size_t end = names.find(',', start);
+        if (end == string::npos) {
+            end = names.length();
+        }
+        int jp = get_predicate(names.substr(start, end - start).c_str());
+        if (jp == 0) {
+            return NULL;
+        }
+        jps.push_back(jp);
+        start = end + 1;
+    }
+
+    // a single predicate applies between every pair of neighbouring datasets
+    size_t num_edges = num_datasets > 1 ? num_datasets - 1 : 1;
+    if (jps.size() == 1) {
+        jps.resize(num_edges, jps[0]);
+    }
+    if (jps.size() != num_edges) {
+        return NULL;
+    }
+
+    try {
+        return create_join(num_datasets, jps);
+    }
+    catch (...) {
+        return NULL;
+    }
+}
+
+void resque_free(resque_join *join)
+{
+    if (join != NULL) {
+        destroy_join(join);
+    }
+}
+
+const char *resque_error(const resque_join *join)
+{
+    return join->error.c_str();
+}
+
+int resque_set_distance(resque_join *join, double distance)
+{
+    join->dwithin_distance = distance;
+    return 0;
+}
+
+int resque_set_self_join(resque_join *join, int both_directions)
+{
+    if (join->num_datasets != 1) {
+        join->error = "a self join takes exactly one dataset";
+        return -1;
+    }
+    join->self_join = true;
+    join->both_directions = both_directions != 0;
+    return 0;
+}
+
+int resque_set_memory_budget(resque_join *join, size_t bytes, const char *spill_dir)
+{
+    join->memory_budget = bytes;
+    if (spill_dir != NULL) {
+        join->spill_dir = spill_dir;
+    }
+    return 0;
+}
+
+int resque_set_plan(resque_join *join, const char *plan)
+{
+    int p = get_plan(plan);
+    if (p < 0) {
+        join->error = string("unknown plan ") + plan;
+        return -1;
+    }
+    join->plan = p;
+    return 0;
+}
+
+int resque_set_plan_log(resque_join *join, const char *path)
+{
+    delete join->plan_log_file;
+    join->plan_log_file = NULL;
+    join->plan_log = NULL;
+
+    if (path == NULL) {
+        return 0;
+    }
+    if (strcmp(path, "-") == 0) {
+        join->plan_log = &cerr;
+        return 0;
+    }
+
+    try {
+        join->plan_log_file = new ofstream(path, ios::out | ios::app);
+    }
+    catch (...) {
+        set_error(join);
+        return -1;
+    }
+    if (!*join->plan_log_file) {
+        join->error = string("cannot open plan log ") + path;
+        delete join->plan_log_file;
+        join->plan_log_file = NULL;
+        return -1;
+    }
+    join->plan_log = join->plan_log_file;
+    return 0;
+}
+
+int resque_set_threads(resque_join *join, int threads)
+{
+    if (threads < 1) {
+        join->error = "a join needs at least one thread";
+        return -1;
+    }
+    join->threads = threads;
+    return 0;
+}
+
+int resque_set_join_mode(resque_join *join, const char *mode)
+{
+    int m = get_join_mode(mode);
+    if (m < 0) {
+        join->error = string("unknown join mode ") + mode;
+        return -1;
+    }
+    if (m != JOIN_PAIRS && m != JOIN_COUNT && join->num_datasets > 2) {
+        join->error = "a semi, anti or object count join takes two datasets or a self join";
+        return -1;
+    }
+    if (m != JOIN_PAIRS && !join->state_dir.empty()) {
+        join->error = "an incremental join reports pairs";
+        return -1;
+    }
+    join->join_mode = m;
+    return 0;
+}
+
+int resque_set_aggregate_area(resque_join *join, int sum_area)
+{
+    if (sum_area && join->num_datasets > 2) {
+        join->error = "the area of a pair takes two datasets or a self join";
+        return -1;
+    }
+    join->aggregate_area = sum_area != 0;
+    return 0;
+}
+
+int resque_set_state_dir(resque_join *join, const char *dir)
+{
+    if (join->num_datasets != 2 || join->predicates[0] == ST_DISJOINT
+            || join->join_mode != JOIN_PAIRS) {
+        join->error = "an incremental join takes two datasets, a predicate other than st_disjoint "
+            "and reports pairs";
+        return -1;
+    }
+    join->state_dir = dir != NULL ? dir : "";
+    return 0;
+}
+
+int resque_add_record(resque_join *join, const char *tile, int database_id, int object_id,
+        const char *record, size_t record_len, size_t wkt_pos, size_t wkt_len,
+        const double *mbr)
+{
+    return resque_add_scanned_record(join, tile, database_id, object_id, record, record_len,
+            wkt_pos, wkt_len, mbr, 0);
+}
+
+int resque_add_scanned_record(resque_join *join, const char *tile, int database_id,
+        int object_id, const char *record, size_t record_len, size_t wkt_pos, size_t wkt_len,
+        const double *mbr, size_t num_points)
+{
+    if (wkt_pos + wkt_len > record_len) {
+        join->error = "WKT outside of the record";
+        return -1;
+    }
+
+    wkt_extent ext;
+    wkt_extent *box = mbr_extent(mbr, ext);
+    if (box != NULL) {
+        box->num_points = num_points;
+    }
+    try {
+        SpatialObject *obj = make_object(join, string(record, record_len), wkt_pos, wkt_len, box);
+        return add(join, tile, database_id, object_id, obj);
+    }
+    catch (...) {
+        set_error(join);
+        return -1;
+    }
+}
+
+int resque_add_wkt(resque_join *join, const char *tile, int database_id, int object_id,
+        const char *wkt)
+{
+    size_t len = strlen(wkt);
+    return resque_add_record(join, tile, database_id, object_id, wkt, len, 0, len, NULL);
+}
+
+int resque_add_polygon(resque_join *join, const char *tile, int database_id, int object_id,
+        const double *xy, const int *ring_sizes, int num_rings)
+{
+    if (num_rings < 1) {
+        join->error = "a polygon needs a shell";
+        return -1;
+    }
+
+    // the rings are ours until the polygon takes them
+    vector<LinearRing*> rings;
+    vector<Geometry*> *holes = NULL;
+    try {
+        for (int r = 0; r < num_rings; r++) {
+            vector<Coordinate> *points = new vector<Coordinate>();
+            for (int p = 0; p < ring_sizes[r]; p++, xy += 2) {
+                points->push_back(Coordinate(xy[0], xy[1]));
+            }
+            rings.push_back(join->factory->createLinearRing(new CoordinateArraySequence(points)));
+        }
+
+        holes = new vector<Geometry*>(rings.begin() + 1, rings.end());
+        Geometry *poly = join->factory->createPolygon(rings[0], holes);
+        rings.clear();
+        holes = NULL;
+        return add(join, tile, database_id, object_id, make_object(join, poly));
+    }
+    catch (...) {
+        for (size_t r = 0; r < rings.size(); r++) {
+            delete rings[r];
+        }
+        delete holes;
+        set_error(join);
+        return -1;
+    }
+}
+
+int resque_add_point(resque_join *join, const char *tile, int database_id, int object_id,
+        double x, double y)
+{
+    try {
+        Geometry *point = join->factory->createPoint(Coordinate(x, y));
+        return add(join, tile, database_id, object_id, make_object(join, point));
+    }
+    catch (...) {
+        set_error(join);
+        return -1;
+    }
+}
+
+size_t resque_num_tiles(const resque_join *join)
+{
+    return join->polydata.size();
+}
+
+const char *resque_tile(const resque_join *join, size_t i)
+{
+    if (i >= join->polydata.size()) {
+        return NULL;
+    }
+    polymap::const_iterator t = join->polydata.begin();
+    advance(t, i);
+    return t->first.c_str();
+}
+
+long resque_join_tile(resque_join *join, const char *tile)
+{
+    try {
+        return join_tile(join, tile);
+    }
+    catch (...) {
+        set_error(join);
+        return -1;
+    }
+}
+
+int resque_tuple_size(const resque_join *join)
+{
+    return join->tuple_size;
+}
+
+int resque_tuple_database(const resque_join *join, int k)
+{
+    if (k < 0 || k >= (int) join->tuple_databases.size()) {
+        return -1;
+    }
+    return join->tuple_databases[k];
+}
+
+int resque_next(resque_join *join, const int **object_ids)
+{
+    try {
+        return next_result(join, object_ids);
+    }
+    catch (...) {
+        set_error(join);
+        return -1;
+    }
+}
+
+int resque_aggregate(const resque_join *join, long *count, double *area)
+{
+    // the tile, or the tuple resque_next() handed out last
+    size_t i = 0;
+    if (join->join_mode == JOIN_OBJECT_COUNT) {
+        if (join->next_result == 0) {
+            return -1;
+        }
+        i = join->next_result / join->tuple_size - 1;
+    }
+    else if (join->join_mode != JOIN_COUNT) {
+        return -1;
+    }
+    if (i >= join->match_counts.size()) {
+        return -1;
+    }
+
+    *count = join->match_counts[i];
+    if (area != NULL) {
+        *area = join->match_areas[i];
+    }
+    return 0;
+}
+
+void resque_clear(resque_join *join)
+{
+    clear_tiles(join);
+}
+
+int resque_estimate_tile(resque_join *join, const char *tile, long size_one, long size_two,
+        resque_estimate *estimate)
+{
+    TileEstimate est;
+    try {
+        if (estimate_tile(join, tile, size_one, size_two, est) < 0) {
+            return -1;
+        }
+    }
+    catch (...) {
+        set_error(join);
+        return -1;
+    }
+
+    estimate->plan = plan_name(est.plan);
+    estimate->model_candidates = est.model_candidates;
+    estimate->candidates = est.candidates;
+    estimate->pairs = est.pairs;
+    estimate->cost = est.cost;
+    return 0;
+}
+
+const char *resque_record(const resque_join *join, const char *tile, int database_id,
+        int object_id, size_t *record_len)
+{
+    polymap::const_iterator t = join->polydata.find(tile);
+    if (t == join->polydata.end()) {
+        return NULL;
+    }
+    map<int, polyset>::const_iterator d = t->second.find(database_id);
+    if (d == t->second.end()) {
+        return NULL;
+    }
+    polyset::const_iterator o = d->second.find(object_id);
+    if (o == d->second.end()) {
+        return NULL;
+    }
+
+    if (record_len != NULL) {
+        *record_len = o->second->record.length();
+    }
+    return o->second->record.c_str();
+}
+
+int resque_broadcast_add(resque_join *join, const char *record, size_t record_len,
+        size_t wkt_pos, size_t wkt_len, const double *mbr)
+{
+    if (wkt_pos + wkt_len > record_len) {
+        join->error = "WKT outside of the record";
+        return -1;
+    }
+
+    wkt_extent ext;
+    try {
+        SpatialObject *obj = make_object(join, string(record, record_len), wkt_pos, wkt_len,
+                mbr_extent(mbr, ext));
+        if (obj == NULL) {
+            return -1;
+        }
+        join->broadcast_objects.push_back(obj);
+        return 1;
+    }
+    catch (...) {
+        set_error(join);
+        return -1;
+    }
+}
+
+int resque_broadcast_build(resque_join *join)
+{
+    try {
+        return build_broadcast_index(join) ? 0 : -1;
+    }
+    catch (...) {
+        set_error(join);
+        return -1;
+    }
+}
+
+long resque_broadcast_probe(resque_join *join, const char *record, size_t record_len,
+        size_t wkt_pos, size_t wkt_len, const double *mbr)
+{
+    if (join->broadcast_index == NULL) {
+        join->error = "no broadcast index, see resque_broadcast_build()";
+        return -1;
+    }
+    if (wkt_pos + wkt_len > record_len) {
+        join->error = "WKT outside of the record";
+        return -1;
+    }
+
+    wkt_extent ext;
+    try {
+        SpatialObject *obj = make_object(join, string(record, record_len), wkt_pos, wkt_len,
+                mbr_extent(mbr, ext));
+        if (obj == NULL) {
+            return -1;
+        }
+        long matches = probe_broadcast(join, obj);
+        free_object(obj);
+        return matches;
+    }
+    catch (...) {
+        set_error(join);
+        return -1;
+    }
+}
+
+const char *resque_broadcast_record(const resque_join *join, int i, size_t *record_len)
+{
+    if (i < 0 || i >= (int) join->broadcast_objects.size()) {
+        return NULL;
+    }
+    if (record_len != NULL) {
+        *record_len = join->broadcast_objects[i]->record.length();
+    }
+    return join->broadcast_objects[i]->record.c_str();
+}
@@ -0,0 +1,190 @@
+#ifndef LIBRESQUE_H
+#define LIBRESQUE_H
+
+#include <stddef.h>
+
+/*
+ * libresque: the resque spatial join engine as a library.
+ *
+ * A join is created for a number of datasets and one predicate per pair of
+ * neighbouring datasets. Objects are added to named tiles, as WKT (alone or
+ * inside a longer record) or as coordinates; each tile is then joined and
+ * its result tuples are read back one by one. Only objects of the same tile
+ * are joined with each other.
+ *
+ * A resque_join is not thread safe; use one per thread. Functions returning
+ * int or long return -1 on error, resque_error() then says why.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RESQUE_ABI_VERSION 1
+
+typedef struct resque_join resque_join;
+
+int resque_abi_version(void);
+
+/* predicates is "st_xxx", applied between every pair of neighbouring
+ * datasets, or "st_a,st_b,..." with one predicate per pair; NULL on a bad
+ * predicate or dataset count */
+resque_join *resque_new(const char *predicates, int num_datasets);
+void resque_free(resque_join *join);
+const char *resque_error(const resque_join *join);
+
+/* st_dwithin distance, 10.0 by default */
+int resque_set_distance(resque_join *join, double distance);
+/* joins dataset 1 with itself (num_datasets must be 1); symmetric
+ * predicates only test each pair once and report it as (i, j) with i < j,
+ * or also as (j, i) when both_directions is set */
+int resque_set_self_join(resque_join *join, int both_directions);
+/* caps the memory the added objects take at about bytes (0, the default,
+ * for no limit). Beyond it the largest tile is spilled to run files in a
+ * directory under spill_dir ($TMPDIR or /tmp when NULL) and joined from
+ * disk one partition at a time; a partition too large for the budget, as
+ * over a dense region, is partitioned again. A spilled object still takes
+ * about 64 bytes of the budget until the tiles are cleared. Two-way joins
+ * and self joins reporting pairs or a count only, and not st_disjoint: the
+ * budget does not apply to the others, such as the semi, anti and
+ * object-count modes, whose tiles stay in memory. */
+int resque_set_memory_budget(resque_join *join, size_t bytes, const char *spill_dir);
+
+/* the filter algorithm of two-way and self join tiles: "nested" (loop),
+ * "sweep" (plane sweep), "index" (R-tree) or "auto", the default, for the
+ * cheapest by a cost model over the tile's cardinalities, average vertex
+ * count and box sizes, or for st_equals "hash", buckets by box and
+ * canonical form, or for st_contains and st_within "range", a range tree
+ * of the boxes; -1 for another name. The pairs come out in the same order
+ * with each. */
+int resque_set_plan(resque_join *join, const char *plan);
+/* appends a line per joined tile to path ("-" for stderr, NULL to stop):
+ *     tile plan size_1 size_2 avg_vertices coverage est_candidates
+ *     candidates est_cost filter_us refine_us pairs
+ * separated by tabs, with the cost in envelope tests and the time in
+ * microseconds. */
+int resque_set_plan_log(resque_join *join, const char *path);
+/* threads refining a tile of many candidate pairs, 1 by default; the
+ * pairs come out in the same order with any number */
+int resque_set_threads(resque_join *join, int threads);
+/* what a tile reports: "pairs", the default, or for a two-way or self
+ * join "semi", the objects of dataset 1 that match some object of the
+ * other side, or "anti", those that match none. A semi or anti join
+ * reports each object of dataset 1 at most once, as a tuple of one id,
+ * and stops probing an object at its first match. The aggregate modes
+ * keep no pairs: "count" reduces a tile to its number of tuples, and
+ * "object-count" (two-way or self join) reports every object of dataset 1
+ * once with its number of matches, see resque_aggregate(); -1 for another
+ * name, or for another mode than "pairs" in an incremental join. */
+int resque_set_join_mode(resque_join *join, const char *mode);
+/* the aggregate modes also sum the area of the intersection of every
+ * matching pair (two-way or self join); off by default as it builds the
+ * intersections */
+int resque_set_aggregate_area(resque_join *join, int sum_area);
+/* incremental join of two datasets (NULL to stop): the objects added are
+ * a delta. resque_join_tile() joins the delta of the tile with itself and
+ * with the tile state kept under dir, then adds it to the state, so a tile
+ * joined batch after batch reports every pair exactly once. An object id
+ * already in the state replaces the object there, as an id added again
+ * does: the new copy is joined as a new object, and the pairs of the old
+ * one reported before stand. Not st_disjoint; the memory budget does not
+ * apply. */
+int resque_set_state_dir(resque_join *join, const char *dir);
+
+/*
+ * Adding objects. Each returns 1 when the object was added, 0 when a self
+ * join already holds it, -1 on error. Object ids are unique per dataset
+ * and tile; adding an id again replaces the object.
+ */
+
+/* record holds the WKT at [wkt_pos, wkt_pos + wkt_len); the record is
+ * copied and can be read back with resque_record(). mbr is xmin, ymin,
+ * xmax, ymax, or NULL to take the box from the WKT text. */
+int resque_add_record(resque_join *join, const char *tile, int database_id, int object_id,
+        const char *record, size_t record_len, size_t wkt_pos, size_t wkt_len,
+        const double *mbr);
+/* the same for a record whose WKT was scanned already, as by the reader
+ * threads of the resque command: mbr is its box and num_points its
+ * vertices, which are then not counted again */
+int resque_add_scanned_record(resque_join *join, const char *tile, int database_id,
+        int object_id, const char *record, size_t record_len, size_t wkt_pos, size_t wkt_len,
+        const double *mbr, size_t num_points);
+int resque_add_wkt(resque_join *join, const char *tile, int database_id, int object_id,
+        const char *wkt);
+/* a polygon of num_rings rings, the shell first; ring r has ring_sizes[r]
+ * points (closed, so the last one repeats the first), taken in turn from
+ * xy as x0, y0, x1, y1, ... */
+int resque_add_polygon(resque_join *join, const char *tile, int database_id, int object_id,
+        const double *xy, const int *ring_sizes, int num_rings);
+int resque_add_point(resque_join *join, const char *tile, int database_id, int object_id,
+        double x, double y);
+
+/* tiles in sorted order */
+size_t resque_num_tiles(const resque_join *join);
+const char *resque_tile(const resque_join *join, size_t i);
+
+/*
+ * Joining. resque_join_tile() returns the number of result tuples of the
+ * tile; resque_next() then hands them out in order, returning 0 after the
+ * last (or -1 on error). A tuple holds resque_tuple_size() object ids, the k-th one of
+ * dataset resque_tuple_database(k). resque_clear() drops all tiles.
+ *
+ * A spilled tile returns 0 from resque_join_tile(); its partitions are
+ * loaded and joined as resque_next() reaches them, so its tuples come out
+ * partition by partition, and resque_record() only knows the objects of
+ * the partition of the last tuple. A spilled tile of the "count" mode is
+ * counted partition by partition within resque_join_tile() instead.
+ */
+long resque_join_tile(resque_join *join, const char *tile);
+/* the aggregates of the "count" and "object-count" join modes: the number
+ * of tuples of the last tile joined (resque_join_tile() returns it too,
+ * and resque_next() then none), or the matches of the object of the tuple
+ * resque_next() handed out last; area may be NULL. -1 in another mode. */
+int resque_aggregate(const resque_join *join, long *count, double *area);
+int resque_tuple_size(const resque_join *join);
+int resque_tuple_database(const resque_join *join, int k);
+int resque_next(resque_join *join, const int **object_ids);
+void resque_clear(resque_join *join);
+
+/*
+ * Estimating. The objects of a tile are taken as a uniform sample of a tile
+ * of size_one objects of dataset 1 and size_two of dataset 2 (size_one for
+ * a self join); the sample is joined and the figures of the whole tile are
+ * extrapolated from it. Two-way and self joins only.
+ */
+typedef struct resque_estimate {
+    const char *plan;               /* the filter algorithm the tile would get */
+    double model_candidates;        /* pairs passing the envelope filter, by
+                                     * the cost model over the box sizes */
+    double candidates;              /* the same, by the sample */
+    double pairs;                   /* result tuples, by the sample */
+    double cost;                    /* filter and refinement, in envelope
+                                     * tests; the refinement follows the model
+                                     * when the sample saw no candidate */
+} resque_estimate;
+
+int resque_estimate_tile(resque_join *join, const char *tile, long size_one, long size_two,
+        resque_estimate *estimate);
+
+/* the record an object was added with; NULL when unknown */
+const char *resque_record(const resque_join *join, const char *tile, int database_id,
+        int object_id, size_t *record_len);
+
+/*
+ * Broadcast join: dataset 1 is added once and indexed, then each object
+ * of dataset 2 is probed against it without being stored. The tuples of a
+ * probe hold one id, the index of the matching broadcast object in the
+ * order they were added.
+ */
+int resque_broadcast_add(resque_join *join, const char *record, size_t record_len,
+        size_t wkt_pos, size_t wkt_len, const double *mbr);
+int resque_broadcast_build(resque_join *join);
+long resque_broadcast_probe(resque_join *join, const char *record, size_t record_len,
+        size_t wkt_pos, size_t wkt_len, const double *mbr);
+const char *resque_broadcast_record(const resque_join *join, int i, size_t *record_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,67 @@
+/*
+ * Joins a few objects through the libresque C API and checks the pairs.
+ *
+ * usage: libresque_test (exit status 0 when the pairs are the expected ones)
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "libresque.h"
+
+int main(void)
+{
+    /* a 10 x 10 square, and one with a hole that is not closed */
+    const double square[] = {5, 5, 15, 5, 15, 15, 5, 15, 5, 5};
+    const int square_rings[] = {5};
+    const double open_hole[] = {5, 5, 15, 5, 15, 15, 5, 15, 5, 5, 8, 8, 12, 8, 12, 12, 8, 12};
+    const int open_hole_rings[] = {5, 4};
+    const int expected[][2] = {{1, 1}, {1, 3}, {2, 1}};
+    const int *ids;
+    int n = 0;
+    int failed = 0;
+
+    resque_join *join = resque_new("st_intersects", 2);
+    if (join == NULL) {
+        fprintf(stderr, "resque_new failed\n");
+        return 1;
+    }
+
+    resque_add_wkt(join, "tile", 1, 1, "POLYGON((0 0, 10 0, 10 10, 0 10, 0 0))");
+    resque_add_wkt(join, "tile", 1, 2, "POLYGON((12 12, 14 12, 14 14, 12 14, 12 12))");
+    resque_add_polygon(join, "tile", 2, 1, square, square_rings, 1);
+    resque_add_point(join, "tile", 2, 2, 20, 20);
+    resque_add_point(join, "tile", 2, 3, 1, 1);
+
+    /* refused with the reason GEOS gives */
+    if (resque_add_polygon(join, "tile", 2, 4, open_hole, open_hole_rings, 2) == 0
+            || strcmp(resque_error(join), "out of memory") == 0) {
+        failed = 1;
+    }
+
+    if (resque_join_tile(join, "tile") < 0) {
+        fprintf(stderr, "%s\n", resque_error(join));
+        resque_free(join);
+        return 1;
+    }
+
+    while (resque_next(join, &ids) > 0) {
+        printf("%d %d\n", ids[0], ids[1]);
+        if (n >= 3 || ids[0] != expected[n][0] || ids[1] != expected[n][1]) {
+            failed = 1;
+        }
+        n++;
+    }
+
+    resque_free(join);
+
+    /* an incremental join only reports pairs, whichever is set first */
+    join = resque_new("st_intersects", 2);
+    if (join == NULL || resque_set_state_dir(join, "state") < 0
+            || resque_set_join_mode(join, "semi") == 0) {
+        failed = 1;
+    }
+    resque_free(join);
+
+    return failed || n != 3;
+}
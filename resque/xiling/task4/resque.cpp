@@ -1,826 +1,1279 @@
 #include <iostream>
 #include <vector>
-#include <string>
-#include <cmath>
 #include <map>
+#include <set>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <deque>
+#include <algorithm>
 #include <stdlib.h> 
-
-// geos
-#include <geos/geom/PrecisionModel.h>
-#include <geos/geom/GeometryFactory.h>
-#include <geos/geom/Geometry.h>
-#include <geos/geom/Point.h>
-#include <geos/io/WKTReader.h>
-#include <geos/io/WKTWriter.h>
-#include <geos/opBuffer.h>
-
-#include <spatialindex/SpatialIndex.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "libresque.h"
+#include "result_cache.h"
+#include "tile_stats.h"
+#include "spatial_predicates.h"
+#include "wkt_envelope.h"
+
+// The resque command: reads the hive reducer stream, joins it through 
+// libresque and prints the joined records.
 
 using namespace std;
-using namespace geos;
-using namespace geos::io;
-using namespace geos::geom;
-using namespace geos::operation::buffer; 
-
-#define OSM_SRID 4326
-
-// Constants
-#define ST_INTERSECTS 1
-#define ST_TOUCHES 2
-#define ST_CROSSES 3
-#define ST_CONTAINS 4
-#define ST_ADJACENT 5
-#define ST_DISJOINT 6
-#define ST_EQUALS 7
-#define ST_DWITHIN 8
-#define ST_WITHIN 9
-#define ST_OVERLAPS 10
 
 #define DATABASE_ID_ONE 1
 #define DATABASE_ID_TWO 2
 
-// data type declaration 
-typedef map<string, map<int, map<int, Geometry*> > > polymap;
-typedef map<string, map<int, map<int, string> > > datamap;
-
-polymap polydata;
-datamap data;
-
 const string tab = "\t";
 const string sep = "\x02"; // ctrl+a
 
-// data block 
-string TILE_ID_ONE = "oligoastroIII.2_40x_20x_NS-MORPH_1";
-string TILE_ID_TWO = "oligoastroIII.2_40x_20x_NS-MORPH_2";
-
-int PREDICATE = 0;
-int shape_idx_1 = -1;
-int shape_idx_2 = -1;
-
-bool readSpatialInputGEOS();
-vector<string> split(string str, string separator);
-
-bool join_intersects();
-bool join_touches();
-bool join_crosses();
-bool join_contains();
-bool join_adjacent();
-bool join_disjoint();
-bool join_equals();
-bool join_dwithin();
-bool join_within();
-bool join_overlaps();
+resque_join *join = NULL;
+
+// shape_idx[d - 1] is the shape column of dataset d
+vector<int> shape_idx;
+int num_datasets = 0;
+// mbr_idx[d - 1] is the first of the xmin, ymin, xmax, ymax columns of 
+// dataset d, -1 when its box is scanned from the WKT text
+vector<int> mbr_idx;
+
+// self join: both sides of the join come from dataset DATABASE_ID_ONE
+bool self_join = false;
+// self join: report a symmetric pair as (i, j) and (j, i)
+bool both_directions = false;
+
+// broadcast join: dataset DATABASE_ID_ONE is loaded from this file and
+// dataset DATABASE_ID_TWO streams through stdin, both as plain tab 
+// separated rows; there are no tiles
+const char *broadcast_file = NULL;
+
+// server mode: join requests are read from stdin, or from the connections
+// to a unix socket at socket_path, see serve_requests()
+bool server_mode = false;
+const char *socket_path = NULL;
+
+// memory budget of the join in MB, 0 for none; the tiles beyond it are 
+// spilled under spill_dir, see resque_set_memory_budget()
+double memory_budget = 0;
+const char *spill_dir = NULL;
+
+// filter algorithm of the tiles and where their plans are logged, see
+// resque_set_plan() and resque_set_plan_log()
+const char *plan = NULL;
+const char *plan_log = NULL;
+
+// threads scanning the input and refining the candidates of a large tile
+int threads = 1;
+
+// pairs, or the objects of dataset 1 with (semi) or without (anti) a
+// match, or the aggregates of a tile (count) or of every object of
+// dataset 1 (object-count), see resque_set_join_mode(); sum_area adds the
+// area of the intersections to the aggregates
+const char *join_mode = NULL;
+bool sum_area = false;
+
+// result cache: the output of a tile is kept under cache_dir, keyed by the
+// join arguments (cache_params) and the digest of the tile's records, and
+// by the tile itself in count mode
+const char *cache_dir = NULL;
+double cache_size = 1024;
+ResultCache *cache = NULL;
+string cache_params;
+map<string, TileDigest> tile_digests;
+
+// incremental join: the input is a delta joined with the tile states kept
+// under state_dir, see resque_set_state_dir()
+const char *state_dir = NULL;
+
+// --estimate: every tile is estimated from a uniform sample of up to
+// ESTIMATE_SAMPLE records per dataset instead of being joined, see
+// resque_estimate_tile()
+#define ESTIMATE_SAMPLE 1024
+bool estimate = false;
+
+struct SampledRecord {
+    string record;
+    size_t wkt_pos;
+    size_t wkt_len;
+    bool has_box;
+    double box[4];
+};
+
+// the records of a dataset seen in a tile and a reservoir sample of them
+struct TileSample {
+    long size[2];
+    vector<SampledRecord> records[2];
+    set<int> self_join_ids;         // a self join counts every object once
+
+    TileSample() { size[0] = size[1] = 0; }
+};
+
+map<string, TileSample> tile_samples;
+
+// --stats: the statistics of every tile and dataset of the input are
+// written to stats_file, see tile_stats.h
+const char *stats_file = NULL;
+map<string, map<int, TileStats> > tile_stats;
+
+// a line of the reducer input split into its fields and its WKT scanned,
+// see scan_record()
+struct InputRecord {
+    string key;
+    int database_id;
+    int object_id;
+    string record;                  // the fields joined by tabs
+    size_t wkt_pos;
+    size_t wkt_len;
+    bool from_columns;              // box is from the MBR columns
+    bool has_box;                   // box is from them or from the WKT text
+    double box[4];
+    size_t num_points;
+    string error;                   // why the record is refused
+};
+
+// bytes per block of the parallel input, see read_input_parallel()
+#define INPUT_BLOCK (1 << 20)
+#define INPUT_BLOCKS_PER_THREAD 4
+
+void usage();
+bool configure(int argc, char** argv);
+void reset_configuration();
+
+bool readSpatialInputGEOS(istream &in);
+void scan_record(const string &input_line, InputRecord &r);
+bool store_record(const InputRecord &r);
+bool read_input_parallel(istream &in);
+vector<string> split(const string &str, const string &separator);
+const double* record_box(const vector<string> &fields, int database_id, double *box);
+size_t wkt_offset(const vector<string> &fields, int shape, const string &separator);
+string aggregate_columns();
+bool join_tiles(long &pairs);
+bool estimate_tiles(long &tiles);
+bool write_stats();
+bool serve_requests(bool &shutdown);
+bool serve_socket(const char *path);
+bool loadBroadcastInput(const char *path);
+bool broadcast_join();
 bool cleanup();
 
 int main(int argc, char** argv)
 {
-    if (argc < 4) {
-        cerr << "usage: resque [predicate] [shape_idx 1] [shape_idx 2] " <<endl;
-	    return 0;
-    }
-
-    //cerr << "argv[1] = " << argv[1] << endl;
-    //cerr << "argv[2] = " << argv[2] << endl;
-    //cerr << "argv[3] = " << argv[3] << endl;
-
-    shape_idx_1 = strtol(argv[2], NULL, 10);
-    shape_idx_2 = strtol(argv[3], NULL, 10);
-
-    if (strcmp(argv[1], "st_intersects") == 0) {
-	    PREDICATE = ST_INTERSECTS;
-    } 
-    else if (strcmp(argv[1], "st_touches") == 0) {
-	    PREDICATE = ST_TOUCHES;
-    } 
-    else if (strcmp(argv[1], "st_crosses") == 0) {
-	    PREDICATE = ST_CROSSES;
-    } 
-    else if (strcmp(argv[1], "st_contains") == 0) {
-	    PREDICATE = ST_CONTAINS;
-    } 
-    else if (strcmp(argv[1], "st_adjacent") == 0) {
-	    PREDICATE = ST_ADJACENT;
-    } 
-    else if (strcmp(argv[1], "st_disjoint") == 0) {
-	    PREDICATE = ST_DISJOINT;
-    }
-    else if (strcmp(argv[1], "st_equals") == 0) {
-	    PREDICATE = ST_EQUALS;
-    }
-    else if (strcmp(argv[1], "st_dwithin") == 0) {
-	    PREDICATE = ST_DWITHIN;
-    }
-    else if (strcmp(argv[1], "st_within") == 0) {
-	    PREDICATE = ST_WITHIN;
-    }
-    else if (strcmp(argv[1], "st_overlaps") == 0) {
-	    PREDICATE = ST_OVERLAPS;
-    }
-    else {
-        cerr << "wrong argv[1], return" << endl;
+    if (!configure(argc, argv)) {
         return 1;
     }
 
+    if (server_mode) {
+        bool shutdown = false;
+        bool ok = socket_path != NULL ? serve_socket(socket_path) : serve_requests(shutdown);
+        return ok ? 0 : 1;
+    }
 
-    if (!readSpatialInputGEOS()) {
-	    return 1;
-    }
-
-    switch (PREDICATE){
-    case ST_INTERSECTS:
-        join_intersects();
-        break;
-    case ST_TOUCHES:
-        join_touches();
-        break;
-    case ST_CROSSES:
-        join_crosses();
-        break;
-    case ST_CONTAINS:
-        join_contains();
-        break;
-    case ST_ADJACENT:
-        join_adjacent();
-        break;
-    case ST_DISJOINT:
-        join_disjoint();
-        break;
-    case ST_EQUALS:
-        join_equals();
-        break;
-    case ST_DWITHIN:
-        join_dwithin();
-        break;
-    case ST_WITHIN:
-        join_within();
-        break;
-    case ST_OVERLAPS:
-        join_overlaps();
-        break;
-    default:
-        cerr << "ERROR: unknown spatial predicate " << endl;
-        return 1;
+    if (broadcast_file != NULL) {
+        if (!loadBroadcastInput(broadcast_file) || !broadcast_join()) {
+            return 1;
+        }
+        return 0;
     }
 
-    return 0;
+    // the tiles spilled to disk go away with cleanup()
+    long pairs = 0;
+    bool ok = readSpatialInputGEOS(cin) && (estimate ? estimate_tiles(pairs) : join_tiles(pairs))
+        && write_stats();
+    cleanup();
+    return ok ? 0 : 1;
 }
 
-bool readSpatialInputGEOS() 
+// Sets the join configuration from a command line; also used for the
+// arguments of every server request.
+bool configure(int argc, char** argv)
 {
-    string input_line;
-    string store_line;
-    
-    string key;
-    string value;
+    static struct option long_options[] = {
+        {"self-join",       no_argument, 0, 's'},
+        {"both-directions", no_argument, 0, 'b'},
+        {"mbr-columns",     required_argument, 0, 'm'},
+        {"broadcast",       required_argument, 0, 'B'},
+        {"server",          no_argument, 0, 'S'},
+        {"socket",          required_argument, 0, 'U'},
+        {"memory-budget",   required_argument, 0, 'M'},
+        {"spill-dir",       required_argument, 0, 'T'},
+        {"plan",            required_argument, 0, 'P'},
+        {"plan-log",        required_argument, 0, 'L'},
+        {"threads",         required_argument, 0, 't'},
+        {"cache-dir",       required_argument, 0, 'C'},
+        {"cache-size",      required_argument, 0, 'z'},
+        {"incremental",     required_argument, 0, 'I'},
+        {"estimate",        no_argument, 0, 'e'},
+        {"stats",           required_argument, 0, 'X'},
+        {"join-mode",       required_argument, 0, 'J'},
+        {"sum-area",        no_argument, 0, 'A'},
+        {0, 0, 0, 0}
+    };
+
+    vector<string> mbr_columns;
+
+    // 0 makes getopt start over for the next request
+    optind = 0;
+
+    int c;
+    while ((c = getopt_long(argc, argv, "sbm:B:SU:M:T:P:L:t:C:z:I:eX:J:A", long_options, NULL)) != -1) {
+        switch (c) {
+        case 's':
+            self_join = true;
+            break;
+        case 'b':
+            both_directions = true;
+            break;
+        case 'm':
+            mbr_columns = split(optarg, ",");
+            break;
+        case 'B':
+            broadcast_file = optarg;
+            break;
+        case 'S':
+            server_mode = true;
+            break;
+        case 'U':
+            server_mode = true;
+            socket_path = optarg;
+            break;
+        case 'M':
+            memory_budget = strtod(optarg, NULL);
+            break;
+        case 'T':
+            spill_dir = optarg;
+            break;
+        case 'P':
+            plan = optarg;
+            break;
+        case 'L':
+            plan_log = optarg;
+            break;
+        case 't':
+            threads = strtol(optarg, NULL, 10);
+            break;
+        case 'C':
+            cache_dir = optarg;
+            break;
+        case 'z':
+            cache_size = strtod(optarg, NULL);
+            break;
+        case 'I':
+            state_dir = optarg;
+            break;
+        case 'e':
+            estimate = true;
+            break;
+        case 'X':
+            stats_file = optarg;
+            break;
+        case 'J':
+            join_mode = optarg;
+            break;
+        case 'A':
+            sum_area = true;
+            break;
+        default:
+            usage();
+            return false;
+        }
+    }
 
-    vector<string> fields;
+    // the join arguments of a server come with each request
+    if (server_mode && optind == argc) {
+        return true;
+    }
 
-    int database_id = 0;
-    int object_id = 0;
-    size_t key_pos;
-
-    GeometryFactory *gf = new GeometryFactory(new PrecisionModel(),OSM_SRID);
-    WKTReader *wkt_reader = new WKTReader(gf);
-    Geometry *poly = NULL; 
-
-    while(cin && getline(cin, input_line) && !cin.eof()) {
-        // cerr << "input_line: " << input_line << endl;
-        
-        key_pos = input_line.find_first_of(tab);
-        key = input_line.substr(0, key_pos);
-        // cerr << "key = " << key << endl;
-
-        value = input_line.substr(key_pos+1);
-        // cerr << "value = " << value << endl;
-
-        // for local version
-        // fiedls[0] is the database id in local version
-        // fiedls[1] is the object id in local version
-        // fields = split(value, tab);
-        // database_id = atoi(fields[0].c_str());
-        // object_id = atoi(fields[1].c_str());
-
-
-        // for hive version
-        // fiedls[1] is the database id in hive version
-        // fiedls[2] is the object id in hive version
-      
-        fields = split(value, sep);
-        database_id = atoi(fields[1].c_str());
-        object_id = atoi(fields[2].c_str());
-
-        // cerr << "fields[0] = " << fields[0] << endl; 
-        // cerr << "fields[1] = " << fields[1] << endl; 
-        // cerr << "fields[2] = " << fields[2] << endl; 
-        // cerr << "fields[9] = " << fields[9] << endl; 
-
-        // fields[shape_idx_1] is the polygon for the 1st input file 
-        // fields[shape_idx_2] is the polygon for the 2nd input file 
-        if (database_id == DATABASE_ID_ONE) {
-            poly = wkt_reader->read(fields[shape_idx_1]);
-        }
-        else if (database_id == DATABASE_ID_TWO) {
-            poly = wkt_reader->read(fields[shape_idx_2]);
-        }
-        else {
-            cerr << "wrong database id : " << database_id << endl;       
+    // a self join only needs the shape index of its single dataset
+    if (argc - optind < (self_join ? 2 : 3)) {
+        usage();
+	    return false;
+    }
+
+    // one shape index per dataset
+    for (int i = optind + 1; i < argc; i++) {
+        shape_idx.push_back(strtol(argv[i], NULL, 10));
+    }
+    num_datasets = shape_idx.size();
+
+    if (self_join && num_datasets != 1) {
+        cerr << "a self join takes exactly one shape index" << endl;
+        return false;
+    }
+
+    // st_a,st_b,... chains the datasets: 1 st_a 2, 2 st_b 3, ...
+    vector<string> names = split(argv[optind], ",");
+    for (size_t i = 0; i < names.size(); i++) {
+        if (get_predicate(names[i].c_str()) == 0) {
+            cerr << "wrong predicate " << names[i] << ", return" << endl;
             return false;
         }
+    }
+    int num_edges = num_datasets > 1 ? num_datasets - 1 : 1;
+    if (names.size() != 1 && (int) names.size() != num_edges) {
+        cerr << "expected 1 or " << num_edges << " predicates for " 
+             << num_datasets << " datasets" << endl;
+        return false;
+    }
 
-        std::stringstream ss;
-        for (size_t i = 0; i < fields.size(); ++i) {
-            if (i != 0) {
-                ss << tab;
-            }
-            ss << fields[i];
+    // one MBR column index for all datasets, or one per dataset
+    for (int d = 0; d < num_datasets; d++) {
+        if (mbr_columns.empty()) {
+            mbr_idx.push_back(-1);
+        }
+        else {
+            const string &idx = mbr_columns[mbr_columns.size() == 1 ? 0 : d];
+            mbr_idx.push_back(strtol(idx.c_str(), NULL, 10));
         }
+    }
+    if (mbr_columns.size() > 1 && (int) mbr_columns.size() != num_datasets) {
+        cerr << "expected 1 or " << num_datasets << " --mbr-columns indexes" << endl;
+        return false;
+    }
+
+    if (both_directions && !self_join) {
+        cerr << "--both-directions only applies to a self join" << endl;
+    }
 
-        store_line = ss.str();
-        polydata[key][database_id][object_id] = poly;
-        data[key][database_id][object_id] = store_line;
+    if (broadcast_file != NULL && (self_join || num_datasets != 2)) {
+        cerr << "a broadcast join takes two datasets" << endl;
+        return false;
+    }
+
+    if (stats_file != NULL && broadcast_file != NULL) {
+        cerr << "--stats is ignored for a broadcast join" << endl;
+    }
+    if (estimate && (broadcast_file != NULL || state_dir != NULL || num_datasets > 2
+                || (join_mode != NULL && strcmp(join_mode, "pairs") != 0))) {
+        cerr << "--estimate takes a two-way or self join" << endl;
+        return false;
+    }
+    if (estimate) {
+        // the same input gets the same estimate
+        srandom(1);
+    }
 
-        fields.clear();
-        cerr.flush();
+    join = resque_new(argv[optind], num_datasets);
+    if (join == NULL) {
+        return false;
+    }
+    if (self_join) {
+        resque_set_self_join(join, both_directions);
+    }
+    if (join_mode != NULL && (broadcast_file != NULL || resque_set_join_mode(join, join_mode) < 0)) {
+        cerr << (broadcast_file != NULL ? "a broadcast join reports pairs" : resque_error(join))
+             << endl;
+        return false;
+    }
+    if (sum_area && (join_mode == NULL || (strcmp(join_mode, "count") != 0
+                    && strcmp(join_mode, "object-count") != 0))) {
+        cerr << "--sum-area is ignored unless --join-mode is count or object-count" << endl;
+    }
+    else if (sum_area && resque_set_aggregate_area(join, 1) < 0) {
+        cerr << resque_error(join) << endl;
+        return false;
+    }
+
+    if (state_dir != NULL && (broadcast_file != NULL || resque_set_state_dir(join, state_dir) < 0)) {
+        cerr << (broadcast_file != NULL ? "a broadcast join cannot be incremental" : resque_error(join))
+             << endl;
+        return false;
+    }
+    if (memory_budget > 0) {
+        if (num_datasets > 2 || get_predicate(names[0].c_str()) == ST_DISJOINT || state_dir != NULL
+                || (join_mode != NULL && strcmp(join_mode, "pairs") != 0
+                    && strcmp(join_mode, "count") != 0)) {
+            cerr << "--memory-budget is ignored for st_disjoint, multiway, incremental, semi, anti "
+                 << "and object-count joins" << endl;
+        }
+        resque_set_memory_budget(join, (size_t) (memory_budget * 1024 * 1024), spill_dir);
+    }
+    if ((plan != NULL && resque_set_plan(join, plan) < 0)
+            || (plan_log != NULL && resque_set_plan_log(join, plan_log) < 0)
+            || resque_set_threads(join, threads) < 0) {
+        cerr << resque_error(join) << endl;
+        return false;
+    }
+
+    if (cache_dir != NULL && state_dir != NULL) {
+        // the output of an incremental join depends on the state as well
+        cerr << "--cache-dir is ignored for an incremental join" << endl;
+    }
+    else if (cache_dir != NULL) {
+        // everything that changes the output of a tile
+        std::stringstream params;
+        params << "resque " << RESQUE_ABI_VERSION << " " << argv[optind];
+        for (int d = 0; d < num_datasets; d++) {
+            params << " " << shape_idx[d] << ":" << mbr_idx[d];
+        }
+        params << (self_join ? " self" : "") << (both_directions ? " both" : "")
+               << " " << (join_mode != NULL ? join_mode : "pairs") << (sum_area ? " area" : "");
+        cache_params = params.str();
+        cache = new ResultCache(cache_dir, (uint64_t) (cache_size * 1024 * 1024));
     }
 
-    // cerr << "polydata size = " << polydata.size() << endl;
     return true;
 }
 
-vector<string> split(string str, string separator)  
-{  
-    vector<string> result;  
-    int cutAt;  
+void reset_configuration()
+{
+    resque_free(join);
+    join = NULL;
+    shape_idx.clear();
+    num_datasets = 0;
+    mbr_idx.clear();
+    self_join = false;
+    both_directions = false;
+    broadcast_file = NULL;
+    memory_budget = 0;
+    spill_dir = NULL;
+    plan = NULL;
+    plan_log = NULL;
+    threads = 1;
+    delete cache;
+    cache = NULL;
+    cache_dir = NULL;
+    cache_size = 1024;
+    cache_params.clear();
+    state_dir = NULL;
+    estimate = false;
+    stats_file = NULL;
+    join_mode = NULL;
+    sum_area = false;
+}
 
-    while((cutAt = str.find_first_of(separator)) != str.npos) {  
-        if(cutAt >= 0) {  
-            result.push_back(str.substr(0, cutAt));  
-        }  
-        str = str.substr(cutAt + 1);  
-    }  
+void usage()
+{
+    cerr << "usage: resque [options] [predicate] [shape_idx 1] [shape_idx 2] " << endl;
+    cerr << "       resque [options] [predicate[,predicate...]] [shape_idx 1] ... [shape_idx N] " << endl;
+    cerr << "       resque --self-join [options] [predicate] [shape_idx] " << endl;
+    cerr << "       resque --server [--socket path] " << endl;
+    cerr << "options:" << endl;
+    cerr << "  -s, --self-join        join dataset " << DATABASE_ID_ONE << " with itself, "
+         << "symmetric predicates only test i < j" << endl;
+    cerr << "  -b, --both-directions  self join: also report the mirrored pair (j, i)" << endl;
+    cerr << "  -B, --broadcast [file]  map side join: dataset " << DATABASE_ID_ONE 
+         << " is read from file, dataset " << DATABASE_ID_TWO << " from stdin, both as "
+         << "tab separated rows; no reduce phase is needed" << endl;
+    cerr << "  -S, --server           serve framed join requests on stdin, see "
+         << "serve_requests() in resque.cpp" << endl;
+    cerr << "  -U, --socket [path]    server: accept the requests on a unix socket" << endl;
+    cerr << "  -M, --memory-budget [MB]  spill the largest tiles to disk beyond about "
+         << "MB of objects and join them partition by partition" << endl;
+    cerr << "  -T, --spill-dir [dir]  where the spilled tiles go, $TMPDIR or /tmp "
+         << "by default" << endl;
+    cerr << "  -P, --plan [name]      filter algorithm of the tiles: nested, sweep, "
+         << "index or auto (the default) to pick the cheapest per tile" << endl;
+    cerr << "  -L, --plan-log [file]  append the plan, estimated and actual cost of "
+         << "every tile to file (- for stderr)" << endl;
+    cerr << "  -t, --threads [n]      scan the input records, and refine the candidate "
+         << "pairs of a large tile, on n threads" << endl;
+    cerr << "  -C, --cache-dir [dir]  stream the tiles joined before with the same "
+         << "records and arguments from a result cache in dir" << endl;
+    cerr << "  -z, --cache-size [MB]  evict the least recently used results beyond "
+         << "MB (1024 by default, 0 for no bound)" << endl;
+    cerr << "  -J, --join-mode [mode]  pairs (the default), or semi (anti) to print "
+         << "each record of dataset " << DATABASE_ID_ONE << " with (without) a match once, "
+         << "or count for a line per tile: tile count, or object-count for every record "
+         << "of dataset " << DATABASE_ID_ONE << " followed by its number of matches" << endl;
+    cerr << "  -A, --sum-area         count and object-count: add a column with the "
+         << "summed area of the intersections" << endl;
+    cerr << "  -I, --incremental [dir]  the input is a delta: join it with itself and "
+         << "with the tile states in dir, then add it to them" << endl;
+    cerr << "  -e, --estimate         instead of joining, estimate every tile from a "
+         << "sample of up to " << ESTIMATE_SAMPLE << " records per dataset and print a "
+         << "tab separated line: tile plan size_1 size_2 sample_1 sample_2 "
+         << "model_candidates candidates pairs cost; a last line * - ... holds the "
+         << "totals" << endl;
+    cerr << "  -X, --stats [file]     write the count, vertices, extent, coverage and "
+         << "a " << STATS_GRID << "x" << STATS_GRID << " histogram of every tile and "
+         << "dataset to file, see tile_stats.h; with --estimate nothing is joined" << endl;
+    cerr << "  -m, --mbr-columns i[,j...]  xmin, ymin, xmax, ymax are precomputed in "
+         << "columns i..i+3 (one index per dataset or one for all); without it the "
+         << "box is scanned from the WKT text" << endl;
+}
 
-    if(str.length() > 0) {  
-        result.push_back(str);  
-    }  
-    return result;  
-}  
+// Splits a line of the reducer input into its fields and scans its WKT,
+// the part of reading a record that touches no shared state; r.error is
+// set for a record that is refused.
+void scan_record(const string &input_line, InputRecord &r)
+{
+    size_t key_pos = input_line.find_first_of(tab);
+    r.key = input_line.substr(0, key_pos);
+    r.error.clear();
+
+    // for local version
+    // fiedls[0] is the database id in local version
+    // fiedls[1] is the object id in local version
+    // fields = split(value, tab);
+    // database_id = atoi(fields[0].c_str());
+    // object_id = atoi(fields[1].c_str());
+
+
+    // for hive version
+    // fiedls[1] is the database id in hive version
+    // fiedls[2] is the object id in hive version
+
+    vector<string> fields = split(input_line.substr(key_pos + 1), sep);
+    r.database_id = atoi(fields[1].c_str());
+    r.object_id = atoi(fields[2].c_str());
+
+    // fields[shape_idx[d - 1]] is the polygon for the d-th input file;
+    // a self join may still be fed two copies of the dataset, libresque
+    // keeps every object once per tile
+    if (self_join) {
+        r.database_id = DATABASE_ID_ONE;
+    }
+    else if (r.database_id < DATABASE_ID_ONE || r.database_id > num_datasets) {
+        std::stringstream error;
+        error << "wrong database id : " << r.database_id;
+        r.error = error.str();
+        return;
+    }
+    int shape = shape_idx[r.database_id - 1];
+
+    // the record is stored with tabs, the WKT keeps its place inside it
+    r.record.clear();
+    for (size_t i = 0; i < fields.size(); ++i) {
+        if (i != 0) {
+            r.record += tab;
+        }
+        r.record += fields[i];
+    }
+    r.wkt_pos = wkt_offset(fields, shape, tab);
+    r.wkt_len = fields[shape].length();
+
+    // the box and vertices as libresque would find them; an estimate only
+    // needs them for the statistics
+    const string &wkt = fields[shape];
+    wkt_extent ext;
+    r.from_columns = record_box(fields, r.database_id, r.box) != NULL;
+    r.has_box = r.from_columns;
+    r.num_points = 0;
+    if (estimate && stats_file == NULL) {
+        return;
+    }
+    r.has_box = r.from_columns || scan_wkt_envelope(wkt, ext);
+    if (r.from_columns || !r.has_box) {
+        r.num_points = count_wkt_points(wkt, 0, wkt.length());
+    }
+    else {
+        r.box[0] = ext.min_x;
+        r.box[1] = ext.min_y;
+        r.box[2] = ext.max_x;
+        r.box[3] = ext.max_y;
+        r.num_points = ext.num_points;
+    }
+}
 
-bool join_intersects() 
+// Adds a scanned record to the statistics, the estimate samples or the
+// join, in input order.
+bool store_record(const InputRecord &r)
 {
-    // cerr << "---------------------------------------------------" << endl;
-    bool success = false;
-    bool flag = false; 
+    if (!r.error.empty()) {
+        cerr << r.error << endl;
+        return false;
+    }
 
-    string key;
-    polymap::iterator iter;
+    if (stats_file != NULL) {
+        wkt_extent ext = {r.box[0], r.box[1], r.box[2], r.box[3], r.num_points};
+        tile_stats[r.key][r.database_id].add(r.has_box ? &ext : NULL, r.num_points);
+    }
 
-    // for each tile (key) in the input stream 
-    try { 
-        for (iter = polydata.begin(); iter != polydata.end(); iter++) {
-            key = iter->first;
-
-            map<int, Geometry*>  poly_set_one = polydata[key][DATABASE_ID_ONE];
-            map<int, Geometry*>  poly_set_two = polydata[key][DATABASE_ID_TWO];
-
-            int len1 = poly_set_one.size();
-            int len2 = poly_set_two.size();
-
-            // cerr << "len1 = " << len1 << endl;
-            // cerr << "len2 = " << len2 << endl;
-
-            // should use iterator, update later
-            for (int i = 0; i < len1 ; i++) {
-                const Geometry* geom1 = poly_set_one[i];
-                const Envelope * env1 = geom1->getEnvelopeInternal();
-
-                for (int j = 0; j < len2 ; j++) {
-                    const Geometry* geom2 = poly_set_two[j];
-                    const Envelope * env2 = geom2->getEnvelopeInternal();
-
-                    // data[key][object_id] = input_line;
-                    if (env1->intersects(env2) && geom1->intersects(geom2)) {
-                        cout << data[key][DATABASE_ID_ONE][i] << sep << data[key][DATABASE_ID_TWO][j] << endl; 
-                        if (flag == false) {
-                            flag = true;
-                        }
-                    }
-                } // end of for (int j = 0; j < len2 ; j++) 
-            } // end of for (int i = 0; i < len1 ; i++) 	
-        } // end of for (iter = polydata.begin(); iter != polydata.end(); iter++)
-    } // end of try
-    catch (Tools::Exception& e) {
-        std::cerr << "******ERROR******" << std::endl;
-        std::string s = e.what();
-        std::cerr << s << std::endl;
-        return -1;
-    } // end of catch
-
-    success = true ;
-    return success;
+    if (estimate) {
+        // reservoir sampling: the n-th record of the dataset replaces a
+        // random one of the sample with probability ESTIMATE_SAMPLE / n
+        TileSample &sample = tile_samples[r.key];
+        if (self_join && !sample.self_join_ids.insert(r.object_id).second) {
+            return true;
+        }
+        vector<SampledRecord> &records = sample.records[r.database_id - 1];
+        long seen = sample.size[r.database_id - 1]++;
+        long slot = seen < ESTIMATE_SAMPLE ? seen : random() % (seen + 1);
+        if (slot < ESTIMATE_SAMPLE) {
+            if (slot == (long) records.size()) {
+                records.push_back(SampledRecord());
+            }
+            SampledRecord &s = records[slot];
+            s.record = r.record;
+            s.wkt_pos = r.wkt_pos;
+            s.wkt_len = r.wkt_len;
+            s.has_box = r.from_columns;
+            copy(r.box, r.box + 4, s.box);
+        }
+        return true;
+    }
+
+    if (resque_add_scanned_record(join, r.key.c_str(), r.database_id, r.object_id,
+                r.record.data(), r.record.length(), r.wkt_pos, r.wkt_len,
+                r.has_box ? r.box : NULL, r.num_points) < 0) {
+        cerr << "******ERROR******" << endl;
+        cerr << resque_error(join) << endl;
+        return false;
+    }
+    if (cache != NULL) {
+        tile_digests[r.key].add(r.database_id, r.record.data(), r.record.length());
+    }
+    return true;
 }
 
-bool join_touches() 
+// With --threads, one thread reads the input in blocks of whole lines,
+// the scanning threads split the blocks into records and scan them, and
+// the calling thread stores them in input order, so the tiles get the
+// same records in the same order as from a single thread. The reader
+// takes a block at a time as getline() would take a stdio lock for every
+// character once there are threads. At most INPUT_BLOCKS_PER_THREAD
+// blocks per scanning thread are read and not yet stored.
+struct InputBatch {
+    long seq;
+    string text;                        // whole lines
+    vector<InputRecord> records;
+};
+
+struct InputPipeline {
+    istream *in;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    deque<InputBatch*> unscanned;
+    map<long, InputBatch*> scanned;     // by seq
+    long read;                          // batches read
+    long stored;                        // batches stored
+    long max_pending;                   // bound on read - stored
+    bool done;                          // the input is all read
+    bool stop;                          // a record was refused
+};
+
+static void* input_reader(void *arg)
 {
-    // cerr << "---------------------------------------------------" << endl;
-    bool success = false;
-    bool flag = false; 
+    InputPipeline *p = (InputPipeline*) arg;
+    string cut;                         // the start of a line cut by a block
+    bool last = false;
+    while (!last) {
+        pthread_mutex_lock(&p->lock);
+        while (!p->stop && p->read - p->stored >= p->max_pending) {
+            pthread_cond_wait(&p->changed, &p->lock);
+        }
+        bool stop = p->stop;
+        pthread_mutex_unlock(&p->lock);
+        if (stop) {
+            break;
+        }
 
-    string key;
-    polymap::iterator iter;
+        InputBatch *batch = new InputBatch();
+        batch->text.swap(cut);
+        size_t have = batch->text.length();
+        batch->text.resize(have + INPUT_BLOCK);
+        p->in->read(&batch->text[have], INPUT_BLOCK);
+        size_t got = p->in->gcount();
+        last = got < INPUT_BLOCK;
+
+        // a last line without a newline is dropped, as by the getline()
+        // loop of a single thread
+        size_t end = batch->text.rfind('\n', have + got);
+        end = end == string::npos || have + got == 0 ? 0 : end + 1;
+        if (!last) {
+            cut.assign(batch->text, end, have + got - end);
+        }
+        batch->text.resize(end);
 
-    // for each tile (key) in the input stream 
-    try { 
-        for (iter = polydata.begin(); iter != polydata.end(); iter++) {
-            key = iter->first;
-
-            map<int, Geometry*>  poly_set_one = polydata[key][DATABASE_ID_ONE];
-            map<int, Geometry*>  poly_set_two = polydata[key][DATABASE_ID_TWO];
-
-            int len1 = poly_set_one.size();
-            int len2 = poly_set_two.size();
-
-            // cerr << "len1 = " << len1 << endl;
-            // cerr << "len2 = " << len2 << endl;
-
-            // should use iterator, update later
-            for (int i = 0; i < len1 ; i++) {
-                const Geometry* geom1 = poly_set_one[i];
-                const Envelope * env1 = geom1->getEnvelopeInternal();
-
-                for (int j = 0; j < len2 ; j++) {
-                    const Geometry* geom2 = poly_set_two[j];
-                    const Envelope * env2 = geom2->getEnvelopeInternal();
-
-                    // data[key][object_id] = input_line;
-                    if (geom1->touches(geom2)) {
-                        cout << data[key][DATABASE_ID_ONE][i] << sep << data[key][DATABASE_ID_TWO][j] << endl; 
-                        if (flag == false) {
-                            flag = true;
-                        }
-                    }
-                } // end of for (int j = 0; j < len2 ; j++) 
-            } // end of for (int i = 0; i < len1 ; i++) 	
-        } // end of for (iter = polydata.begin(); iter != polydata.end(); iter++)
-    } // end of try
-    catch (Tools::Exception& e) {
-        std::cerr << "******ERROR******" << std::endl;
-        std::string s = e.what();
-        std::cerr << s << std::endl;
-        return -1;
-    } // end of catch
-
-    success = true ;
-    return success;
+        pthread_mutex_lock(&p->lock);
+        if (batch->text.empty()) {
+            delete batch;
+        }
+        else {
+            batch->seq = p->read++;
+            p->unscanned.push_back(batch);
+        }
+        p->done = last;
+        pthread_cond_broadcast(&p->changed);
+        pthread_mutex_unlock(&p->lock);
+    }
+    return NULL;
 }
 
-bool join_crosses() 
+static void* input_scanner(void *arg)
 {
-    // cerr << "---------------------------------------------------" << endl;
-    bool success = false;
-    bool flag = false; 
+    InputPipeline *p = (InputPipeline*) arg;
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (!p->stop && !p->done && p->unscanned.empty()) {
+            pthread_cond_wait(&p->changed, &p->lock);
+        }
+        if (p->stop || p->unscanned.empty()) {
+            break;
+        }
+        InputBatch *batch = p->unscanned.front();
+        p->unscanned.pop_front();
+        pthread_mutex_unlock(&p->lock);
+
+        const string &text = batch->text;
+        batch->records.resize(count(text.begin(), text.end(), '\n'));
+        size_t start = 0;
+        for (size_t i = 0; i < batch->records.size(); i++) {
+            size_t end = text.find('\n', start);
+            scan_record(text.substr(start, end - start), batch->records[i]);
+            start = end + 1;
+        }
+        string().swap(batch->text);
 
-    string key;
+        pthread_mutex_lock(&p->lock);
+        p->scanned[batch->seq] = batch;
+        pthread_cond_broadcast(&p->changed);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
 
-    polymap::iterator iter;
+bool read_input_parallel(istream &in)
+{
+    InputPipeline p;
+    p.in = &in;
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.changed, NULL);
+    p.read = 0;
+    p.stored = 0;
+    p.max_pending = (long) threads * INPUT_BLOCKS_PER_THREAD;
+    p.done = false;
+    p.stop = false;
+
+    vector<pthread_t> workers;
+    bool ok = true;
+    for (int t = 0; ok && t <= threads; t++) {
+        pthread_t thread;
+        ok = pthread_create(&thread, NULL, t == 0 ? input_reader : input_scanner, &p) == 0;
+        if (ok) {
+            workers.push_back(thread);
+        }
+        else {
+            cerr << "cannot start the input threads" << endl;
+        }
+    }
 
-    // for each tile (key) in the input stream 
-    try { 
-        for (iter = polydata.begin(); iter != polydata.end(); iter++) {
-            key = iter->first;
-
-            map<int, Geometry*>  poly_set_one = polydata[key][DATABASE_ID_ONE];
-            map<int, Geometry*>  poly_set_two = polydata[key][DATABASE_ID_TWO];
-
-            int len1 = poly_set_one.size();
-            int len2 = poly_set_two.size();
-
-            // cerr << "len1 = " << len1 << endl;
-            // cerr << "len2 = " << len2 << endl;
-
-            // should use iterator, update later
-            for (int i = 0; i < len1 ; i++) {
-                const Geometry* geom1 = poly_set_one[i];
-                const Envelope * env1 = geom1->getEnvelopeInternal();
-
-                for (int j = 0; j < len2 ; j++) {
-                    const Geometry* geom2 = poly_set_two[j];
-                    const Envelope * env2 = geom2->getEnvelopeInternal();
-
-                    // data[key][object_id] = input_line;
-                    if (geom1->crosses(geom2)) {
-                        cout << data[key][DATABASE_ID_ONE][i] << sep << data[key][DATABASE_ID_TWO][j] << endl; 
-                        if (flag == false) {
-                            flag = true;
-                        }
-                    }
-                } // end of for (int j = 0; j < len2 ; j++) 
-            } // end of for (int i = 0; i < len1 ; i++) 	
-        }
-    } // end of try
-    catch (Tools::Exception& e) {
-        std::cerr << "******ERROR******" << std::endl;
-        std::string s = e.what();
-        std::cerr << s << std::endl;
-        return -1;
-    } // end of catch
-
-    success = true ;
-    return success;
-}
+    for (long next = 0; ok; next++) {
+        pthread_mutex_lock(&p.lock);
+        while (p.scanned.count(next) == 0 && !(p.done && p.read == next)) {
+            pthread_cond_wait(&p.changed, &p.lock);
+        }
+        InputBatch *batch = NULL;
+        if (p.scanned.count(next) != 0) {
+            batch = p.scanned[next];
+            p.scanned.erase(next);
+        }
+        pthread_mutex_unlock(&p.lock);
+        if (batch == NULL) {
+            break;
+        }
 
+        for (size_t i = 0; ok && i < batch->records.size(); i++) {
+            ok = store_record(batch->records[i]);
+        }
+        delete batch;
 
-bool join_contains() 
-{
-    // cerr << "---------------------------------------------------" << endl;
-    bool success = false;
-    bool flag = false; 
+        pthread_mutex_lock(&p.lock);
+        p.stored++;
+        pthread_cond_broadcast(&p.changed);
+        pthread_mutex_unlock(&p.lock);
+    }
 
-    string key;
+    pthread_mutex_lock(&p.lock);
+    p.stop = !ok;
+    pthread_cond_broadcast(&p.changed);
+    pthread_mutex_unlock(&p.lock);
+    for (size_t t = 0; t < workers.size(); t++) {
+        pthread_join(workers[t], NULL);
+    }
 
-    polymap::iterator iter;
+    for (size_t b = 0; b < p.unscanned.size(); b++) {
+        delete p.unscanned[b];
+    }
+    for (map<long, InputBatch*>::iterator b = p.scanned.begin(); b != p.scanned.end(); b++) {
+        delete b->second;
+    }
+    pthread_mutex_destroy(&p.lock);
+    pthread_cond_destroy(&p.changed);
+    return ok;
+}
 
-    // for each tile (key) in the input stream 
-    try { 
-        for (iter = polydata.begin(); iter != polydata.end(); iter++) {
-            key = iter->first;
-
-            map<int, Geometry*>  poly_set_one = polydata[key][DATABASE_ID_ONE];
-            map<int, Geometry*>  poly_set_two = polydata[key][DATABASE_ID_TWO];
-
-            int len1 = poly_set_one.size();
-            int len2 = poly_set_two.size();
-
-            // cerr << "len1 = " << len1 << endl;
-            // cerr << "len2 = " << len2 << endl;
-
-            // should use iterator, update later
-            for (int i = 0; i < len1 ; i++) {
-                const Geometry* geom1 = poly_set_one[i];
-                const Envelope * env1 = geom1->getEnvelopeInternal();
-
-                for (int j = 0; j < len2 ; j++) {
-                    const Geometry* geom2 = poly_set_two[j];
-                    const Envelope * env2 = geom2->getEnvelopeInternal();
-
-                    // data[key][object_id] = input_line;
-                    if (env1->contains(env2) && geom1->contains(geom2)) {
-                        cout << data[key][DATABASE_ID_ONE][i] << sep << data[key][DATABASE_ID_TWO][j] << endl; 
-                        if (flag == false) {
-                            flag = true;
-                        }
-                    }
-                } // end of for (int j = 0; j < len2 ; j++) 
-            } // end of for (int i = 0; i < len1 ; i++) 	
-        }
-    } // end of try
-    catch (Tools::Exception& e) {
-        std::cerr << "******ERROR******" << std::endl;
-        std::string s = e.what();
-        std::cerr << s << std::endl;
-        return -1;
-    } // end of catch
-
-    success = true ;
-    return success;
+bool readSpatialInputGEOS(istream &in) 
+{
+    if (threads > 1) {
+        return read_input_parallel(in);
+    }
+
+    string input_line;
+    InputRecord r;
+    while(in && getline(in, input_line) && !in.eof()) {
+        scan_record(input_line, r);
+        if (!store_record(r)) {
+            return false;
+        }
+    }
+    return true;
 }
 
+vector<string> split(const string &str, const string &separator)  
+{  
+    vector<string> result;  
+    size_t start = 0;
+    size_t cutAt;  
 
-bool join_adjacent() 
-{
-    // cerr << "---------------------------------------------------" << endl;
-    bool success = false;
-    bool flag = false; 
+    while ((cutAt = str.find_first_of(separator, start)) != string::npos) {  
+        result.push_back(str.substr(start, cutAt - start));  
+        start = cutAt + 1;  
+    }  
 
-    string key;
+    if (start < str.length()) {  
+        result.push_back(str.substr(start));  
+    }  
+    return result;  
+}  
 
-    polymap::iterator iter;
+// box from the MBR columns of the dataset, NULL to let libresque scan the
+// WKT text
+const double* record_box(const vector<string> &fields, int database_id, double *box)
+{
+    wkt_extent ext;
+    int mbr = mbr_idx[database_id - 1];
+    if (mbr < 0 || !read_mbr_columns(fields, mbr, ext)) {
+        return NULL;
+    }
+    box[0] = ext.min_x;
+    box[1] = ext.min_y;
+    box[2] = ext.max_x;
+    box[3] = ext.max_y;
+    return box;
+}
 
-    // for each tile (key) in the input stream 
-    try { 
-        for (iter = polydata.begin(); iter != polydata.end(); iter++) {
-            key = iter->first;
-
-            map<int, Geometry*>  poly_set_one = polydata[key][DATABASE_ID_ONE];
-            map<int, Geometry*>  poly_set_two = polydata[key][DATABASE_ID_TWO];
-
-            int len1 = poly_set_one.size();
-            int len2 = poly_set_two.size();
-
-            // cerr << "len1 = " << len1 << endl;
-            // cerr << "len2 = " << len2 << endl;
-
-            // should use iterator, update later
-            for (int i = 0; i < len1 ; i++) {
-                const Geometry* geom1 = poly_set_one[i];
-                const Envelope * env1 = geom1->getEnvelopeInternal();
-
-                for (int j = 0; j < len2 ; j++) {
-                    const Geometry* geom2 = poly_set_two[j];
-                    const Envelope * env2 = geom2->getEnvelopeInternal();
-
-                    // data[key][object_id] = input_line;
-                    if (!geom1->disjoint(geom2)) {
-                        cout << data[key][DATABASE_ID_ONE][i] << sep << data[key][DATABASE_ID_TWO][j] << endl; 
-                        if (flag == false) {
-                            flag = true;
-                        }
-                    }
-                } // end of for (int j = 0; j < len2 ; j++) 
-            } // end of for (int i = 0; i < len1 ; i++) 	
-        }
-    } // end of try
-    catch (Tools::Exception& e) {
-        std::cerr << "******ERROR******" << std::endl;
-        std::string s = e.what();
-        std::cerr << s << std::endl;
-        return -1;
-    } // end of catch
-
-    success = true ;
-    return success;
+// where fields[shape] starts once the fields are joined by separator
+size_t wkt_offset(const vector<string> &fields, int shape, const string &separator)
+{
+    size_t pos = 0;
+    for (int k = 0; k < shape; k++) {
+        pos += fields[k].length() + separator.length();
+    }
+    return pos;
 }
 
+// the aggregate columns of the last tile or tuple of a count or
+// object-count join
+string aggregate_columns()
+{
+    long count = 0;
+    double area = 0.0;
+    resque_aggregate(join, &count, &area);
+
+    std::stringstream columns;
+    columns.precision(12);
+    columns << tab << count;
+    if (sum_area) {
+        columns << tab << area;
+    }
+    return columns.str();
+}
 
-bool join_disjoint() 
+// Joins every tile and prints each result tuple as its records separated
+// by ctrl+b, followed by its aggregates in object-count mode, or a line
+// per tile in count mode; pairs is the number of lines printed. With a
+// result cache, a tile found in it is streamed from there and the others
+// are stored.
+bool join_tiles(long &pairs) 
 {
-    // cerr << "---------------------------------------------------" << endl;
-    bool success = false;
-    bool flag = false; 
+    const int *ids;
+    size_t len;
+    int next;
+    string line;
+    bool count_tiles = join_mode != NULL && strcmp(join_mode, "count") == 0;
+    bool count_objects = join_mode != NULL && strcmp(join_mode, "object-count") == 0;
 
-    string key;
+    // for each tile (key) in the input stream 
+    for (size_t t = 0; t < resque_num_tiles(join); t++) {
+        const char *tile = resque_tile(join, t);
+
+        string key;
+        ostream *entry = NULL;
+        if (cache != NULL) {
+            // the line of a count names its tile, so only that tile may share it
+            long cached = 0;
+            key = cache->key(count_tiles ? cache_params + " tile " + tile : cache_params,
+                    tile_digests[tile]);
+            if (cache->fetch(key, cout, cached)) {
+                pairs += cached;
+                continue;
+            }
+            entry = cache->open_entry(key);
+        }
 
-    polymap::iterator iter;
+        if (resque_join_tile(join, tile) < 0) {
+            cerr << "******ERROR******" << endl;
+            cerr << resque_error(join) << endl;
+            if (entry != NULL) {
+                cache->abort_entry();
+            }
+            return false;
+        }
 
-    // for each tile (key) in the input stream 
-    try { 
-        for (iter = polydata.begin(); iter != polydata.end(); iter++) {
-            key = iter->first;
-
-            map<int, Geometry*>  poly_set_one = polydata[key][DATABASE_ID_ONE];
-            map<int, Geometry*>  poly_set_two = polydata[key][DATABASE_ID_TWO];
-
-            int len1 = poly_set_one.size();
-            int len2 = poly_set_two.size();
-
-            // cerr << "len1 = " << len1 << endl;
-            // cerr << "len2 = " << len2 << endl;
-
-            // should use iterator, update later
-            for (int i = 0; i < len1 ; i++) {
-                const Geometry* geom1 = poly_set_one[i];
-                const Envelope * env1 = geom1->getEnvelopeInternal();
-
-                for (int j = 0; j < len2 ; j++) {
-                    const Geometry* geom2 = poly_set_two[j];
-                    const Envelope * env2 = geom2->getEnvelopeInternal();
-
-                    // data[key][object_id] = input_line;
-                    if (geom1->disjoint(geom2)) {
-                        cout << data[key][DATABASE_ID_ONE][i] << sep << data[key][DATABASE_ID_TWO][j] << endl; 
-                        if (flag == false) {
-                            flag = true;
-                        }
-                    }
-                } // end of for (int j = 0; j < len2 ; j++) 
-            } // end of for (int i = 0; i < len1 ; i++) 	
-        }
-    } // end of try
-    catch (Tools::Exception& e) {
-        std::cerr << "******ERROR******" << std::endl;
-        std::string s = e.what();
-        std::cerr << s << std::endl;
-        return -1;
-    } // end of catch
-
-    success = true ;
-    return success;
-}
+        if (count_tiles) {
+            pairs++;
+            line = tile + aggregate_columns() + '\n';
+            cout << line;
+            if (entry != NULL) {
+                *entry << line;
+            }
+        }
 
+        // a spilled tile is joined while its tuples are read
+        int tuple_size = resque_tuple_size(join);
+        while ((next = resque_next(join, &ids)) > 0) {
+            pairs++;
+            line.clear();
+            for (int k = 0; k < tuple_size; k++) {
+                const char *record = resque_record(join, tile, resque_tuple_database(join, k), 
+                        ids[k], &len);
+                if (k != 0) {
+                    line += sep;
+                }
+                line.append(record, len);
+            }
+            if (count_objects) {
+                line += aggregate_columns();
+            }
+            line += '\n';
+            cout << line;
+            if (entry != NULL) {
+                *entry << line;
+            }
+        }
+        if (next < 0) {
+            cerr << "******ERROR******" << endl;
+            cerr << resque_error(join) << endl;
+            if (entry != NULL) {
+                cache->abort_entry();
+            }
+            return false;
+        }
+        if (entry != NULL) {
+            cache->commit_entry();
+        }
+    }
+
+    cout.flush();
+    return true;
+}
 
-bool join_equals() 
+// Estimates every tile from its sample, one line per tile as described in
+// usage(), then the totals; tiles is the number of tiles.
+bool estimate_tiles(long &tiles)
 {
-    // cerr << "---------------------------------------------------" << endl;
-    bool success = false;
-    bool flag = false; 
+    long sizes[2] = {0, 0};
+    double totals[4] = {0.0, 0.0, 0.0, 0.0};
+
+    for (map<string, TileSample>::iterator t = tile_samples.begin(); t != tile_samples.end(); t++) {
+        const char *tile = t->first.c_str();
+        TileSample &sample = t->second;
+
+        // the sample stands in for the tile, numbered by its slots
+        for (int d = 0; d < 2; d++) {
+            for (size_t r = 0; r < sample.records[d].size(); r++) {
+                SampledRecord &rec = sample.records[d][r];
+                if (resque_add_record(join, tile, d + 1, r, rec.record.data(), rec.record.length(),
+                            rec.wkt_pos, rec.wkt_len, rec.has_box ? rec.box : NULL) < 0) {
+                    cerr << "******ERROR******" << endl;
+                    cerr << resque_error(join) << endl;
+                    return false;
+                }
+            }
+        }
 
-    string key;
+        resque_estimate est;
+        if (resque_estimate_tile(join, tile, sample.size[0], sample.size[1], &est) < 0) {
+            cerr << "******ERROR******" << endl;
+            cerr << resque_error(join) << endl;
+            return false;
+        }
+        resque_clear(join);
+
+        cout << tile << tab << est.plan << tab << sample.size[0] << tab << sample.size[1]
+             << tab << sample.records[0].size() << tab << sample.records[1].size()
+             << tab << (long) (est.model_candidates + 0.5) << tab << (long) (est.candidates + 0.5)
+             << tab << (long) (est.pairs + 0.5) << tab << (long) (est.cost + 0.5) << '\n';
+
+        tiles++;
+        sizes[0] += sample.size[0];
+        sizes[1] += sample.size[1];
+        totals[0] += est.model_candidates;
+        totals[1] += est.candidates;
+        totals[2] += est.pairs;
+        totals[3] += est.cost;
+    }
 
-    polymap::iterator iter;
+    cout << '*' << tab << '-' << tab << sizes[0] << tab << sizes[1] << tab << '-' << tab << '-';
+    for (int k = 0; k < 4; k++) {
+        cout << tab << (long) (totals[k] + 0.5);
+    }
+    cout << endl;
+    return true;
+}
 
-    // for each tile (key) in the input stream 
-    try { 
-        for (iter = polydata.begin(); iter != polydata.end(); iter++) {
-            key = iter->first;
-
-            map<int, Geometry*>  poly_set_one = polydata[key][DATABASE_ID_ONE];
-            map<int, Geometry*>  poly_set_two = polydata[key][DATABASE_ID_TWO];
-
-            int len1 = poly_set_one.size();
-            int len2 = poly_set_two.size();
-
-            // cerr << "len1 = " << len1 << endl;
-            // cerr << "len2 = " << len2 << endl;
-
-            // should use iterator, update later
-            for (int i = 0; i < len1 ; i++) {
-                const Geometry* geom1 = poly_set_one[i];
-                const Envelope * env1 = geom1->getEnvelopeInternal();
-
-                for (int j = 0; j < len2 ; j++) {
-                    const Geometry* geom2 = poly_set_two[j];
-                    const Envelope * env2 = geom2->getEnvelopeInternal();
-
-                    // data[key][object_id] = input_line;
-                    if (env1->equals(env2) && geom1->equals(geom2)) {
-                        cout << data[key][DATABASE_ID_ONE][i] << sep << data[key][DATABASE_ID_TWO][j] << endl; 
-                        if (flag == false) {
-                            flag = true;
-                        }
-                    }
-                } // end of for (int j = 0; j < len2 ; j++) 
-            } // end of for (int i = 0; i < len1 ; i++) 	
-        }
-    } // end of try
-    catch (Tools::Exception& e) {
-        std::cerr << "******ERROR******" << std::endl;
-        std::string s = e.what();
-        std::cerr << s << std::endl;
-        return -1;
-    } // end of catch
-
-    success = true ;
-    return success;
+// Writes the statistics sidecar, one line per tile and dataset.
+bool write_stats()
+{
+    if (stats_file == NULL) {
+        return true;
+    }
+
+    ofstream out(stats_file);
+    out.precision(12);
+    for (map<string, map<int, TileStats> >::iterator t = tile_stats.begin(); t != tile_stats.end(); t++) {
+        for (map<int, TileStats>::iterator d = t->second.begin(); d != t->second.end(); d++) {
+            d->second.write(out, t->first, d->first);
+        }
+    }
+    out.close();
+    if (!out) {
+        cerr << "cannot write the statistics to " << stats_file << endl;
+        return false;
+    }
+    return true;
 }
 
-bool join_dwithin() 
+// Loads the broadcast dataset into the broadcast index of libresque.
+bool loadBroadcastInput(const char *path)
 {
-    // cerr << "---------------------------------------------------" << endl;
-    bool success = false;
-    bool flag = false; 
-    double distance = 5.0;
+    ifstream in(path);
+    if (!in) {
+        cerr << "cannot open broadcast file " << path << endl;
+        return false;
+    }
 
-    string key;
+    string input_line;
+    vector<string> fields;
+    int shape = shape_idx[DATABASE_ID_ONE - 1];
+    double box[4];
+    long n = 0;
 
-    polymap::iterator iter;
+    while (getline(in, input_line)) {
+        if (input_line.empty()) {
+            continue;
+        }
+        n++;
 
-    // for each tile (key) in the input stream 
-    try { 
-        for (iter = polydata.begin(); iter != polydata.end(); iter++) {
-            key = iter->first;
-
-            map<int, Geometry*>  poly_set_one = polydata[key][DATABASE_ID_ONE];
-            map<int, Geometry*>  poly_set_two = polydata[key][DATABASE_ID_TWO];
-
-            int len1 = poly_set_one.size();
-            int len2 = poly_set_two.size();
-
-            // cerr << "len1 = " << len1 << endl;
-            // cerr << "len2 = " << len2 << endl;
-
-            // should use iterator, update later
-            for (int i = 0; i < len1 ; i++) {
-                const Geometry* geom1 = poly_set_one[i];
-                BufferOp * buffer_op1 = new BufferOp(geom1);
-                const Geometry* geom_buffer1 = buffer_op1->getResultGeometry(distance);
-                const Envelope * env1 = geom_buffer1->getEnvelopeInternal();
-
-                for (int j = 0; j < len2 ; j++) {
-                    const Geometry* geom2 = poly_set_two[j];
-                    BufferOp * buffer_op2 = new BufferOp(geom2);
-                    const Geometry* geom_buffer2 = buffer_op2->getResultGeometry(distance);
-                    const Envelope * env2 = geom_buffer2->getEnvelopeInternal();
-
-                    // data[key][object_id] = input_line;
-                    if (env1->intersects(env2) && geom_buffer1->intersects(geom_buffer2)) {
-                        cout << data[key][DATABASE_ID_ONE][i] << sep << data[key][DATABASE_ID_TWO][j] << endl; 
-                        if (flag == false) {
-                            flag = true;
-                        }
-                    }
-                } // end of for (int j = 0; j < len2 ; j++) 
-            } // end of for (int i = 0; i < len1 ; i++) 	
-        }
-    } // end of try
-    catch (Tools::Exception& e) {
-        std::cerr << "******ERROR******" << std::endl;
-        std::string s = e.what();
-        std::cerr << s << std::endl;
-        return -1;
-    } // end of catch
-
-    success = true ;
-    return success;
+        fields = split(input_line, tab);
+        if ((int) fields.size() <= shape) {
+            cerr << "broadcast record " << n << " has no column " << shape << endl;
+            return false;
+        }
+
+        if (resque_broadcast_add(join, input_line.data(), input_line.length(),
+                    wkt_offset(fields, shape, tab), fields[shape].length(),
+                    record_box(fields, DATABASE_ID_ONE, box)) < 0) {
+            cerr << "******ERROR******" << endl;
+            cerr << resque_error(join) << endl;
+            return false;
+        }
+    }
+
+    if (resque_broadcast_build(join) < 0) {
+        cerr << "******ERROR******" << endl;
+        cerr << resque_error(join) << endl;
+        return false;
+    }
+    return true;
 }
 
-bool join_within() 
+// Streams dataset DATABASE_ID_TWO from stdin against the broadcast index. 
+// Pairs are written like the reducer writes them, broadcast record first, 
+// in broadcast file order for each streamed record.
+bool broadcast_join()
 {
-    // cerr << "---------------------------------------------------" << endl;
-    bool success = false;
-    bool flag = false; 
+    string input_line;
+    vector<string> fields;
+    int shape = shape_idx[DATABASE_ID_TWO - 1];
+    double box[4];
+    const int *ids;
+    size_t len;
+
+    while (cin && getline(cin, input_line) && !cin.eof()) {
+        fields = split(input_line, tab);
+        if ((int) fields.size() <= shape) {
+            cerr << "record without column " << shape << ": " << input_line << endl;
+            return false;
+        }
 
-    string key;
+        if (resque_broadcast_probe(join, input_line.data(), input_line.length(),
+                    wkt_offset(fields, shape, tab), fields[shape].length(),
+                    record_box(fields, DATABASE_ID_TWO, box)) < 0) {
+            cerr << "******ERROR******" << endl;
+            cerr << resque_error(join) << endl;
+            return false;
+        }
 
-    polymap::iterator iter;
+        while (resque_next(join, &ids) > 0) {
+            const char *record = resque_broadcast_record(join, ids[0], &len);
+            cout.write(record, len);
+            cout << sep << input_line << '\n';
+        }
+    }
 
-    // for each tile (key) in the input stream 
-    try { 
-        for (iter = polydata.begin(); iter != polydata.end(); iter++) {
-            key = iter->first;
-
-            map<int, Geometry*>  poly_set_one = polydata[key][DATABASE_ID_ONE];
-            map<int, Geometry*>  poly_set_two = polydata[key][DATABASE_ID_TWO];
-
-            int len1 = poly_set_one.size();
-            int len2 = poly_set_two.size();
-
-            // cerr << "len1 = " << len1 << endl;
-            // cerr << "len2 = " << len2 << endl;
-
-            // should use iterator, update later
-            for (int i = 0; i < len1 ; i++) {
-                const Geometry* geom1 = poly_set_one[i];
-                const Envelope * env1 = geom1->getEnvelopeInternal();
-
-                for (int j = 0; j < len2 ; j++) {
-                    const Geometry* geom2 = poly_set_two[j];
-                    const Envelope * env2 = geom2->getEnvelopeInternal();
-
-                    // data[key][object_id] = input_line;
-                    if (geom1->within(geom2)) {
-                        cout << data[key][DATABASE_ID_ONE][i] << sep << data[key][DATABASE_ID_TWO][j] << endl; 
-                        if (flag == false) {
-                            flag = true;
-                        }
-                    }
-                } // end of for (int j = 0; j < len2 ; j++) 
-            } // end of for (int i = 0; i < len1 ; i++) 	
-        }
-    } // end of try
-    catch (Tools::Exception& e) {
-        std::cerr << "******ERROR******" << std::endl;
-        std::string s = e.what();
-        std::cerr << s << std::endl;
-        return -1;
-    } // end of catch
-
-    success = true ;
-    return success;
+    cout.flush();
+    return true;
 }
 
+// Frees the tiles of the last join, and the result cache with an entry
+// it left unfinished.
+bool cleanup()
+{
+    if (join != NULL) {
+        resque_clear(join);
+    }
+    delete cache;
+    cache = NULL;
+    tile_digests.clear();
+    tile_samples.clear();
+    tile_stats.clear();
+    return true;
+}
 
-bool join_overlaps() 
+// Server mode. A request is a header line
+//
+//     JOIN <lines> [options] <predicate> <shape_idx 1> ... 
+//
+// with the arguments of a resque command line, followed by <lines> lines of
+// reducer input. The reply is the joined records, as resque prints them, 
+// then a line "END <pairs>" (the tiles for --estimate); a request that
+// fails is answered with a single line "ERROR <reason>" instead. "QUIT"
+// ends the session and "SHUTDOWN" also stops a socket server, which
+// shutdown tells. The process and the libraries it loaded stay warm across
+// requests.
+bool serve_requests(bool &shutdown)
 {
-    // cerr << "---------------------------------------------------" << endl;
-    bool success = false;
-    bool flag = false; 
+    string header;
+    string line;
+
+    while (getline(cin, header)) {
+        vector<string> args;
+        vector<string> words = split(header, " ");
+        for (size_t i = 0; i < words.size(); i++) {
+            if (!words[i].empty()) {
+                args.push_back(words[i]);
+            }
+        }
 
-    string key;
+        if (args.empty()) {
+            continue;
+        }
+        if (args[0] == "QUIT") {
+            return true;
+        }
+        if (args[0] == "SHUTDOWN") {
+            shutdown = true;
+            return true;
+        }
+        if (args[0] != "JOIN" || args.size() < 2) {
+            // the framing is lost, end the session
+            cout << "ERROR bad request header" << endl;
+            return true;
+        }
 
-    polymap::iterator iter;
+        long num_lines = strtol(args[1].c_str(), NULL, 10);
+        std::stringstream body;
+        for (long i = 0; i < num_lines && getline(cin, line); i++) {
+            body << line << '\n';
+        }
 
-    // for each tile (key) in the input stream 
-    try { 
-        for (iter = polydata.begin(); iter != polydata.end(); iter++) {
-            key = iter->first;
-
-            map<int, Geometry*>  poly_set_one = polydata[key][DATABASE_ID_ONE];
-            map<int, Geometry*>  poly_set_two = polydata[key][DATABASE_ID_TWO];
-
-            int len1 = poly_set_one.size();
-            int len2 = poly_set_two.size();
-
-            // cerr << "len1 = " << len1 << endl;
-            // cerr << "len2 = " << len2 << endl;
-
-            // should use iterator, update later
-            for (int i = 0; i < len1 ; i++) {
-                const Geometry* geom1 = poly_set_one[i];
-                const Envelope * env1 = geom1->getEnvelopeInternal();
-
-                for (int j = 0; j < len2 ; j++) {
-                    const Geometry* geom2 = poly_set_two[j];
-                    const Envelope * env2 = geom2->getEnvelopeInternal();
-
-                    // data[key][object_id] = input_line;
-                    if (geom1->overlaps(geom2)) {
-                        cout << data[key][DATABASE_ID_ONE][i] << sep << data[key][DATABASE_ID_TWO][j] << endl; 
-                        if (flag == false) {
-                            flag = true;
-                        }
-                    }
-                } // end of for (int j = 0; j < len2 ; j++) 
-            } // end of for (int i = 0; i < len1 ; i++) 	
-        }
-    } // end of try
-    catch (Tools::Exception& e) {
-        std::cerr << "******ERROR******" << std::endl;
-        std::string s = e.what();
-        std::cerr << s << std::endl;
-        return -1;
-    } // end of catch
-
-    success = true ;
-    return success;
+        // args[1] stands in for argv[0]
+        vector<char*> argv;
+        for (size_t i = 1; i < args.size(); i++) {
+            argv.push_back(const_cast<char*>(args[i].c_str()));
+        }
+        argv.push_back(NULL);
+
+        // a request cannot start a server of its own
+        reset_configuration();
+        const char *serving_path = socket_path;
+        server_mode = false;
+        bool configured = configure(argv.size() - 1, &argv[0]);
+        bool nested_server = server_mode;
+        server_mode = true;
+        socket_path = serving_path;
+
+        long pairs = 0;
+        if (!configured || num_datasets == 0) {
+            cout << "ERROR bad join arguments" << endl;
+        }
+        else if (nested_server) {
+            cout << "ERROR no server in a join request" << endl;
+        }
+        else if (broadcast_file != NULL) {
+            cout << "ERROR no broadcast join in server mode" << endl;
+        }
+        else if (!readSpatialInputGEOS(body)
+                || !(estimate ? estimate_tiles(pairs) : join_tiles(pairs)) || !write_stats()) {
+            cout << "ERROR join failed" << endl;
+        }
+        else {
+            cout << "END " << pairs << endl;
+        }
+        cleanup();
+    }
+
+    return true;
 }
 
-bool cleanup(){ return true; }
+// Serves the connections to a unix socket one after the other, each as a
+// session of serve_requests(), until a SHUTDOWN request.
+bool serve_socket(const char *path)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return false;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(fd, 8) < 0) {
+        perror(path);
+        close(fd);
+        return false;
+    }
+
+    // a client going away must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    bool shutdown = false;
+    while (!shutdown) {
+        int conn = accept(fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("accept");
+            break;
+        }
+
+        // the session reads cin and writes cout
+        dup2(conn, 0);
+        dup2(conn, 1);
+        close(conn);
+        cin.clear();
+        clearerr(stdin);
+
+        serve_requests(shutdown);
+        cout.flush();
+        cout.clear();
+    }
+
+    close(fd);
+    unlink(path);
+    return true;
+}
@@ -0,0 +1,2624 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <deque>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <cmath>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+// geos
+#include <geos/geom/PrecisionModel.h>
+#include <geos/geom/GeometryFactory.h>
+#include <geos/geom/Geometry.h>
+#include <geos/geom/prep/PreparedGeometry.h>
+#include <geos/geom/prep/PreparedGeometryFactory.h>
+#include <geos/io/WKTReader.h>
+#include <geos/util/GEOSException.h>
+
+#include <spatialindex/SpatialIndex.h>
+
+#include "resque_engine.h"
+#include "range_tree.h"
+#include "wkt_canonical.h"
+
+using namespace std;
+using namespace geos;
+using namespace geos::io;
+using namespace geos::geom;
+using namespace geos::geom::prep;
+
+// the plan of a two-way or self join tile, estimated by plan_tile() and
+// completed with the actual figures as the tile is joined
+struct TilePlan {
+    int algorithm;              // PLAN_xxx
+    size_t size_one;
+    size_t size_two;
+    double avg_points;          // vertices per object
+    double coverage;            // sum of the box areas over the tile area
+    double est_candidates;      // pairs passing the envelope filter
+    double est_cost;            // filter and refinement, in envelope tests
+    long candidates;
+    double filter_us;
+    double refine_us;
+};
+
+// an object as the plane sweep and the indexed filter see it
+struct PlanEntry {
+    int id;
+    SpatialObject *obj;
+    Envelope box;               // env, grown for st_dwithin
+
+    bool operator<(const PlanEntry &other) const {
+        return box.getMinX() < other.box.getMinX();
+    }
+};
+
+// a pair that passed the envelope filter, refined in (id1, id2) order
+struct Candidate {
+    int id1;
+    int id2;
+    SpatialObject *obj1;
+    SpatialObject *obj2;
+
+    bool operator<(const Candidate &other) const {
+        return id1 < other.id1 || (id1 == other.id1 && id2 < other.id2);
+    }
+};
+
+int join_bucket(resque_join *j, const string &key);
+void plan_tile(resque_join *j, polyset &poly_set_one, polyset &poly_set_two, TilePlan &plan);
+void plan_sample(resque_join *j, polyset &poly_set_one, polyset &poly_set_two,
+        double n1, double n2, TilePlan &plan);
+void log_plan(resque_join *j, const string &key, const TilePlan &plan, long pairs);
+long nested_loop_join(resque_join *j, polyset &poly_set_one, polyset &poly_set_two, TilePlan &plan);
+long disjoint_join(resque_join *j, polyset &poly_set_one, polyset &poly_set_two, TilePlan &plan,
+        bool count_only);
+void plane_sweep_candidates(resque_join *j, polyset &poly_set_one, polyset &poly_set_two,
+        vector<Candidate> &candidates);
+void indexed_candidates(resque_join *j, polyset &poly_set_one, polyset &poly_set_two,
+        vector<Candidate> &candidates);
+void nested_loop_candidates(resque_join *j, polyset &poly_set_one, polyset &poly_set_two,
+        vector<Candidate> &candidates);
+void equals_candidates(resque_join *j, polyset &poly_set_one, polyset &poly_set_two,
+        vector<Candidate> &candidates);
+void containment_candidates(resque_join *j, polyset &poly_set_one, polyset &poly_set_two,
+        vector<Candidate> &candidates);
+long refine_candidates(resque_join *j, vector<Candidate> &candidates);
+bool parallel_refine(resque_join *j, vector<Candidate> &candidates, vector<char> &hits);
+void sample_envelopes(polyset &poly_set, vector<const Envelope*> &sample);
+double estimate_pairs(resque_join *j, polyset &poly_set_one, polyset &poly_set_two, const int jp);
+int join_bucket_multiway(resque_join *j, const string &key);
+long join_bucket_outer(resque_join *j, const string &key);
+long aggregate_tile(resque_join *j, const string &tile, long tuples);
+size_t object_bytes(SpatialObject *obj);
+bool enforce_budget(resque_join *j);
+void free_tile_objects(resque_join *j, const string &tile);
+Envelope spill_envelope(resque_join *j, const Envelope &env);
+int spill_cell(const SpillRun *run, double x, double y);
+string partition_path(const SpillRun *run, int p);
+SpillRun* create_run(resque_join *j, const Envelope &extent);
+bool open_run(resque_join *j, SpillRun *run);
+void close_run(resque_join *j, SpillRun *run);
+void remove_run(resque_join *j, SpillRun *run);
+bool spill_tile(resque_join *j, const string &tile);
+bool spill_object(resque_join *j, SpillRun *run, int database_id, int object_id,
+        SpatialObject *obj);
+bool spill_line(SpillRun *run, const Envelope &env, const string &line);
+SpillRun* split_partition(resque_join *j, SpillRun *run, int p);
+void end_spilled_tile(resque_join *j);
+long join_partition(resque_join *j);
+long count_spilled_tile(resque_join *j, const string &tile);
+
+resque_join* create_join(int num_datasets, const vector<int> &predicates)
+{
+    resque_join *j = new resque_join();
+    j->num_datasets = num_datasets;
+    j->predicates = predicates;
+    j->dwithin_distance = 10.0;
+    j->self_join = false;
+    j->both_directions = false;
+    j->tuple_size = 0;
+    j->next_result = 0;
+    j->broadcast_storage = NULL;
+    j->broadcast_index = NULL;
+    j->plan = PLAN_AUTO;
+    j->plan_log = NULL;
+    j->plan_log_file = NULL;
+    j->threads = 1;
+    j->join_mode = JOIN_PAIRS;
+    j->aggregate_area = false;
+    j->memory_budget = 0;
+    j->memory_used = 0;
+    j->open_run = NULL;
+    j->join_run = NULL;
+    const char *tmpdir = getenv("TMPDIR");
+    j->spill_dir = tmpdir != NULL && *tmpdir != '\0' ? tmpdir : "/tmp";
+    j->factory = new GeometryFactory(new PrecisionModel(), OSM_SRID);
+    j->wkt_reader = new WKTReader(j->factory);
+    return j;
+}
+
+void destroy_join(resque_join *j)
+{
+    clear_tiles(j);
+    for (size_t i = 0; i < j->broadcast_objects.size(); i++) {
+        PreparedGeometryFactory::destroy(j->broadcast_prepared[i]);
+        free_object(j->broadcast_objects[i]);
+    }
+    delete j->broadcast_index;
+    delete j->broadcast_storage;
+    delete j->plan_log_file;
+    delete j->wkt_reader;
+    delete j->factory;
+    delete j;
+}
+
+SpatialObject* make_object(resque_join *j, const string &record,
+        size_t wkt_pos, size_t wkt_len, const wkt_extent *box)
+{
+    SpatialObject *obj = new SpatialObject();
+    obj->geom = NULL;
+    obj->locator = NULL;
+    obj->edge_index = NULL;
+    obj->record = record;
+    obj->wkt_pos = wkt_pos;
+    obj->wkt_len = wkt_len;
+
+    // the box comes from the MBR columns or a scan of the WKT text, the
+    // geometry is parsed only when neither works
+    wkt_extent ext;
+    string wkt = record.substr(wkt_pos, wkt_len);
+    if (box != NULL) {
+        ext = *box;
+    }
+    if (box != NULL || scan_wkt_envelope(wkt, ext)) {
+        obj->env.init(ext.min_x, ext.max_x, ext.min_y, ext.max_y);
+        obj->num_points = box == NULL ? ext.num_points
+            : box->num_points > 0 ? box->num_points : count_wkt_points(wkt, 0, wkt.length());
+    }
+    else {
+        try {
+            obj->env = *get_geometry(j, obj)->getEnvelopeInternal();
+            obj->num_points = obj->geom->getNumPoints();
+        }
+        catch (geos::util::GEOSException& e) {
+            j->error = e.what();
+            free_object(obj);
+            return NULL;
+        }
+    }
+
+    obj->is_point = !obj->env.isNull()
+        && obj->env.getWidth() == 0 && obj->env.getHeight() == 0
+        && is_point_wkt(wkt);
+    return obj;
+}
+
+SpatialObject* make_object(resque_join *j, Geometry *geom)
+{
+    SpatialObject *obj = new SpatialObject();
+    obj->geom = geom;
+    obj->locator = NULL;
+    obj->edge_index = NULL;
+    obj->wkt_pos = 0;
+    obj->wkt_len = 0;
+    obj->num_points = geom->getNumPoints();
+    obj->env = *geom->getEnvelopeInternal();
+    obj->is_point = geom->getGeometryTypeId() == GEOS_POINT;
+    return obj;
+}
+
+int add_object(resque_join *j, const string &tile, int database_id, int object_id,
+        SpatialObject *obj)
+{
+    if (j->self_join) {
+        database_id = DATABASE_ID_ONE;
+    }
+    else if (database_id < DATABASE_ID_ONE || database_id > j->num_datasets) {
+        j->error = "wrong database id";
+        free_object(obj);
+        return -1;
+    }
+
+    map<string, SpillRun*>::iterator s = j->spilled.find(tile);
+    if (s != j->spilled.end()) {
+        if (j->self_join && s->second->live.count(make_pair(database_id, object_id)) > 0) {
+            free_object(obj);
+            return 0;
+        }
+        if (!spill_object(j, s->second, database_id, object_id, obj)) {
+            return -1;
+        }
+        return enforce_budget(j) ? 1 : -1;
+    }
+
+    polyset &poly_set = j->polydata[tile][database_id];
+    polyset::iterator o = poly_set.find(object_id);
+    if (o != poly_set.end()) {
+        if (j->self_join) {
+            // a self join may still be fed two copies of the dataset; every
+            // object is kept once per tile
+            free_object(obj);
+            return 0;
+        }
+        size_t bytes = object_bytes(o->second);
+        j->tile_bytes[tile] -= bytes;
+        j->memory_used -= bytes;
+        free_object(o->second);
+        o->second = obj;
+    }
+    else {
+        poly_set[object_id] = obj;
+    }
+
+    size_t bytes = object_bytes(obj);
+    j->tile_bytes[tile] += bytes;
+    j->memory_used += bytes;
+
+    return enforce_budget(j) ? 1 : -1;
+}
+
+// Spills the largest tile in memory, the one that frees the most, once the
+// budget is exceeded; false when it could not be spilled.
+bool enforce_budget(resque_join *j)
+{
+    if (j->memory_budget == 0 || j->memory_used <= j->memory_budget || j->tile_bytes.empty()
+            || !can_spill(j)) {
+        return true;
+    }
+    map<string, size_t>::iterator largest = j->tile_bytes.begin();
+    for (map<string, size_t>::iterator t = j->tile_bytes.begin(); t != j->tile_bytes.end(); t++) {
+        if (t->second > largest->second) {
+            largest = t;
+        }
+    }
+    return spill_tile(j, largest->first);
+}
+
+// A rough footprint: the record, and about twice the WKT text once the
+// geometry is parsed from it.
+size_t object_bytes(SpatialObject *obj)
+{
+    size_t bytes = sizeof(SpatialObject) + obj->record.length();
+    if (obj->wkt_len > 0) {
+        return bytes + 2 * obj->wkt_len;
+    }
+    if (obj->geom != NULL) {
+        return bytes + 3 * sizeof(double) * obj->geom->getNumPoints();
+    }
+    return bytes;
+}
+
+void free_object(SpatialObject *obj)
+{
+    delete obj->geom;
+    delete obj->locator;
+    delete obj->edge_index;
+    delete obj;
+}
+
+const Geometry* get_geometry(resque_join *j, SpatialObject *obj)
+{
+    if (obj->geom == NULL) {
+        obj->geom = j->wkt_reader->read(obj->record.substr(obj->wkt_pos, obj->wkt_len));
+    }
+    return obj->geom;
+}
+
+// NULL unless obj is a polygon or multipolygon
+const PointLocator* get_locator(resque_join *j, SpatialObject *obj)
+{
+    if (obj->locator == NULL) {
+        obj->locator = new PointLocator(get_geometry(j, obj));
+    }
+    return obj->locator->valid() ? obj->locator : NULL;
+}
+
+// NULL unless obj is a polygon or multipolygon
+const EdgeIndex* get_edge_index(resque_join *j, SpatialObject *obj)
+{
+    if (obj->edge_index == NULL) {
+        obj->edge_index = new EdgeIndex(get_geometry(j, obj));
+    }
+    return obj->edge_index->valid() ? obj->edge_index : NULL;
+}
+
+// predicates answered from the boundaries of two polygons, see edge_index.h
+static bool edge_predicate(int jp)
+{
+    return jp == ST_TOUCHES || jp == ST_ADJACENT;
+}
+
+// st_touches or st_adjacent between two polygons from their edge indexes:
+// 1 or 0, or -1 when the edges cannot tell and GEOS has to
+static int edge_relate(resque_join *j, SpatialObject *obj1, SpatialObject *obj2, const int jp)
+{
+    if (!edge_predicate(jp) || obj1->is_point || obj2->is_point) {
+        return -1;
+    }
+    const EdgeIndex *edges1 = get_edge_index(j, obj1);
+    const EdgeIndex *edges2 = edges1 != NULL ? get_edge_index(j, obj2) : NULL;
+    if (edges2 == NULL) {
+        return -1;
+    }
+    int relation = edges1->relate(*edges2, jp == ST_ADJACENT);
+    if (relation == EDGES_UNKNOWN) {
+        return -1;
+    }
+    return jp == ST_ADJACENT ? relation == EDGES_MEET : relation == EDGES_TOUCH;
+}
+
+// jp between a point and a polygon from the PointLocator of the polygon,
+// without parsing the point: 1 or 0, or -1 when the pair is not a point
+// and a polygon or the point is too close to an edge to locate
+static int point_relate(resque_join *j, SpatialObject *obj1, SpatialObject *obj2, const int jp)
+{
+    if (!point_fast_path(jp) || obj1->is_point == obj2->is_point) {
+        return -1;
+    }
+    SpatialObject *point = obj1->is_point ? obj1 : obj2;
+    const PointLocator *locator = get_locator(j, obj1->is_point ? obj2 : obj1);
+    if (locator == NULL) {
+        return -1;
+    }
+    int location = locator->locate(point->env.getMinX(), point->env.getMinY());
+    if (location == POINT_UNKNOWN) {
+        return -1;
+    }
+    return point_predicate(jp, obj1->is_point, location);
+}
+
+// envelope first; the geometries are only parsed for a surviving pair
+bool join_objects(resque_join *j, SpatialObject *obj1, SpatialObject *obj2, const int jp)
+{
+    if (!envelope_filter(&obj1->env, &obj2->env, jp, j->dwithin_distance)) {
+        return false;
+    }
+    int related = edge_relate(j, obj1, obj2, jp);
+    if (related < 0) {
+        related = point_relate(j, obj1, obj2, jp);
+    }
+    if (related >= 0) {
+        return related != 0;
+    }
+    return join_with_predicate(get_geometry(j, obj1), get_geometry(j, obj2),
+            &obj1->env, &obj2->env, jp, j->dwithin_distance);
+}
+
+void report_pair(resque_join *j, int id1, int id2)
+{
+    j->results.push_back(id1);
+    j->results.push_back(id2);
+}
+
+// Joins a two-way or self join tile; plan_tile() picks the filter
+// algorithm. The pairs come out in the order of the nested loop whatever
+// the plan. A point paired with a polygon is refined by the PointLocator of
+// the polygon, see point_relate(). A count join of st_disjoint only counts
+// its pairs, see disjoint_join().
+int join_bucket(resque_join *j, const string &key)
+{
+    int jp = j->predicates[0];
+    polyset &poly_set_one = j->polydata[key][DATABASE_ID_ONE];
+    polyset &poly_set_two = j->self_join ? poly_set_one : j->polydata[key][DATABASE_ID_TWO];
+
+    TilePlan plan;
+    plan_tile(j, poly_set_one, poly_set_two, plan);
+
+    struct timeval start;
+    struct timeval filtered;
+    struct timeval end;
+    gettimeofday(&start, NULL);
+    long pairs = -1;
+
+    if (jp == ST_DISJOINT) {
+        pairs = disjoint_join(j, poly_set_one, poly_set_two, plan, j->join_mode == JOIN_COUNT);
+        filtered = start;
+    }
+    else if (plan.algorithm == PLAN_NESTED_LOOP && j->threads <= 1) {
+        // the envelope filter and the refinement interleave
+        pairs = nested_loop_join(j, poly_set_one, poly_set_two, plan);
+        filtered = start;
+    }
+    else {
+        vector<Candidate> candidates;
+        if (plan.algorithm == PLAN_NESTED_LOOP) {
+            nested_loop_candidates(j, poly_set_one, poly_set_two, candidates);
+        }
+        else if (plan.algorithm == PLAN_PLANE_SWEEP) {
+            plane_sweep_candidates(j, poly_set_one, poly_set_two, candidates);
+        }
+        else if (plan.algorithm == PLAN_HASHED) {
+            equals_candidates(j, poly_set_one, poly_set_two, candidates);
+        }
+        else if (plan.algorithm == PLAN_RANGE_TREE) {
+            containment_candidates(j, poly_set_one, poly_set_two, candidates);
+        }
+        else {
+            indexed_candidates(j, poly_set_one, poly_set_two, candidates);
+        }
+        gettimeofday(&filtered, NULL);
+        plan.candidates = candidates.size();
+        pairs = refine_candidates(j, candidates);
+    }
+
+    gettimeofday(&end, NULL);
+    plan.filter_us = (filtered.tv_sec - start.tv_sec) * 1e6 + (filtered.tv_usec - start.tv_usec);
+    plan.refine_us = (end.tv_sec - filtered.tv_sec) * 1e6 + (end.tv_usec - filtered.tv_usec);
+    log_plan(j, key, plan, pairs);
+
+    return pairs;
+}
+
+static double log2n(double n)
+{
+    return n > 1 ? log(n) / log(2.0) : 0.0;
+}
+
+// the pairs a tile of n1 and n2 objects tests without any filter
+static double all_pairs(resque_join *j, double n1, double n2)
+{
+    return j->self_join ? n1 * (n1 - 1) / (is_symmetric(j->predicates[0]) ? 2 : 1) : n1 * n2;
+}
+
+void plan_tile(resque_join *j, polyset &poly_set_one, polyset &poly_set_two, TilePlan &plan)
+{
+    plan_sample(j, poly_set_one, poly_set_two, poly_set_one.size(), poly_set_two.size(), plan);
+}
+
+// Estimates the cost of each filter algorithm for the tile and picks the
+// cheapest, unless j->plan forces one. From the cardinalities, the average
+// box sides and the tile extent, the envelope filter passes a fraction
+// x_overlap * y_overlap of the pairs, each refined at a cost that grows
+// with the vertices of the pair. A nested loop tests every pair; a plane
+// sweep sorts both sides and tests the pairs overlapping on x; the indexed
+// join builds an R-tree over the larger side and probes it with the other.
+// st_disjoint filters like st_intersects, see disjoint_join(); unless a
+// plan is forced, st_equals buckets its objects by box and canonical form,
+// see equals_candidates(), and st_contains and st_within probe a range
+// tree over the smaller side, see containment_candidates().
+// The sets may be a sample of a tile of n1 and n2 objects, the averages
+// come from them and the cardinalities from n1 and n2.
+void plan_sample(resque_join *j, polyset &poly_set_one, polyset &poly_set_two,
+        double n1, double n2, TilePlan &plan)
+{
+    int jp = j->predicates[0];
+    double grow = jp == ST_DWITHIN ? j->dwithin_distance : 0.0;
+
+    polyset *sides[2] = {&poly_set_one, &poly_set_two};
+    double width[2] = {0.0, 0.0};
+    double height[2] = {0.0, 0.0};
+    double area = 0.0;
+    double points = 0.0;
+    Envelope extent;
+
+    for (int s = 0; s < 2; s++) {
+        for (polyset::iterator o = sides[s]->begin(); o != sides[s]->end(); o++) {
+            const Envelope &env = o->second->env;
+            if (env.isNull()) {
+                continue;
+            }
+            width[s] += env.getWidth();
+            height[s] += env.getHeight();
+            area += env.getArea();
+            points += o->second->num_points;
+            extent.expandToInclude(&env);
+        }
+        if (!sides[s]->empty()) {
+            width[s] /= sides[s]->size();
+            height[s] /= sides[s]->size();
+        }
+    }
+
+    double pairs = all_pairs(j, n1, n2);
+
+    double tile_width = extent.getWidth() + grow;
+    double tile_height = extent.getHeight() + grow;
+    double x_overlap = tile_width > 0 ? min(1.0, (width[0] + width[1] + grow) / tile_width) : 1.0;
+    double y_overlap = tile_height > 0 ? min(1.0, (height[0] + height[1] + grow) / tile_height) : 1.0;
+
+    double sampled = poly_set_one.size() + poly_set_two.size();
+    plan.size_one = n1;
+    plan.size_two = n2;
+    plan.avg_points = sampled > 0 ? points / sampled : 0.0;
+    plan.coverage = extent.getArea() > 0 ? area / extent.getArea() : 1.0;
+    plan.est_candidates = pairs * x_overlap * y_overlap;
+    plan.candidates = 0;
+    plan.filter_us = 0;
+    plan.refine_us = 0;
+
+    double big = max(n1, n2);
+    double small = j->self_join ? n1 : min(n1, n2);
+    double cost[6];
+    cost[PLAN_NESTED_LOOP] = pairs;
+    cost[PLAN_PLANE_SWEEP] = COST_SORT * (n1 * log2n(n1) + n2 * log2n(n2))
+        + n1 + n2 + pairs * x_overlap;
+    cost[PLAN_INDEXED] = COST_INDEX_INSERT * big * log2n(big)
+        + COST_INDEX_PROBE * small * log2n(big) + plan.est_candidates;
+    cost[PLAN_HASHED] = COST_SORT * (n1 * log2n(n1) + n2 * log2n(n2))
+        + (n1 + n2) * plan.avg_points;
+    cost[PLAN_RANGE_TREE] = COST_SORT * small * log2n(small) * log2n(small)
+        + COST_INDEX_PROBE * big * log2n(small) * log2n(small) + plan.est_candidates;
+
+    plan.algorithm = j->plan;
+    if (plan.algorithm == PLAN_AUTO && jp == ST_EQUALS) {
+        // the candidates are the pairs of a bucket, about the pairs
+        plan.algorithm = PLAN_HASHED;
+    }
+    else if (plan.algorithm == PLAN_AUTO && (jp == ST_CONTAINS || jp == ST_WITHIN)) {
+        // the candidates are the contained boxes, not every box that meets
+        plan.algorithm = PLAN_RANGE_TREE;
+    }
+    else if (plan.algorithm == PLAN_AUTO) {
+        plan.algorithm = PLAN_NESTED_LOOP;
+        for (int a = PLAN_PLANE_SWEEP; a <= PLAN_INDEXED; a++) {
+            if (cost[a] < cost[plan.algorithm]) {
+                plan.algorithm = a;
+            }
+        }
+    }
+
+    plan.est_cost = cost[plan.algorithm]
+        + plan.est_candidates * COST_REFINE_VERTEX * 2 * plan.avg_points;
+}
+
+// Estimates the join of a tile from the objects it holds, taken as a
+// uniform sample of a tile of size_one and size_two objects. The plan and
+// its filter cost come from the cost model; the sample is joined and its
+// candidates and pairs are scaled by the ratio of all the pairs of the
+// tile to those of the sample. Returns -1 on error.
+int estimate_tile(resque_join *j, const string &tile, long size_one, long size_two,
+        TileEstimate &estimate)
+{
+    if (j->num_datasets > 2) {
+        j->error = "only a two-way or self join tile can be estimated";
+        return -1;
+    }
+    if (j->self_join) {
+        size_two = size_one;
+    }
+
+    polyset &poly_set_one = j->polydata[tile][DATABASE_ID_ONE];
+    polyset &poly_set_two = j->self_join ? poly_set_one : j->polydata[tile][DATABASE_ID_TWO];
+
+    TilePlan plan;
+    plan_sample(j, poly_set_one, poly_set_two, size_one, size_two, plan);
+    estimate.plan = plan.algorithm;
+    estimate.model_candidates = plan.est_candidates;
+    estimate.cost = plan.est_cost;
+
+    TilePlan sample;
+    sample.candidates = 0;
+    long pairs;
+    try {
+        if (j->predicates[0] == ST_DISJOINT) {
+            sample.algorithm = PLAN_PLANE_SWEEP;
+            pairs = disjoint_join(j, poly_set_one, poly_set_two, sample, true);
+        }
+        else {
+            vector<Candidate> candidates;
+            plane_sweep_candidates(j, poly_set_one, poly_set_two, candidates);
+            sample.candidates = candidates.size();
+            pairs = refine_candidates(j, candidates);
+        }
+    }
+    catch (geos::util::GEOSException& e) {
+        j->error = e.what();
+        return -1;
+    }
+    j->results.clear();
+    j->next_result = 0;
+
+    double sample_pairs = all_pairs(j, poly_set_one.size(), poly_set_two.size());
+    double scale = sample_pairs > 0 ? all_pairs(j, size_one, size_two) / sample_pairs : 0.0;
+    estimate.candidates = sample.candidates * scale;
+    estimate.pairs = pairs * scale;
+
+    // the refinement by the sampled candidates, unless the sample saw none
+    if (sample.candidates > 0) {
+        estimate.cost += (estimate.candidates - plan.est_candidates)
+            * COST_REFINE_VERTEX * 2 * plan.avg_points;
+    }
+    return 0;
+}
+
+// One line per tile, see resque_set_plan_log() in libresque.h.
+void log_plan(resque_join *j, const string &key, const TilePlan &plan, long pairs)
+{
+    if (j->plan_log == NULL) {
+        return;
+    }
+    ostream &log = *j->plan_log;
+    log << key << '\t' << plan_name(plan.algorithm)
+        << '\t' << plan.size_one << '\t' << plan.size_two
+        << '\t' << plan.avg_points << '\t' << plan.coverage
+        << '\t' << (long) plan.est_candidates << '\t' << plan.candidates
+        << '\t' << (long) plan.est_cost
+        << '\t' << (long) plan.filter_us << '\t' << (long) plan.refine_us
+        << '\t' << pairs << '\n';
+    log.flush();
+}
+
+long nested_loop_join(resque_join *j, polyset &poly_set_one, polyset &poly_set_two, TilePlan &plan)
+{
+    long pairs = 0;
+    int jp = j->predicates[0];
+    polyset::iterator i;
+    polyset::iterator k;
+
+    if (j->self_join) {
+        // each object is loaded once; a symmetric predicate only needs the
+        // upper triangle (i < k), the diagonal (i, i) is never reported
+        bool symmetric = is_symmetric(jp);
+
+        for (i = poly_set_one.begin(); i != poly_set_one.end(); i++) {
+            k = poly_set_one.begin();
+            if (symmetric) {
+                k = i;
+                k++;
+            }
+
+            for (; k != poly_set_one.end(); k++) {
+                if (k == i || !envelope_filter(&i->second->env, &k->second->env, jp, j->dwithin_distance)) {
+                    continue;
+                }
+                plan.candidates++;
+
+                if (join_objects(j, i->second, k->second, jp)) {
+                    report_pair(j, i->first, k->first);
+                    pairs++;
+                    if (symmetric && j->both_directions) {
+                        report_pair(j, k->first, i->first);
+                        pairs++;
+                    }
+                }
+            } // end of for (; k != poly_set_one.end(); k++)
+        } // end of for (i = poly_set_one.begin(); i != poly_set_one.end(); i++)
+
+        return pairs;
+    }
+
+    for (i = poly_set_one.begin(); i != poly_set_one.end(); i++) {
+        for (k = poly_set_two.begin(); k != poly_set_two.end(); k++) {
+            if (!envelope_filter(&i->second->env, &k->second->env, jp, j->dwithin_distance)) {
+                continue;
+            }
+            plan.candidates++;
+
+            if (join_objects(j, i->second, k->second, jp)) {
+                report_pair(j, i->first, k->first);
+                pairs++;
+            }
+        } // end of for (k = poly_set_two.begin(); k != poly_set_two.end(); k++)
+    } // end of for (i = poly_set_one.begin(); i != poly_set_one.end(); i++)
+
+    return pairs;
+}
+
+static void plan_entries(polyset &poly_set, double grow, vector<PlanEntry> &entries)
+{
+    for (polyset::iterator o = poly_set.begin(); o != poly_set.end(); o++) {
+        if (o->second->env.isNull()) {
+            continue;
+        }
+        PlanEntry entry;
+        entry.id = o->first;
+        entry.obj = o->second;
+        entry.box = o->second->env;
+        entry.box.expandBy(grow);
+        entries.push_back(entry);
+    }
+}
+
+// Queues (one, two) when it passes the envelope filter; for a self join
+// the pair was found once for both of its orders. The candidates of
+// st_disjoint are the pairs whose boxes meet, the only ones refined.
+static void add_candidate(resque_join *j, const PlanEntry &one, const PlanEntry &two,
+        vector<Candidate> &candidates)
+{
+    int jp = j->predicates[0] == ST_DISJOINT ? ST_INTERSECTS : j->predicates[0];
+
+    if (j->self_join && one.id == two.id) {
+        return;
+    }
+    if (j->self_join && is_symmetric(jp)) {
+        const PlanEntry &lo = one.id < two.id ? one : two;
+        const PlanEntry &hi = one.id < two.id ? two : one;
+        if (envelope_filter(&lo.obj->env, &hi.obj->env, jp, j->dwithin_distance)) {
+            Candidate c = {lo.id, hi.id, lo.obj, hi.obj};
+            candidates.push_back(c);
+        }
+        return;
+    }
+
+    if (envelope_filter(&one.obj->env, &two.obj->env, jp, j->dwithin_distance)) {
+        Candidate c = {one.id, two.id, one.obj, two.obj};
+        candidates.push_back(c);
+    }
+    if (j->self_join && envelope_filter(&two.obj->env, &one.obj->env, jp, j->dwithin_distance)) {
+        Candidate c = {two.id, one.id, two.obj, one.obj};
+        candidates.push_back(c);
+    }
+}
+
+static bool y_overlap(const Envelope &a, const Envelope &b)
+{
+    return a.getMinY() <= b.getMaxY() && b.getMinY() <= a.getMaxY();
+}
+
+// Both sides sorted by min x; each box is tested against the boxes of the
+// other side that start within its x range. st_dwithin grows the boxes of
+// side one by the distance (each side by half of it in a self join).
+void plane_sweep_candidates(resque_join *j, polyset &poly_set_one, polyset &poly_set_two,
+        vector<Candidate> &candidates)
+{
+    double distance = j->predicates[0] == ST_DWITHIN ? j->dwithin_distance : 0.0;
+    vector<PlanEntry> one;
+    vector<PlanEntry> two;
+
+    if (j->self_join) {
+        plan_entries(poly_set_one, distance / 2, one);
+        sort(one.begin(), one.end());
+        for (size_t a = 0; a < one.size(); a++) {
+            for (size_t b = a + 1; b < one.size() && one[b].box.getMinX() <= one[a].box.getMaxX(); b++) {
+                if (y_overlap(one[a].box, one[b].box)) {
+                    add_candidate(j, one[a], one[b], candidates);
+                }
+            }
+        }
+        return;
+    }
+
+    plan_entries(poly_set_one, distance, one);
+    plan_entries(poly_set_two, 0.0, two);
+    sort(one.begin(), one.end());
+    sort(two.begin(), two.end());
+
+    size_t a = 0;
+    size_t b = 0;
+    while (a < one.size() && b < two.size()) {
+        if (one[a].box.getMinX() <= two[b].box.getMinX()) {
+            for (size_t m = b; m < two.size() && two[m].box.getMinX() <= one[a].box.getMaxX(); m++) {
+                if (y_overlap(one[a].box, two[m].box)) {
+                    add_candidate(j, one[a], two[m], candidates);
+                }
+            }
+            a++;
+        }
+        else {
+            for (size_t m = a; m < one.size() && one[m].box.getMinX() <= two[b].box.getMaxX(); m++) {
+                if (y_overlap(one[m].box, two[b].box)) {
+                    add_candidate(j, one[m], two[b], candidates);
+                }
+            }
+            b++;
+        }
+    }
+}
+
+// An R-tree over the boxes of the larger side, probed with the other. A
+// self join indexes its side and keeps each hit of a later object once.
+void indexed_candidates(resque_join *j, polyset &poly_set_one, polyset &poly_set_two,
+        vector<Candidate> &candidates)
+{
+    double distance = j->predicates[0] == ST_DWITHIN ? j->dwithin_distance : 0.0;
+    vector<PlanEntry> one;
+    vector<PlanEntry> two;
+
+    if (j->self_join) {
+        plan_entries(poly_set_one, distance / 2, one);
+    }
+    else {
+        plan_entries(poly_set_one, distance, one);
+        plan_entries(poly_set_two, 0.0, two);
+    }
+
+    bool index_one = j->self_join || one.size() > two.size();
+    vector<PlanEntry> &indexed = index_one ? one : two;
+    vector<PlanEntry> &probes = j->self_join ? one : (index_one ? two : one);
+
+    SpatialIndex::id_type index_id;
+    auto_ptr<SpatialIndex::IStorageManager> storage(
+            SpatialIndex::StorageManager::createNewMemoryStorageManager());
+    auto_ptr<SpatialIndex::ISpatialIndex> index(SpatialIndex::RTree::createNewRTree(*storage, 0.7,
+                100, 100, 2, SpatialIndex::RTree::RV_RSTAR, index_id));
+
+    for (size_t e = 0; e < indexed.size(); e++) {
+        const Envelope &box = indexed[e].box;
+        double low[2] = {box.getMinX(), box.getMinY()};
+        double high[2] = {box.getMaxX(), box.getMaxY()};
+        index->insertData(0, NULL, SpatialIndex::Region(low, high, 2), e);
+    }
+
+    for (size_t p = 0; p < probes.size(); p++) {
+        const Envelope &box = probes[p].box;
+        double low[2] = {box.getMinX(), box.getMinY()};
+        double high[2] = {box.getMaxX(), box.getMaxY()};
+        IdVisitor visitor;
+        index->intersectsWithQuery(SpatialIndex::Region(low, high, 2), visitor);
+
+        for (size_t h = 0; h < visitor.hits.size(); h++) {
+            size_t e = visitor.hits[h];
+            if (j->self_join) {
+                if (e > p) {
+                    add_candidate(j, probes[p], indexed[e], candidates);
+                }
+            }
+            else if (index_one) {
+                add_candidate(j, indexed[e], probes[p], candidates);
+            }
+            else {
+                add_candidate(j, probes[p], indexed[e], candidates);
+            }
+        }
+    }
+}
+
+// an object of an st_equals join: its box, and the hash of its canonical
+// form unless it has none
+struct EqualsEntry {
+    PlanEntry entry;
+    bool hashed;
+    uint64_t hash;
+};
+
+typedef pair<pair<double, double>, pair<double, double> > BoxKey;
+
+// the objects of one side with one box
+struct EqualsBucket {
+    map<uint64_t, vector<PlanEntry> > hashed;
+    vector<PlanEntry> unhashed;
+};
+
+static void equals_entries(polyset &poly_set, vector<EqualsEntry> &entries)
+{
+    vector<PlanEntry> boxes;
+    plan_entries(poly_set, 0.0, boxes);
+    for (size_t e = 0; e < boxes.size(); e++) {
+        SpatialObject *obj = boxes[e].obj;
+        EqualsEntry entry;
+        entry.entry = boxes[e];
+        entry.hash = 0;
+        entry.hashed = wkt_canonical_hash(obj->record, obj->wkt_pos, obj->wkt_len, entry.hash);
+        entries.push_back(entry);
+    }
+}
+
+static BoxKey box_key(const Envelope &box)
+{
+    return make_pair(make_pair(box.getMinX(), box.getMinY()), make_pair(box.getMaxX(), box.getMaxY()));
+}
+
+// Equality is exact: equal geometries have the same box and, when both
+// have a canonical form (see wkt_canonical.h), the same hash. Side two is
+// bucketed by box and hash; an object of side one meets the objects of
+// its bucket and those of its box without a hash, or every object of its
+// box when it has none itself. A self join keeps each pair once.
+void equals_candidates(resque_join *j, polyset &poly_set_one, polyset &poly_set_two,
+        vector<Candidate> &candidates)
+{
+    vector<EqualsEntry> one;
+    vector<EqualsEntry> two;
+    equals_entries(poly_set_one, one);
+    if (!j->self_join) {
+        equals_entries(poly_set_two, two);
+    }
+    vector<EqualsEntry> &indexed = j->self_join ? one : two;
+
+    map<BoxKey, EqualsBucket> buckets;
+    for (size_t e = 0; e < indexed.size(); e++) {
+        EqualsBucket &bucket = buckets[box_key(indexed[e].entry.box)];
+        if (indexed[e].hashed) {
+            bucket.hashed[indexed[e].hash].push_back(indexed[e].entry);
+        }
+        else {
+            bucket.unhashed.push_back(indexed[e].entry);
+        }
+    }
+
+    vector<const PlanEntry*> hits;
+    for (size_t p = 0; p < one.size(); p++) {
+        map<BoxKey, EqualsBucket>::iterator b = buckets.find(box_key(one[p].entry.box));
+        if (b == buckets.end()) {
+            continue;
+        }
+        EqualsBucket &bucket = b->second;
+
+        hits.clear();
+        for (size_t u = 0; u < bucket.unhashed.size(); u++) {
+            hits.push_back(&bucket.unhashed[u]);
+        }
+        map<uint64_t, vector<PlanEntry> >::iterator h;
+        for (h = bucket.hashed.begin(); h != bucket.hashed.end(); h++) {
+            if (one[p].hashed && h->first != one[p].hash) {
+                continue;
+            }
+            for (size_t e = 0; e < h->second.size(); e++) {
+                hits.push_back(&h->second[e]);
+            }
+        }
+
+        for (size_t k = 0; k < hits.size(); k++) {
+            // st_equals is symmetric, a self join sees each pair from both
+            // of its objects
+            if (j->self_join && hits[k]->id <= one[p].entry.id) {
+                continue;
+            }
+            add_candidate(j, one[p].entry, *hits[k], candidates);
+        }
+    }
+}
+
+// A box of st_contains or st_within can only hold the boxes inside it. A
+// range tree over the boxes of the smaller side finds, for every box of
+// the other, the boxes inside it or the boxes holding it, so only
+// containment candidates are ever formed. The containing side is side one
+// of st_contains and side two of st_within; a self join uses its one side
+// for both.
+void containment_candidates(resque_join *j, polyset &poly_set_one, polyset &poly_set_two,
+        vector<Candidate> &candidates)
+{
+    bool within = j->predicates[0] == ST_WITHIN;
+    vector<PlanEntry> one;
+    vector<PlanEntry> two;
+    plan_entries(poly_set_one, 0.0, one);
+    if (!j->self_join) {
+        plan_entries(poly_set_two, 0.0, two);
+    }
+    vector<PlanEntry> &containers = j->self_join || !within ? one : two;
+    vector<PlanEntry> &contained = j->self_join ? one : (within ? one : two);
+
+    // the tree holds the containers when they are fewer
+    bool tree_holds_containers = containers.size() < contained.size();
+    vector<PlanEntry> &indexed = tree_holds_containers ? containers : contained;
+    vector<PlanEntry> &probes = tree_holds_containers ? contained : containers;
+
+    vector<RangeBox> boxes(indexed.size());
+    for (size_t e = 0; e < indexed.size(); e++) {
+        const Envelope &box = indexed[e].box;
+        RangeBox b = {box.getMinX(), box.getMinY(), box.getMaxX(), box.getMaxY()};
+        boxes[e] = b;
+    }
+    BoxRangeTree tree(boxes);
+
+    vector<size_t> hits;
+    for (size_t p = 0; p < probes.size(); p++) {
+        const Envelope &box = probes[p].box;
+        RangeBox query = {box.getMinX(), box.getMinY(), box.getMaxX(), box.getMaxY()};
+        hits.clear();
+        if (tree_holds_containers) {
+            tree.containing(query, hits);
+        }
+        else {
+            tree.contained(query, hits);
+        }
+
+        for (size_t h = 0; h < hits.size(); h++) {
+            const PlanEntry &outer = tree_holds_containers ? indexed[hits[h]] : probes[p];
+            const PlanEntry &inner = tree_holds_containers ? probes[p] : indexed[hits[h]];
+            if (j->self_join && inner.id == outer.id) {
+                continue;
+            }
+            // st_within reports the contained object first
+            Candidate c = {outer.id, inner.id, outer.obj, inner.obj};
+            if (within) {
+                Candidate reversed = {inner.id, outer.id, inner.obj, outer.obj};
+                c = reversed;
+            }
+            candidates.push_back(c);
+        }
+    }
+}
+
+// A candidate of a semi or anti join probe, refined cheapest first.
+struct SemiCandidate {
+    size_t num_points;
+    int id;
+    SpatialObject *obj;
+
+    bool operator<(const SemiCandidate &other) const {
+        return num_points < other.num_points || (num_points == other.num_points && id < other.id);
+    }
+};
+
+// The area of the intersection of a matching pair; points and disjoint
+// boxes have none.
+static double intersection_area(resque_join *j, SpatialObject *obj1, SpatialObject *obj2)
+{
+    if (obj1->is_point || obj2->is_point || !obj1->env.intersects(obj2->env)) {
+        return 0.0;
+    }
+    auto_ptr<Geometry> common(get_geometry(j, obj1)->intersection(get_geometry(j, obj2)));
+    return common->getArea();
+}
+
+// Semi, anti and per object joins. Every object of dataset 1 (the outer
+// side) probes an R-tree over dataset 2, or over dataset 1 itself in a
+// self join, and refines its candidates with the fewest vertices first.
+// A semi or anti join stops the probe at the first candidate that matches
+// and reports the outer object once, in id order, when a match was found
+// (JOIN_SEMI) or when none was (JOIN_ANTI). JOIN_OBJECT_COUNT refines
+// every candidate and reports each outer object, in id order, with its
+// matches in match_counts (and match_areas). For st_disjoint the inner
+// objects whose boxes miss the probe match as they are and only the hits
+// of the probe are refined.
+long join_bucket_outer(resque_join *j, const string &key)
+{
+    int jp = j->predicates[0];
+    double distance = jp == ST_DWITHIN ? j->dwithin_distance : 0.0;
+    polyset &outer = j->polydata[key][DATABASE_ID_ONE];
+    polyset &inner = j->self_join ? outer : j->polydata[key][DATABASE_ID_TWO];
+
+    vector<PlanEntry> indexed;
+    plan_entries(inner, 0.0, indexed);
+
+    SpatialIndex::id_type index_id;
+    auto_ptr<SpatialIndex::IStorageManager> storage;
+    auto_ptr<SpatialIndex::ISpatialIndex> index;
+    if (!indexed.empty()) {
+        storage.reset(SpatialIndex::StorageManager::createNewMemoryStorageManager());
+        index.reset(SpatialIndex::RTree::createNewRTree(*storage, 0.7, 100, 100, 2,
+                    SpatialIndex::RTree::RV_RSTAR, index_id));
+        for (size_t e = 0; e < indexed.size(); e++) {
+            const Envelope &box = indexed[e].box;
+            double low[2] = {box.getMinX(), box.getMinY()};
+            double high[2] = {box.getMaxX(), box.getMaxY()};
+            index->insertData(0, NULL, SpatialIndex::Region(low, high, 2), e);
+        }
+    }
+
+    long reported = 0;
+    vector<SemiCandidate> candidates;
+    for (polyset::iterator o = outer.begin(); o != outer.end(); o++) {
+        SpatialObject *obj = o->second;
+        candidates.clear();
+
+        if (index.get() != NULL && !obj->env.isNull()) {
+            Envelope probe(obj->env);
+            probe.expandBy(distance);
+            double low[2] = {probe.getMinX(), probe.getMinY()};
+            double high[2] = {probe.getMaxX(), probe.getMaxY()};
+            IdVisitor visitor;
+            index->intersectsWithQuery(SpatialIndex::Region(low, high, 2), visitor);
+            for (size_t h = 0; h < visitor.hits.size(); h++) {
+                const PlanEntry &entry = indexed[visitor.hits[h]];
+                SemiCandidate c = {entry.obj->num_points, entry.id, entry.obj};
+                candidates.push_back(c);
+            }
+        }
+        sort(candidates.begin(), candidates.end());
+
+        // the inner objects the probe missed, the object itself aside
+        long missed = 0;
+        if (jp == ST_DISJOINT) {
+            missed = inner.size() - candidates.size();
+            bool self_hit = false;
+            for (size_t c = 0; c < candidates.size() && j->self_join; c++) {
+                self_hit = self_hit || candidates[c].id == o->first;
+            }
+            if (j->self_join && !self_hit) {
+                missed--;
+            }
+        }
+
+        if (j->join_mode == JOIN_OBJECT_COUNT) {
+            long matches = missed;
+            double area = 0.0;
+            for (size_t c = 0; c < candidates.size(); c++) {
+                if ((j->self_join && candidates[c].id == o->first)
+                        || !join_objects(j, obj, candidates[c].obj, jp)) {
+                    continue;
+                }
+                matches++;
+                if (j->aggregate_area && jp != ST_DISJOINT) {
+                    area += intersection_area(j, obj, candidates[c].obj);
+                }
+            }
+            j->results.push_back(o->first);
+            j->match_counts.push_back(matches);
+            j->match_areas.push_back(area);
+            reported++;
+            continue;
+        }
+
+        bool matched = missed > 0;
+        for (size_t c = 0; c < candidates.size() && !matched; c++) {
+            if (j->self_join && candidates[c].id == o->first) {
+                continue;
+            }
+            matched = join_objects(j, obj, candidates[c].obj, jp);
+        }
+
+        if (matched == (j->join_mode == JOIN_SEMI)) {
+            j->results.push_back(o->first);
+            reported++;
+        }
+    }
+
+    return reported;
+}
+
+// Count joins. The tuples of a tile, tuples of them in j->results, are
+// reduced to their number and, with aggregate_area, the summed area of
+// the intersection of each pair; only the aggregate is kept, so the
+// tuples are never handed out.
+long aggregate_tile(resque_join *j, const string &tile, long tuples)
+{
+    double area = 0.0;
+    if (j->aggregate_area && j->tuple_size == 2 && j->predicates[0] != ST_DISJOINT) {
+        polyset &one = j->polydata[tile][j->tuple_databases[0]];
+        polyset &two = j->polydata[tile][j->tuple_databases[1]];
+        for (size_t r = 0; r + 1 < j->results.size(); r += 2) {
+            area += intersection_area(j, one[j->results[r]], two[j->results[r + 1]]);
+        }
+    }
+
+    j->results.clear();
+    j->match_counts.assign(1, tuples);
+    j->match_areas.assign(1, area);
+    return tuples;
+}
+
+// The nested loop as a filter only, for a parallel refinement.
+void nested_loop_candidates(resque_join *j, polyset &poly_set_one, polyset &poly_set_two,
+        vector<Candidate> &candidates)
+{
+    vector<PlanEntry> one;
+    vector<PlanEntry> two;
+    plan_entries(poly_set_one, 0.0, one);
+    plan_entries(poly_set_two, 0.0, two);
+
+    for (size_t a = 0; a < one.size(); a++) {
+        for (size_t b = j->self_join ? a + 1 : 0; b < two.size(); b++) {
+            add_candidate(j, one[a], two[b], candidates);
+        }
+    }
+}
+
+// Refines the candidates in (id1, id2) order, as the nested loop reports;
+// a large tile is refined in parallel, see parallel_refine().
+long refine_candidates(resque_join *j, vector<Candidate> &candidates)
+{
+    int jp = j->predicates[0];
+    bool mirror = j->self_join && j->both_directions && is_symmetric(jp);
+    long pairs = 0;
+
+    sort(candidates.begin(), candidates.end());
+
+    vector<char> hits;
+    if (j->threads > 1 && candidates.size() >= PARALLEL_MIN_CANDIDATES) {
+        if (!parallel_refine(j, candidates, hits)) {
+            return -1;
+        }
+    }
+
+    for (size_t c = 0; c < candidates.size(); c++) {
+        bool hit = hits.empty()
+            ? join_objects(j, candidates[c].obj1, candidates[c].obj2, jp)
+            : hits[c] != 0;
+        if (hit) {
+            report_pair(j, candidates[c].id1, candidates[c].id2);
+            pairs++;
+            if (mirror) {
+                report_pair(j, candidates[c].id2, candidates[c].id1);
+                pairs++;
+            }
+        }
+    }
+
+    return pairs;
+}
+
+// st_disjoint as the complement of the envelope filter of st_intersects.
+// A pair whose boxes do not meet is disjoint without a look at the
+// geometries, so only the candidates of the filter of plan.algorithm are
+// refined; every other pair of the tile is reported as it is. The pairs
+// come out in the order of the nested loop; with count_only they are
+// counted and none is reported.
+long disjoint_join(resque_join *j, polyset &poly_set_one, polyset &poly_set_two, TilePlan &plan,
+        bool count_only)
+{
+    vector<Candidate> candidates;
+    if (plan.algorithm == PLAN_PLANE_SWEEP) {
+        plane_sweep_candidates(j, poly_set_one, poly_set_two, candidates);
+    }
+    else if (plan.algorithm == PLAN_INDEXED) {
+        indexed_candidates(j, poly_set_one, poly_set_two, candidates);
+    }
+    else {
+        nested_loop_candidates(j, poly_set_one, poly_set_two, candidates);
+    }
+    sort(candidates.begin(), candidates.end());
+    plan.candidates += candidates.size();
+
+    vector<char> hits;
+    if (j->threads > 1 && candidates.size() >= PARALLEL_MIN_CANDIDATES) {
+        if (!parallel_refine(j, candidates, hits)) {
+            return -1;
+        }
+    }
+    else {
+        hits.resize(candidates.size());
+        for (size_t c = 0; c < candidates.size(); c++) {
+            hits[c] = join_objects(j, candidates[c].obj1, candidates[c].obj2, ST_DISJOINT);
+        }
+    }
+
+    // disjoint is symmetric, a self join reports the upper triangle
+    long mirror = j->self_join && j->both_directions ? 2 : 1;
+    if (count_only) {
+        long disjoint = (long) all_pairs(j, poly_set_one.size(), poly_set_two.size())
+            - candidates.size() + count(hits.begin(), hits.end(), 1);
+        return disjoint * mirror;
+    }
+
+    long pairs = 0;
+    size_t c = 0;
+    for (polyset::iterator i = poly_set_one.begin(); i != poly_set_one.end(); i++) {
+        polyset::iterator k = poly_set_two.begin();
+        if (j->self_join) {
+            k = i;
+            k++;
+        }
+        for (; k != poly_set_two.end(); k++) {
+            if (c < candidates.size() && candidates[c].id1 == i->first
+                    && candidates[c].id2 == k->first) {
+                if (!hits[c++]) {
+                    continue;
+                }
+            }
+            report_pair(j, i->first, k->first);
+            if (mirror == 2) {
+                report_pair(j, k->first, i->first);
+            }
+            pairs += mirror;
+        }
+    }
+
+    return pairs;
+}
+
+// A run of candidates refined by one worker. The candidates of an outer
+// object stay in one chunk unless there are too many of them, so that its
+// prepared geometry serves them all.
+struct RefineChunk {
+    size_t begin;
+    size_t end;
+};
+
+// The chunks of one worker. The owner takes them from the front, in
+// order; an idle worker steals from the back, the work its owner would
+// reach last.
+struct StealDeque {
+    pthread_mutex_t lock;
+    deque<RefineChunk> chunks;
+};
+
+struct RefineWork {
+    resque_join *j;
+    vector<Candidate> *candidates;
+    vector<char> *hits;
+    StealDeque *deques;
+    int num_workers;
+
+    pthread_mutex_t error_lock;
+    bool failed;
+    string error;
+};
+
+struct RefineWorker {
+    RefineWork *work;
+    int self;
+    pthread_t thread;
+};
+
+static bool take_chunk(RefineWork *work, int self, RefineChunk &chunk)
+{
+    for (int v = 0; v < work->num_workers; v++) {
+        StealDeque &d = work->deques[(self + v) % work->num_workers];
+        pthread_mutex_lock(&d.lock);
+        bool found = !d.chunks.empty();
+        if (found && v == 0) {
+            chunk = d.chunks.front();
+            d.chunks.pop_front();
+        }
+        else if (found) {
+            chunk = d.chunks.back();
+            d.chunks.pop_back();
+        }
+        pthread_mutex_unlock(&d.lock);
+        if (found) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Only reads the geometries, which are parsed before the workers start;
+// the prepared geometries belong to the worker that made them.
+static void refine_chunk(RefineWork *work, const RefineChunk &chunk)
+{
+    resque_join *j = work->j;
+    int jp = j->predicates[0];
+    vector<Candidate> &candidates = *work->candidates;
+    SpatialObject *outer = NULL;
+    const PreparedGeometry *prep = NULL;
+
+    try {
+        for (size_t c = chunk.begin; c < chunk.end; c++) {
+            Candidate &pair = candidates[c];
+            if (pair.obj1 != outer) {
+                if (prep != NULL) {
+                    PreparedGeometryFactory::destroy(prep);
+                    prep = NULL;
+                }
+                outer = pair.obj1;
+                // preparing pays off from the second pair on, unless the
+                // edge index or the point locator answers them
+                if (c + 1 < chunk.end && candidates[c + 1].obj1 == outer
+                        && (outer->edge_index == NULL || !outer->edge_index->valid())
+                        && (outer->locator == NULL || !outer->locator->valid())) {
+                    prep = PreparedGeometryFactory::prepare(outer->geom);
+                }
+            }
+
+            int related = edge_relate(j, outer, pair.obj2, jp);
+            if (related < 0) {
+                related = point_relate(j, outer, pair.obj2, jp);
+            }
+            bool hit = related >= 0 ? related != 0
+                : prep != NULL
+                ? prepared_predicate(prep, pair.obj2->geom, jp, j->dwithin_distance)
+                : join_with_predicate(outer->geom, pair.obj2->geom, &outer->env, &pair.obj2->env,
+                        jp, j->dwithin_distance);
+            (*work->hits)[c] = hit;
+        }
+    }
+    catch (geos::util::GEOSException& e) {
+        pthread_mutex_lock(&work->error_lock);
+        if (!work->failed) {
+            work->failed = true;
+            work->error = e.what();
+        }
+        pthread_mutex_unlock(&work->error_lock);
+    }
+
+    if (prep != NULL) {
+        PreparedGeometryFactory::destroy(prep);
+    }
+}
+
+static void* refine_worker(void *arg)
+{
+    RefineWorker *worker = (RefineWorker*) arg;
+    RefineWork *work = worker->work;
+    RefineChunk chunk;
+
+    while (take_chunk(work, worker->self, chunk)) {
+        pthread_mutex_lock(&work->error_lock);
+        bool failed = work->failed;
+        pthread_mutex_unlock(&work->error_lock);
+        if (failed) {
+            break;
+        }
+        refine_chunk(work, chunk);
+    }
+    return NULL;
+}
+
+// Refines the sorted candidates on j->threads threads into hits, one flag
+// per candidate, so the pairs are still reported in candidate order. The
+// chunks are dealt out to the workers in contiguous runs and balanced by
+// stealing. false (with j->error set) when a predicate failed.
+bool parallel_refine(resque_join *j, vector<Candidate> &candidates, vector<char> &hits)
+{
+    // lazy parsing is not thread safe, nor are the lazy edge indexes and
+    // point locators
+    bool edges = edge_predicate(j->predicates[0]);
+    bool points = point_fast_path(j->predicates[0]);
+    for (size_t c = 0; c < candidates.size(); c++) {
+        SpatialObject *obj1 = candidates[c].obj1;
+        SpatialObject *obj2 = candidates[c].obj2;
+        get_geometry(j, obj1);
+        get_geometry(j, obj2);
+        if (edges && !obj1->is_point && !obj2->is_point) {
+            get_edge_index(j, obj1);
+            get_edge_index(j, obj2);
+        }
+        if (points && obj1->is_point != obj2->is_point) {
+            get_locator(j, obj1->is_point ? obj2 : obj1);
+        }
+    }
+
+    vector<RefineChunk> chunks;
+    size_t begin = 0;
+    for (size_t c = 1; c <= candidates.size(); c++) {
+        bool group_end = c == candidates.size() || candidates[c].obj1 != candidates[c - 1].obj1;
+        size_t size = c - begin;
+        if (c == candidates.size() || (group_end && size >= REFINE_CHUNK) || size >= 4 * REFINE_CHUNK) {
+            RefineChunk chunk = {begin, c};
+            chunks.push_back(chunk);
+            begin = c;
+        }
+    }
+
+    RefineWork work;
+    work.j = j;
+    work.candidates = &candidates;
+    work.hits = &hits;
+    work.num_workers = min((size_t) j->threads, chunks.size());
+    work.deques = new StealDeque[work.num_workers];
+    work.failed = false;
+    pthread_mutex_init(&work.error_lock, NULL);
+    hits.assign(candidates.size(), 0);
+
+    for (int w = 0; w < work.num_workers; w++) {
+        pthread_mutex_init(&work.deques[w].lock, NULL);
+    }
+    for (size_t k = 0; k < chunks.size(); k++) {
+        work.deques[k * work.num_workers / chunks.size()].chunks.push_back(chunks[k]);
+    }
+
+    // the calling thread is worker 0
+    vector<RefineWorker> workers(work.num_workers);
+    for (int w = 0; w < work.num_workers; w++) {
+        workers[w].work = &work;
+        workers[w].self = w;
+    }
+    int started = 1;
+    for (; started < work.num_workers; started++) {
+        if (pthread_create(&workers[started].thread, NULL, refine_worker, &workers[started]) != 0) {
+            break;
+        }
+    }
+    refine_worker(&workers[0]);
+    for (int w = 1; w < started; w++) {
+        pthread_join(workers[w].thread, NULL);
+    }
+
+    for (int w = 0; w < work.num_workers; w++) {
+        pthread_mutex_destroy(&work.deques[w].lock);
+    }
+    delete[] work.deques;
+    pthread_mutex_destroy(&work.error_lock);
+
+    if (work.failed) {
+        j->error = work.error;
+        return false;
+    }
+    return true;
+}
+
+void sample_envelopes(polyset &poly_set, vector<const Envelope*> &sample)
+{
+    size_t stride = poly_set.size() / SAMPLE_SIZE + 1;
+    size_t k = 0;
+
+    for (polyset::iterator it = poly_set.begin(); it != poly_set.end(); it++, k++) {
+        if (k % stride == 0) {
+            sample.push_back(&it->second->env);
+        }
+    }
+}
+
+// Estimates how many pairs of the two sets pass the envelope filter of jp
+// from an evenly spaced sample of each side.
+double estimate_pairs(resque_join *j, polyset &poly_set_one, polyset &poly_set_two, const int jp)
+{
+    if (poly_set_one.empty() || poly_set_two.empty()) {
+        return 0.0;
+    }
+
+    vector<const Envelope*> sample_one;
+    vector<const Envelope*> sample_two;
+    sample_envelopes(poly_set_one, sample_one);
+    sample_envelopes(poly_set_two, sample_two);
+
+    double hits = 0;
+    for (size_t a = 0; a < sample_one.size(); a++) {
+        for (size_t b = 0; b < sample_two.size(); b++) {
+            if (envelope_filter(sample_one[a], sample_two[b], jp, j->dwithin_distance)) {
+                hits++;
+            }
+        }
+    }
+
+    return hits / (sample_one.size() * sample_two.size())
+        * poly_set_one.size() * poly_set_two.size();
+}
+
+// Joins datasets 1..num_datasets of a tile along the chain
+// 1 predicates[0] 2 predicates[1] 3 ...
+// The join starts from the edge with the fewest estimated pairs and grows
+// the partial tuples towards the neighbouring edge with the smaller fan-out,
+// so the intermediate candidate sets stay small.
+int join_bucket_multiway(resque_join *j, const string &key)
+{
+    int num_datasets = j->num_datasets;
+    int num_edges = num_datasets - 1;
+    vector<polyset*> sets(num_datasets);
+
+    for (int d = 0; d < num_datasets; d++) {
+        sets[d] = &j->polydata[key][d + 1];
+        if (sets[d]->empty()) {
+            return 0;
+        }
+    }
+
+    vector<double> estimate(num_edges);
+    for (int e = 0; e < num_edges; e++) {
+        estimate[e] = estimate_pairs(j, *sets[e], *sets[e + 1], j->predicates[e]);
+    }
+    int first = min_element(estimate.begin(), estimate.end()) - estimate.begin();
+
+    // a tuple holds one object id per dataset; datasets lo..hi are bound
+    vector<vector<int> > tuples;
+    polyset::iterator i;
+    polyset::iterator k;
+
+    for (i = sets[first]->begin(); i != sets[first]->end(); i++) {
+        for (k = sets[first + 1]->begin(); k != sets[first + 1]->end(); k++) {
+            if (join_objects(j, i->second, k->second, j->predicates[first])) {
+                vector<int> tuple(num_datasets, -1);
+                tuple[first] = i->first;
+                tuple[first + 1] = k->first;
+                tuples.push_back(tuple);
+            }
+        }
+    }
+
+    int lo = first;
+    int hi = first + 1;
+
+    while (!tuples.empty() && (lo > 0 || hi < num_datasets - 1)) {
+        // estimated matches per bound object on either side
+        double left = lo > 0 ? estimate[lo - 1] / sets[lo]->size() : 0.0;
+        double right = hi < num_datasets - 1 ? estimate[hi] / sets[hi]->size() : 0.0;
+        bool go_left = lo > 0 && (hi == num_datasets - 1 || left <= right);
+
+        int bound = go_left ? lo : hi;
+        int next = go_left ? lo - 1 : hi + 1;
+        int edge = go_left ? lo - 1 : hi;
+
+        // the matches of a bound object are computed once and shared by all
+        // the tuples holding it
+        map<int, vector<int> > matches;
+        vector<vector<int> > extended;
+
+        for (size_t t = 0; t < tuples.size(); t++) {
+            int id = tuples[t][bound];
+            map<int, vector<int> >::iterator m = matches.find(id);
+
+            if (m == matches.end()) {
+                m = matches.insert(make_pair(id, vector<int>())).first;
+                SpatialObject *obj = (*sets[bound])[id];
+
+                for (k = sets[next]->begin(); k != sets[next]->end(); k++) {
+                    bool hit = go_left
+                        ? join_objects(j, k->second, obj, j->predicates[edge])
+                        : join_objects(j, obj, k->second, j->predicates[edge]);
+                    if (hit) {
+                        m->second.push_back(k->first);
+                    }
+                }
+            }
+
+            for (size_t n = 0; n < m->second.size(); n++) {
+                extended.push_back(tuples[t]);
+                extended.back()[next] = m->second[n];
+            }
+        }
+
+        tuples.swap(extended);
+        if (go_left) {
+            lo--;
+        }
+        else {
+            hi++;
+        }
+    }
+
+    // report in dataset order, sorted by object ids like the two-way join
+    sort(tuples.begin(), tuples.end());
+    for (size_t t = 0; t < tuples.size(); t++) {
+        j->results.insert(j->results.end(), tuples[t].begin(), tuples[t].end());
+    }
+
+    return tuples.size();
+}
+
+long join_tile(resque_join *j, const string &tile)
+{
+    j->results.clear();
+    j->next_result = 0;
+    j->tuple_databases.clear();
+    j->match_counts.clear();
+    j->match_areas.clear();
+
+    // the last partition of a spilled tile joined before
+    if (!j->spill_tile.empty()) {
+        free_tile_objects(j, j->spill_tile);
+        end_spilled_tile(j);
+    }
+
+    if (j->join_mode != JOIN_PAIRS && j->join_mode != JOIN_COUNT) {
+        j->tuple_size = 1;
+        j->tuple_databases.assign(1, DATABASE_ID_ONE);
+    }
+    else if (j->self_join) {
+        j->tuple_size = 2;
+        j->tuple_databases.resize(2, DATABASE_ID_ONE);
+    }
+    else {
+        j->tuple_size = j->num_datasets;
+        for (int d = 0; d < j->num_datasets; d++) {
+            j->tuple_databases.push_back(d + 1);
+        }
+    }
+
+    if (j->polydata.find(tile) == j->polydata.end()) {
+        return j->join_mode == JOIN_COUNT ? aggregate_tile(j, tile, 0) : 0;
+    }
+
+    if (!j->state_dir.empty()) {
+        return join_tile_incremental(j, tile);
+    }
+
+    map<string, SpillRun*>::iterator s = j->spilled.find(tile);
+    if (s != j->spilled.end()) {
+        // the cells are joined one by one as the tuples are read
+        close_run(j, s->second);
+        s->second->next_partition = 0;
+        j->spill_tile = tile;
+        j->join_run = s->second;
+        return j->join_mode == JOIN_COUNT ? count_spilled_tile(j, tile) : 0;
+    }
+
+    try {
+        long tuples;
+        if (j->num_datasets > 2) {
+            tuples = join_bucket_multiway(j, tile);
+        }
+        else if (j->join_mode != JOIN_PAIRS && j->join_mode != JOIN_COUNT) {
+            return join_bucket_outer(j, tile);
+        }
+        else {
+            tuples = join_bucket(j, tile);
+        }
+        if (tuples >= 0) {
+            return j->join_mode == JOIN_COUNT ? aggregate_tile(j, tile, tuples) : tuples;
+        }
+    } // end of try
+    catch (Tools::Exception& e) {
+        j->error = e.what();
+    } // end of catch
+    catch (geos::util::GEOSException& e) {
+        j->error = e.what();
+    } // end of catch
+
+    j->results.clear();
+    return -1;
+}
+
+int next_result(resque_join *j, const int **ids)
+{
+    while (j->next_result >= j->results.size()) {
+        if (j->spill_tile.empty()) {
+            return 0;
+        }
+        if (join_partition(j) < 0) {
+            return -1;
+        }
+    }
+
+    *ids = &j->results[j->next_result];
+    j->next_result += j->tuple_size;
+    return 1;
+}
+
+void free_tile_objects(resque_join *j, const string &tile)
+{
+    polymap::iterator t = j->polydata.find(tile);
+    if (t == j->polydata.end()) {
+        return;
+    }
+    for (map<int, polyset>::iterator d = t->second.begin(); d != t->second.end(); d++) {
+        for (polyset::iterator o = d->second.begin(); o != d->second.end(); o++) {
+            free_object(o->second);
+        }
+        d->second.clear();
+    }
+}
+
+void clear_tiles(resque_join *j)
+{
+    for (polymap::iterator t = j->polydata.begin(); t != j->polydata.end(); t++) {
+        free_tile_objects(j, t->first);
+    }
+    j->polydata.clear();
+    j->results.clear();
+    j->next_result = 0;
+    j->match_counts.clear();
+    j->match_areas.clear();
+    j->tile_bytes.clear();
+    end_spilled_tile(j);
+
+    for (map<string, SpillRun*>::iterator s = j->spilled.begin(); s != j->spilled.end(); s++) {
+        remove_run(j, s->second);
+    }
+    j->spilled.clear();
+    j->memory_used = 0;
+}
+
+static const char *join_mode_names[] = {"pairs", "semi", "anti", "count", "object-count"};
+
+int get_join_mode(const char *name)
+{
+    for (int m = JOIN_PAIRS; m <= JOIN_OBJECT_COUNT; m++) {
+        if (strcmp(name, join_mode_names[m]) == 0) {
+            return m;
+        }
+    }
+    return -1;
+}
+
+static const char *plan_names[] = {"auto", "nested", "sweep", "index", "hash", "range"};
+
+int get_plan(const char *name)
+{
+    for (int p = PLAN_AUTO; p <= PLAN_INDEXED; p++) {
+        if (strcmp(name, plan_names[p]) == 0) {
+            return p;
+        }
+    }
+    return -1;
+}
+
+const char* plan_name(int plan)
+{
+    return plan >= PLAN_AUTO && plan <= PLAN_RANGE_TREE ? plan_names[plan] : "unknown";
+}
+
+bool can_spill(resque_join *j)
+{
+    // a disjoint pair need not share a cell
+    return j->num_datasets <= 2 && j->predicates[0] != ST_DISJOINT && j->state_dir.empty()
+        && (j->join_mode == JOIN_PAIRS || j->join_mode == JOIN_COUNT);
+}
+
+// The box an object of box env is partitioned by. Two boxes that pass the
+// envelope filter of any predicate but st_disjoint intersect; for
+// st_dwithin both sides grow by half the distance so that they do.
+Envelope spill_envelope(resque_join *j, const Envelope &env)
+{
+    Envelope grown(env);
+    if (j->predicates[0] == ST_DWITHIN) {
+        grown.expandBy(j->dwithin_distance / 2);
+    }
+    return grown;
+}
+
+static int grid_index(double v, double lo, double width)
+{
+    if (width <= 0) {
+        return 0;
+    }
+    double c = (v - lo) / width * SPILL_GRID;
+    if (c < 0) {
+        return 0;
+    }
+    return c >= SPILL_GRID ? SPILL_GRID - 1 : (int) c;
+}
+
+// the cell of a point, outside the extent clamped to the border cells
+int spill_cell(const SpillRun *run, double x, double y)
+{
+    int cx = grid_index(x, run->extent.getMinX(), run->extent.getWidth());
+    int cy = grid_index(y, run->extent.getMinY(), run->extent.getHeight());
+    return cy * SPILL_GRID + cx;
+}
+
+string partition_path(const SpillRun *run, int p)
+{
+    std::stringstream path;
+    path << run->dir << "/" << p;
+    return path.str();
+}
+
+// A run over extent in a new directory under j->spill_dir; NULL (with
+// j->error set) when the directory cannot be made.
+SpillRun* create_run(resque_join *j, const Envelope &extent)
+{
+    string pattern = j->spill_dir + "/resque-spill-XXXXXX";
+    vector<char> name(pattern.begin(), pattern.end());
+    name.push_back('\0');
+    if (mkdtemp(&name[0]) == NULL) {
+        j->error = "cannot create a spill directory under " + j->spill_dir;
+        return NULL;
+    }
+
+    SpillRun *run = new SpillRun();
+    run->dir = &name[0];
+    run->extent = extent;
+    run->next_partition = 0;
+    run->parent = NULL;
+    run->depth = 0;
+    run->split_lines = 0;
+    run->lines.assign(SPILL_GRID * SPILL_GRID, 0);
+    run->written = 0;
+    return run;
+}
+
+// Opens the run files of a tile for appending, closing those of the tile
+// spilled before it.
+bool open_run(resque_join *j, SpillRun *run)
+{
+    if (!run->files.empty()) {
+        return true;
+    }
+    if (j->open_run != NULL) {
+        close_run(j, j->open_run);
+    }
+
+    for (int p = 0; p < SPILL_GRID * SPILL_GRID; p++) {
+        ofstream *f = new ofstream(partition_path(run, p).c_str(), ios::out | ios::app);
+        run->files.push_back(f);
+        if (!*f) {
+            j->error = "cannot write spill file " + partition_path(run, p);
+            close_run(j, run);
+            return false;
+        }
+        f->precision(17);
+    }
+    j->open_run = run;
+    return true;
+}
+
+void close_run(resque_join *j, SpillRun *run)
+{
+    for (size_t p = 0; p < run->files.size(); p++) {
+        delete run->files[p];
+    }
+    run->files.clear();
+    if (j->open_run == run) {
+        j->open_run = NULL;
+    }
+}
+
+// Closes the run files and removes them with their directory.
+void remove_run(resque_join *j, SpillRun *run)
+{
+    j->memory_used -= run->live.size() * SPILL_LIVE_BYTES;
+    close_run(j, run);
+    for (int p = 0; p < SPILL_GRID * SPILL_GRID; p++) {
+        remove(partition_path(run, p).c_str());
+    }
+    remove(run->dir.c_str());
+    delete run;
+}
+
+// Moves a tile from memory to a directory of run files, one per cell of a
+// SPILL_GRID x SPILL_GRID grid over the tile as it is now. On failure the
+// tile is dropped: its objects are freed and its run files removed.
+bool spill_tile(resque_join *j, const string &tile)
+{
+    map<int, polyset> &sets = j->polydata[tile];
+    map<int, polyset>::iterator d;
+    polyset::iterator o;
+    Envelope extent;
+    for (d = sets.begin(); d != sets.end(); d++) {
+        for (o = d->second.begin(); o != d->second.end(); o++) {
+            Envelope env = spill_envelope(j, o->second->env);
+            extent.expandToInclude(&env);
+        }
+    }
+
+    SpillRun *run = create_run(j, extent);
+    bool ok = run != NULL && open_run(j, run);
+    for (d = sets.begin(); d != sets.end(); d++) {
+        for (o = d->second.begin(); o != d->second.end(); o++) {
+            if (ok) {
+                ok = spill_object(j, run, d->first, o->first, o->second);
+            }
+            else {
+                free_object(o->second);
+            }
+        }
+        d->second.clear();
+    }
+
+    j->memory_used -= j->tile_bytes[tile];
+    j->tile_bytes.erase(tile);
+    if (!ok) {
+        if (run != NULL) {
+            remove_run(j, run);
+        }
+        j->polydata.erase(tile);
+        return false;
+    }
+    j->spilled[tile] = run;
+    return true;
+}
+
+// Writes an object to the run file of every cell its box overlaps as
+//     serial database_id object_id is_point min_x min_y max_x max_y wkt_pos wkt_len \t record
+// and frees it. An object built from a geometry is written with its WKT as
+// the record. An empty object matches nothing and is dropped.
+bool spill_object(resque_join *j, SpillRun *run, int database_id, int object_id,
+        SpatialObject *obj)
+{
+    if (obj->env.isNull()) {
+        free_object(obj);
+        return true;
+    }
+    if (!open_run(j, run)) {
+        free_object(obj);
+        return false;
+    }
+
+    if (obj->wkt_len == 0 && obj->geom != NULL) {
+        obj->record = obj->geom->toString();
+        obj->wkt_pos = 0;
+        obj->wkt_len = obj->record.length();
+    }
+
+    // the entry stays in memory until the tile is cleared
+    long serial = run->written++;
+    pair<map<pair<int, int>, long>::iterator, bool> entry
+        = run->live.insert(make_pair(make_pair(database_id, object_id), serial));
+    if (entry.second) {
+        j->memory_used += SPILL_LIVE_BYTES;
+    }
+    else {
+        entry.first->second = serial;
+    }
+
+    std::ostringstream line;
+    line.precision(17);
+    line << serial << ' ' << database_id << ' ' << object_id << ' ' << obj->is_point << ' '
+         << obj->env.getMinX() << ' ' << obj->env.getMinY() << ' '
+         << obj->env.getMaxX() << ' ' << obj->env.getMaxY() << ' '
+         << obj->wkt_pos << ' ' << obj->wkt_len << '\t' << obj->record;
+    bool ok = spill_line(run, spill_envelope(j, obj->env), line.str());
+
+    free_object(obj);
+    if (!ok) {
+        j->error = "cannot write the spill files in " + run->dir;
+    }
+    return ok;
+}
+
+// Appends a line of the run files to the file of every cell env overlaps.
+bool spill_line(SpillRun *run, const Envelope &env, const string &line)
+{
+    int lo = spill_cell(run, env.getMinX(), env.getMinY());
+    int hi = spill_cell(run, env.getMaxX(), env.getMaxY());
+
+    bool ok = true;
+    for (int cy = lo / SPILL_GRID; cy <= hi / SPILL_GRID; cy++) {
+        for (int cx = lo % SPILL_GRID; cx <= hi % SPILL_GRID; cx++) {
+            ofstream &f = *run->files[cy * SPILL_GRID + cx];
+            f << line << '\n';
+            ok = ok && f.good();
+            run->lines[cy * SPILL_GRID + cx]++;
+        }
+    }
+    return ok;
+}
+
+// Cuts cell p of run into a run of its own over the cell, copying every
+// line of its run file to the cells of the new run it overlaps. NULL (with
+// j->error set) on failure.
+SpillRun* split_partition(resque_join *j, SpillRun *run, int p)
+{
+    const Envelope &e = run->extent;
+    int cx = p % SPILL_GRID;
+    int cy = p / SPILL_GRID;
+    double w = e.getWidth() / SPILL_GRID;
+    double h = e.getHeight() / SPILL_GRID;
+    Envelope cell(e.getMinX() + cx * w, cx == SPILL_GRID - 1 ? e.getMaxX() : e.getMinX() + (cx + 1) * w,
+            e.getMinY() + cy * h, cy == SPILL_GRID - 1 ? e.getMaxY() : e.getMinY() + (cy + 1) * h);
+
+    SpillRun *child = create_run(j, cell);
+    if (child == NULL) {
+        return NULL;
+    }
+    child->parent = run;
+    child->depth = run->depth + 1;
+    child->split_lines = run->lines[p];
+
+    ifstream in(partition_path(run, p).c_str());
+    bool ok = in && open_run(j, child);
+    string line;
+    while (ok && getline(in, line)) {
+        std::istringstream header(line.substr(0, line.find('\t')));
+        long serial;
+        int database_id;
+        int object_id;
+        bool is_point;
+        double min_x, min_y, max_x, max_y;
+        header >> serial >> database_id >> object_id >> is_point >> min_x >> min_y >> max_x >> max_y;
+        ok = header && spill_line(child, spill_envelope(j, Envelope(min_x, max_x, min_y, max_y)), line);
+    }
+    ok = ok && in.eof();
+    close_run(j, child);
+
+    if (!ok) {
+        j->error = "cannot split spill file " + partition_path(run, p);
+        remove_run(j, child);
+        return NULL;
+    }
+    return child;
+}
+
+// Stops joining the spilled tile, removing the runs of its split cells.
+void end_spilled_tile(resque_join *j)
+{
+    while (j->join_run != NULL && j->join_run->parent != NULL) {
+        SpillRun *parent = j->join_run->parent;
+        remove_run(j, j->join_run);
+        j->join_run = parent;
+    }
+    j->join_run = NULL;
+    j->spill_tile.clear();
+}
+
+// Loads the next cell of the spilled tile being joined and joins it into
+// j->results, keeping the tuples whose reference point lies in the cell.
+// A cell too large for the memory budget is split instead, and its cells
+// are joined next. Ends the tile after the last cell. Returns the tuples
+// kept, -1 on error.
+long join_partition(resque_join *j)
+{
+    const string tile = j->spill_tile;
+    SpillRun *root = j->spilled[tile];
+
+    free_tile_objects(j, tile);
+    j->results.clear();
+    j->next_result = 0;
+
+    // the cells of a split cell are done, its run goes on
+    SpillRun *run = j->join_run;
+    while (run->next_partition >= SPILL_GRID * SPILL_GRID && run->parent != NULL) {
+        j->join_run = run->parent;
+        remove_run(j, run);
+        run = j->join_run;
+    }
+    if (run->next_partition >= SPILL_GRID * SPILL_GRID) {
+        end_spilled_tile(j);
+        return 0;
+    }
+    int p = run->next_partition++;
+
+    ifstream in(partition_path(run, p).c_str(), ios::in | ios::ate);
+    if (!in) {
+        j->error = "cannot read spill file " + partition_path(run, p);
+        end_spilled_tile(j);
+        return -1;
+    }
+
+    // a line takes about as much memory again for the parsed geometry; a
+    // cell that holds every line of the cell it was split from, as when
+    // its objects all cover it, is not split again
+    size_t bytes = in.tellg();
+    if (j->memory_budget > 0 && bytes > j->memory_budget / SPILL_SPLIT_SHARE
+            && run->depth < SPILL_SPLIT_DEPTH
+            && (run->parent == NULL || run->lines[p] < run->split_lines)
+            && (run->extent.getWidth() > 0 || run->extent.getHeight() > 0)) {
+        SpillRun *child = split_partition(j, run, p);
+        if (child == NULL) {
+            end_spilled_tile(j);
+            return -1;
+        }
+        j->join_run = child;
+        return 0;
+    }
+    in.seekg(0);
+
+    string line;
+    while (getline(in, line)) {
+        size_t record_pos = line.find('\t');
+        std::istringstream header(line.substr(0, record_pos));
+        long serial;
+        int database_id;
+        int object_id;
+        double min_x, min_y, max_x, max_y;
+        SpatialObject *obj = new SpatialObject();
+        obj->geom = NULL;
+        obj->locator = NULL;
+        obj->edge_index = NULL;
+        header >> serial >> database_id >> object_id >> obj->is_point
+               >> min_x >> min_y >> max_x >> max_y >> obj->wkt_pos >> obj->wkt_len;
+        if (!header || record_pos == string::npos) {
+            delete obj;
+            j->error = "corrupt spill file " + partition_path(run, p);
+            end_spilled_tile(j);
+            return -1;
+        }
+        // a copy replaced later, or dropped by a self join, may still sit
+        // in other cells than the live one
+        if (root->live[make_pair(database_id, object_id)] != serial) {
+            delete obj;
+            continue;
+        }
+        obj->env.init(min_x, max_x, min_y, max_y);
+        obj->record = line.substr(record_pos + 1);
+        obj->num_points = count_wkt_points(obj->record, obj->wkt_pos, obj->wkt_len);
+        j->polydata[tile][database_id][object_id] = obj;
+    }
+
+    bool failed = false;
+    try {
+        join_bucket(j, tile);
+    }
+    catch (Tools::Exception& e) {
+        j->error = e.what();
+        failed = true;
+    }
+    catch (geos::util::GEOSException& e) {
+        j->error = e.what();
+        failed = true;
+    }
+    if (failed) {
+        j->results.clear();
+        end_spilled_tile(j);
+        return -1;
+    }
+
+    // a pair overlapping several cells is found in each of them; the cell
+    // being joined of every run is the one before its next
+    map<int, polyset> &sets = j->polydata[tile];
+    size_t kept = 0;
+    for (size_t r = 0; r < j->results.size(); r += 2) {
+        Envelope env1 = spill_envelope(j, sets[j->tuple_databases[0]][j->results[r]]->env);
+        Envelope env2 = spill_envelope(j, sets[j->tuple_databases[1]][j->results[r + 1]]->env);
+        double x = max(env1.getMinX(), env2.getMinX());
+        double y = max(env1.getMinY(), env2.getMinY());
+        bool here = true;
+        for (SpillRun *up = run; up != NULL && here; up = up->parent) {
+            here = spill_cell(up, x, y) == up->next_partition - 1;
+        }
+        if (here) {
+            j->results[kept++] = j->results[r];
+            j->results[kept++] = j->results[r + 1];
+        }
+    }
+    j->results.resize(kept);
+
+    return kept / 2;
+}
+
+// The count (and area) of a spilled tile, summed over its cells as they
+// are joined.
+long count_spilled_tile(resque_join *j, const string &tile)
+{
+    long tuples = 0;
+    double area = 0.0;
+    while (!j->spill_tile.empty()) {
+        long kept = join_partition(j);
+        if (kept < 0) {
+            return -1;
+        }
+        aggregate_tile(j, tile, kept);
+        tuples += kept;
+        area += j->match_areas[0];
+    }
+    j->match_counts.assign(1, tuples);
+    j->match_areas.assign(1, area);
+    return tuples;
+}
+
+// The state of an incremental join is one disk R-tree per tile and dataset,
+// in the files <tile>.<dataset>.idx and .dat under j->state_dir, with the
+// index id in <tile>.<dataset>.id. The data of an entry is
+//     wkt_pos wkt_len \t record
+// and its region the envelope of the object. The region of every object id
+// is also kept in <tile>.<dataset>.box, as lines of
+//     object_id min_x min_y max_x max_y
+// so that an object added again can take the place of its old entry.
+struct TileState {
+    SpatialIndex::IStorageManager *storage;
+    SpatialIndex::ISpatialIndex *index;
+
+    TileState() : storage(NULL), index(NULL) {}
+    ~TileState() {
+        // the index writes its header to the storage when deleted
+        delete index;
+        delete storage;
+    }
+};
+
+// an entry of a tile state found by a probe
+struct StateHit {
+    SpatialIndex::id_type id;
+    double low[2];
+    double high[2];
+    string data;
+
+    bool operator<(const StateHit &other) const {
+        return id < other.id;
+    }
+};
+
+class StateVisitor : public SpatialIndex::IVisitor {
+public:
+    vector<StateHit> hits;
+
+    void visitNode(const SpatialIndex::INode &n) {}
+    void visitData(const SpatialIndex::IData &d) {
+        StateHit hit;
+        hit.id = d.getIdentifier();
+
+        SpatialIndex::IShape *shape;
+        d.getShape(&shape);
+        SpatialIndex::Region *region = static_cast<SpatialIndex::Region*>(shape);
+        for (int k = 0; k < 2; k++) {
+            hit.low[k] = region->m_pLow[k];
+            hit.high[k] = region->m_pHigh[k];
+        }
+        delete shape;
+
+        uint32_t len;
+        uint8_t *data;
+        d.getData(len, &data);
+        hit.data.assign((const char*) data, len);
+        delete[] data;
+
+        hits.push_back(hit);
+    }
+    void visitData(std::vector<const SpatialIndex::IData*> &v) {}
+};
+
+// the state files of a tile and dataset, without the suffix; the tile name
+// is escaped to stay one file name
+string state_base(resque_join *j, const string &tile, int database_id)
+{
+    std::stringstream base;
+    base << j->state_dir << '/';
+    for (size_t i = 0; i < tile.length(); i++) {
+        unsigned char c = tile[i];
+        if (isalnum(c) || c == '-' || c == '_') {
+            base << c;
+        }
+        else {
+            char escaped[4];
+            snprintf(escaped, sizeof(escaped), "%%%02X", c);
+            base << escaped;
+        }
+    }
+    base << '.' << database_id;
+    return base.str();
+}
+
+// Opens the state of a tile and dataset into state, or creates it when
+// create is set. state.index stays NULL when there is none yet.
+void open_state(resque_join *j, const string &tile, int database_id, bool create,
+        TileState &state)
+{
+    string base = state_base(j, tile, database_id);
+    string id_path = base + ".id";
+    SpatialIndex::id_type index_id;
+
+    ifstream id_in(id_path.c_str());
+    if (id_in >> index_id) {
+        state.storage = SpatialIndex::StorageManager::loadDiskStorageManager(base);
+        state.index = SpatialIndex::RTree::loadRTree(*state.storage, index_id);
+        return;
+    }
+    if (!create) {
+        return;
+    }
+
+    mkdir(j->state_dir.c_str(), 0777);
+    state.storage = SpatialIndex::StorageManager::createNewDiskStorageManager(base, 4096);
+    state.index = SpatialIndex::RTree::createNewRTree(*state.storage, 0.7, 100, 100, 2,
+            SpatialIndex::RTree::RV_RSTAR, index_id);
+    ofstream id_out(id_path.c_str());
+    id_out << index_id << '\n';
+    if (!id_out) {
+        throw runtime_error("cannot write " + id_path);
+    }
+}
+
+SpatialObject* state_object(const StateHit &hit)
+{
+    SpatialObject *obj = new SpatialObject();
+    obj->geom = NULL;
+    obj->locator = NULL;
+    obj->edge_index = NULL;
+
+    size_t record_pos = hit.data.find('\t');
+    std::istringstream header(hit.data.substr(0, record_pos));
+    header >> obj->wkt_pos >> obj->wkt_len;
+    if (!header || record_pos == string::npos) {
+        delete obj;
+        throw runtime_error("corrupt state entry");
+    }
+    obj->record = hit.data.substr(record_pos + 1);
+    obj->env.init(hit.low[0], hit.high[0], hit.low[1], hit.high[1]);
+    obj->num_points = count_wkt_points(obj->record, obj->wkt_pos, obj->wkt_len);
+    obj->is_point = obj->env.getWidth() == 0 && obj->env.getHeight() == 0
+        && is_point_wkt(obj->record.substr(obj->wkt_pos, obj->wkt_len));
+    return obj;
+}
+
+// Probes the state of the other dataset with every object of the delta of
+// dataset database_id; the pairs go to j->results and the objects of the
+// state they hold to old.
+static long join_state(resque_join *j, const string &tile, int database_id,
+        map<int, polyset> &old)
+{
+    int jp = j->predicates[0];
+    int other = database_id == DATABASE_ID_ONE ? DATABASE_ID_TWO : DATABASE_ID_ONE;
+
+    TileState state;
+    open_state(j, tile, other, false, state);
+    if (state.index == NULL) {
+        return 0;
+    }
+
+    polyset &delta = j->polydata[tile][database_id];
+    polyset &replaced = j->polydata[tile][other];
+    long pairs = 0;
+    for (polyset::iterator o = delta.begin(); o != delta.end(); o++) {
+        Envelope probe(o->second->env);
+        if (probe.isNull()) {
+            continue;
+        }
+        if (jp == ST_DWITHIN) {
+            probe.expandBy(j->dwithin_distance);
+        }
+        double low[2] = {probe.getMinX(), probe.getMinY()};
+        double high[2] = {probe.getMaxX(), probe.getMaxY()};
+        StateVisitor visitor;
+        state.index->intersectsWithQuery(SpatialIndex::Region(low, high, 2), visitor);
+        sort(visitor.hits.begin(), visitor.hits.end());
+
+        for (size_t h = 0; h < visitor.hits.size(); h++) {
+            int id = visitor.hits[h].id;
+            // the delta holds a newer copy, joined with the delta already
+            if (replaced.count(id) > 0) {
+                continue;
+            }
+            polyset::iterator s = old[other].find(id);
+            SpatialObject *obj;
+            if (s != old[other].end()) {
+                obj = s->second;
+            }
+            else {
+                obj = state_object(visitor.hits[h]);
+                old[other][id] = obj;
+            }
+
+            if (database_id == DATABASE_ID_ONE ? join_objects(j, o->second, obj, jp)
+                    : join_objects(j, obj, o->second, jp)) {
+                if (database_id == DATABASE_ID_ONE) {
+                    report_pair(j, o->first, id);
+                }
+                else {
+                    report_pair(j, id, o->first);
+                }
+                pairs++;
+            }
+        }
+    }
+    return pairs;
+}
+
+// Adds the delta of a tile and dataset to its state, replacing the entry
+// of an object id already there. An object built from a geometry is stored
+// with its WKT as the record; an empty one matches nothing and is left
+// out.
+static void update_state(resque_join *j, const string &tile, int database_id)
+{
+    polyset &delta = j->polydata[tile][database_id];
+    if (delta.empty()) {
+        return;
+    }
+
+    TileState state;
+    open_state(j, tile, database_id, true, state);
+
+    string box_path = state_base(j, tile, database_id) + ".box";
+    map<int, vector<double> > boxes;
+    ifstream box_in(box_path.c_str());
+    int id;
+    vector<double> box(4);
+    while (box_in >> id >> box[0] >> box[1] >> box[2] >> box[3]) {
+        boxes[id] = box;
+    }
+
+    for (polyset::iterator o = delta.begin(); o != delta.end(); o++) {
+        SpatialObject *obj = o->second;
+        map<int, vector<double> >::iterator old = boxes.find(o->first);
+        if (old != boxes.end()) {
+            const vector<double> &b = old->second;
+            double low[2] = {b[0], b[1]};
+            double high[2] = {b[2], b[3]};
+            state.index->deleteData(SpatialIndex::Region(low, high, 2), o->first);
+            boxes.erase(old);
+        }
+        if (obj->env.isNull()) {
+            continue;
+        }
+        if (obj->wkt_len == 0 && obj->geom != NULL) {
+            obj->record = obj->geom->toString();
+            obj->wkt_pos = 0;
+            obj->wkt_len = obj->record.length();
+        }
+
+        std::stringstream data;
+        data << obj->wkt_pos << ' ' << obj->wkt_len << '\t' << obj->record;
+        string bytes = data.str();
+        double low[2] = {obj->env.getMinX(), obj->env.getMinY()};
+        double high[2] = {obj->env.getMaxX(), obj->env.getMaxY()};
+        state.index->insertData(bytes.length(), (const uint8_t*) bytes.data(),
+                SpatialIndex::Region(low, high, 2), o->first);
+        boxes[o->first].assign(low, low + 2);
+        boxes[o->first].insert(boxes[o->first].end(), high, high + 2);
+    }
+
+    string box_tmp = box_path + ".tmp";
+    ofstream box_out(box_tmp.c_str());
+    box_out.precision(17);
+    for (map<int, vector<double> >::iterator b = boxes.begin(); b != boxes.end(); b++) {
+        box_out << b->first << ' ' << b->second[0] << ' ' << b->second[1] << ' '
+                << b->second[2] << ' ' << b->second[3] << '\n';
+    }
+    box_out.close();
+    if (!box_out || rename(box_tmp.c_str(), box_path.c_str()) != 0) {
+        throw runtime_error("cannot write " + box_path);
+    }
+}
+
+// The delta is joined with itself by join_bucket(), then each side of it
+// probes the state of the other side, so the cost follows the delta and
+// the state objects near it rather than the whole tile. The state objects
+// that matched join the tile afterwards for resque_record().
+long join_tile_incremental(resque_join *j, const string &tile)
+{
+    map<int, polyset> old;
+    long pairs = -1;
+    try {
+        pairs = join_bucket(j, tile);
+        if (pairs >= 0) {
+            pairs += join_state(j, tile, DATABASE_ID_ONE, old);
+            pairs += join_state(j, tile, DATABASE_ID_TWO, old);
+            update_state(j, tile, DATABASE_ID_ONE);
+            update_state(j, tile, DATABASE_ID_TWO);
+        }
+    }
+    catch (Tools::Exception& e) {
+        j->error = e.what();
+        pairs = -1;
+    }
+    catch (geos::util::GEOSException& e) {
+        j->error = e.what();
+        pairs = -1;
+    }
+    catch (runtime_error& e) {
+        j->error = e.what();
+        pairs = -1;
+    }
+
+    for (map<int, polyset>::iterator d = old.begin(); d != old.end(); d++) {
+        for (polyset::iterator o = d->second.begin(); o != d->second.end(); o++) {
+            if (pairs >= 0) {
+                j->polydata[tile][d->first][o->first] = o->second;
+            }
+            else {
+                free_object(o->second);
+            }
+        }
+    }
+    if (pairs < 0) {
+        j->results.clear();
+    }
+    return pairs;
+}
+
+// The broadcast objects go into an R-tree over their envelopes; their
+// geometries are parsed and prepared up front as every one of them is
+// probed many times.
+bool build_broadcast_index(resque_join *j)
+{
+    try {
+        SpatialIndex::id_type index_id;
+        j->broadcast_storage = SpatialIndex::StorageManager::createNewMemoryStorageManager();
+        j->broadcast_index = SpatialIndex::RTree::createNewRTree(*j->broadcast_storage, 0.7, 100, 100, 2,
+                SpatialIndex::RTree::RV_RSTAR, index_id);
+
+        for (size_t i = 0; i < j->broadcast_objects.size(); i++) {
+            SpatialObject *obj = j->broadcast_objects[i];
+            j->broadcast_prepared.push_back(PreparedGeometryFactory::prepare(get_geometry(j, obj)));
+
+            double low[2] = {obj->env.getMinX(), obj->env.getMinY()};
+            double high[2] = {obj->env.getMaxX(), obj->env.getMaxY()};
+            SpatialIndex::Region region(low, high, 2);
+            j->broadcast_index->insertData(0, NULL, region, i);
+        }
+    }
+    catch (Tools::Exception& e) {
+        j->error = e.what();
+        return false;
+    }
+    catch (geos::util::GEOSException& e) {
+        j->error = e.what();
+        return false;
+    }
+
+    return true;
+}
+
+// Matches are reported in broadcast order.
+long probe_broadcast(resque_join *j, SpatialObject *obj)
+{
+    int jp = j->predicates[0];
+
+    j->results.clear();
+    j->next_result = 0;
+    j->spill_tile.clear();
+    j->tuple_size = 1;
+    j->tuple_databases.assign(1, DATABASE_ID_ONE);
+
+    try {
+        IdVisitor visitor;
+        if (jp == ST_DISJOINT) {
+            // every broadcast object is a candidate
+            for (size_t i = 0; i < j->broadcast_objects.size(); i++) {
+                visitor.hits.push_back(i);
+            }
+        }
+        else {
+            Envelope probe(obj->env);
+            if (jp == ST_DWITHIN) {
+                probe.expandBy(j->dwithin_distance);
+            }
+            double low[2] = {probe.getMinX(), probe.getMinY()};
+            double high[2] = {probe.getMaxX(), probe.getMaxY()};
+            SpatialIndex::Region region(low, high, 2);
+            j->broadcast_index->intersectsWithQuery(region, visitor);
+            sort(visitor.hits.begin(), visitor.hits.end());
+        }
+
+        for (size_t h = 0; h < visitor.hits.size(); h++) {
+            SpatialIndex::id_type id = visitor.hits[h];
+            SpatialObject *other = j->broadcast_objects[id];
+            if (!envelope_filter(&other->env, &obj->env, jp, j->dwithin_distance)) {
+                continue;
+            }
+
+            // a probing point is located without being parsed
+            int related = obj->is_point ? point_relate(j, other, obj, jp) : -1;
+            bool hit = related >= 0
+                ? related != 0
+                : prepared_predicate(j->broadcast_prepared[id], get_geometry(j, obj),
+                        jp, j->dwithin_distance);
+            if (hit) {
+                j->results.push_back(id);
+            }
+        }
+    }
+    catch (Tools::Exception& e) {
+        j->error = e.what();
+        j->results.clear();
+        return -1;
+    }
+    catch (geos::util::GEOSException& e) {
+        j->error = e.what();
+        j->results.clear();
+        return -1;
+    }
+
+    return j->results.size();
+}
@@ -0,0 +1,273 @@
+#ifndef RESQUE_ENGINE_H
+#define RESQUE_ENGINE_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <ostream>
+
+// geos
+#include <geos/geom/Envelope.h>
+#include <geos/geom/Geometry.h>
+#include <geos/geom/GeometryFactory.h>
+#include <geos/geom/prep/PreparedGeometry.h>
+#include <geos/io/WKTReader.h>
+
+#include <spatialindex/SpatialIndex.h>
+
+#include "edge_index.h"
+#include "point_locator.h"
+#include "spatial_predicates.h"
+#include "wkt_envelope.h"
+
+// The join engine behind libresque.h and the resque command. Everything a
+// join needs lives in a resque_join; the public C API in libresque.cpp is a
+// thin layer over the functions declared here.
+
+#define OSM_SRID 4326
+
+#define DATABASE_ID_ONE 1
+#define DATABASE_ID_TWO 2
+
+// objects sampled per dataset when estimating the size of a join edge
+#define SAMPLE_SIZE 64
+
+// a spilled tile is cut into SPILL_GRID x SPILL_GRID partitions; a
+// partition whose run file holds more than 1 / SPILL_SPLIT_SHARE of the
+// memory budget is cut the same way again when it is joined, at most
+// SPILL_SPLIT_DEPTH times
+#define SPILL_GRID 8
+#define SPILL_SPLIT_SHARE 3
+#define SPILL_SPLIT_DEPTH 3
+// the memory a spilled object keeps in SpillRun::live, a map node of about
+// four pointers and the key, counted against the memory budget
+#define SPILL_LIVE_BYTES 64
+
+// filter algorithms of a two-way or self join tile, see plan_tile()
+#define PLAN_AUTO 0
+#define PLAN_NESTED_LOOP 1
+#define PLAN_PLANE_SWEEP 2
+#define PLAN_INDEXED 3
+#define PLAN_HASHED 4           // st_equals only, picked by PLAN_AUTO
+#define PLAN_RANGE_TREE 5       // st_contains and st_within only, likewise
+
+// what a tile reports, see join_bucket_outer() and aggregate_tile()
+#define JOIN_PAIRS 0            // every matching pair
+#define JOIN_SEMI 1             // the objects of dataset 1 with a match
+#define JOIN_ANTI 2             // the objects of dataset 1 without one
+#define JOIN_COUNT 3            // the number of tuples of the tile
+#define JOIN_OBJECT_COUNT 4     // every object of dataset 1 with its number
+                                // of matches
+
+// a tile with this many candidate pairs is refined by j->threads threads,
+// in chunks of about REFINE_CHUNK pairs
+#define PARALLEL_MIN_CANDIDATES 256
+#define REFINE_CHUNK 64
+
+// cost model units: one envelope test costs 1
+#define COST_SORT 1.0           // per comparison of a sort
+#define COST_INDEX_INSERT 8.0   // per level of an R-tree insert
+#define COST_INDEX_PROBE 4.0    // per level of an R-tree query
+#define COST_REFINE_VERTEX 2.0  // per vertex of a pair refined by GEOS
+
+// A tile object. Its envelope comes from precomputed MBR columns or a scan
+// of the WKT text; the geometry is parsed the first time a pair with it
+// survives the envelope filter.
+struct SpatialObject {
+    geos::geom::Envelope env;
+    geos::geom::Geometry *geom;     // NULL until parsed
+    bool is_point;                  // a POINT, its coordinates are env's corner
+    PointLocator *locator;          // NULL until built, see get_locator()
+    EdgeIndex *edge_index;          // NULL until built, see get_edge_index()
+    std::string record;             // the caller's record holding the WKT
+    size_t wkt_pos;
+    size_t wkt_len;
+    size_t num_points;              // vertices, see count_wkt_points()
+};
+
+// the join of a tile estimated from a sample of its objects, see
+// estimate_tile()
+struct TileEstimate {
+    int plan;                       // PLAN_xxx the tile would get
+    double model_candidates;        // by the cost model over the box sizes
+    double candidates;              // by the sample
+    double pairs;                   // by the sample
+    double cost;                    // filter and refinement, in envelope tests
+};
+
+// data type declaration
+typedef std::map<int, SpatialObject*> polyset;
+typedef std::map<std::string, std::map<int, polyset> > polymap;
+
+// A tile moved to disk once the memory budget ran out. Its objects are
+// written to one run file per grid cell they overlap; the tile is joined
+// one cell at a time and a pair is only reported in the cell holding the
+// reference point of the pair (the lower left corner of the intersection
+// of the two boxes), so a pair seen in several cells comes out once.
+// A cell too large to join in memory is split into a run of its own over
+// the cell, whose cells are joined in its place; a pair then also needs
+// its reference point in the cell of every run above.
+struct SpillRun {
+    std::string dir;
+    geos::geom::Envelope extent;    // the tile when it was spilled, or the
+                                    // cell split; the border cells take what
+                                    // lies outside
+    std::vector<std::ofstream*> files;  // empty while closed
+    int next_partition;             // the cell joined next
+    SpillRun *parent;               // the run of the cell split, NULL for a
+                                    // tile
+    int depth;                      // the splits above
+    long split_lines;               // the lines of the cell split
+    std::vector<long> lines;        // the lines written to each cell
+    // objects are written with a serial number; (dataset id, object id) ->
+    // the serial of the copy that counts, the first one in a self join and
+    // the last one otherwise, as in memory
+    long written;
+    std::map<std::pair<int, int>, long> live;
+};
+
+struct resque_join {
+    int num_datasets;
+    // predicates[k] joins dataset k + 1 with dataset k + 2
+    std::vector<int> predicates;
+    // st_dwithin used to buffer both sides by 5.0 and intersect the buffers
+    double dwithin_distance;
+    // self join: both sides of the join come from dataset DATABASE_ID_ONE
+    bool self_join;
+    // self join: report a symmetric pair as (i, j) and (j, i)
+    bool both_directions;
+
+    // tile id -> dataset id -> object id -> object
+    polymap polydata;
+
+    // PLAN_AUTO picks the filter algorithm of each tile by its estimated
+    // cost; the plans are logged to plan_log unless it is NULL
+    int plan;
+    std::ostream *plan_log;
+    std::ofstream *plan_log_file;   // plan_log when it is owned
+    // threads refining the candidates of a large tile
+    int threads;
+    // JOIN_xxx
+    int join_mode;
+    // JOIN_COUNT and JOIN_OBJECT_COUNT also sum the area of the
+    // intersection of every pair
+    bool aggregate_area;
+
+    // 0 for no limit; beyond it the largest tile in memory is spilled to
+    // a directory under spill_dir
+    size_t memory_budget;
+    size_t memory_used;
+    std::map<std::string, size_t> tile_bytes;
+    std::string spill_dir;
+    std::map<std::string, SpillRun*> spilled;
+    // the run files of one tile at most are open at a time
+    SpillRun *open_run;
+    // the spilled tile being joined, empty when none, and the run whose
+    // cells are joined, the innermost split cell's
+    std::string spill_tile;
+    SpillRun *join_run;
+
+    // incremental join: the objects added are a delta, joined with each
+    // other and with the state of their tile under state_dir, which they
+    // are then added to; empty for an ordinary join
+    std::string state_dir;
+
+    // the tuples of the last join or probe, tuple_size object ids each;
+    // position k holds an object of dataset tuple_databases[k]
+    std::vector<int> results;
+    int tuple_size;
+    std::vector<int> tuple_databases;
+    size_t next_result;
+    // the aggregates of the last join: one for the tile (JOIN_COUNT) or
+    // one per tuple (JOIN_OBJECT_COUNT)
+    std::vector<long> match_counts;
+    std::vector<double> match_areas;
+
+    // broadcast join: dataset DATABASE_ID_ONE indexed once, probed by the
+    // objects of dataset DATABASE_ID_TWO one at a time
+    std::vector<SpatialObject*> broadcast_objects;
+    std::vector<const geos::geom::prep::PreparedGeometry*> broadcast_prepared;
+    SpatialIndex::IStorageManager *broadcast_storage;
+    SpatialIndex::ISpatialIndex *broadcast_index;
+
+    geos::geom::GeometryFactory *factory;
+    geos::io::WKTReader *wkt_reader;
+
+    std::string error;
+};
+
+class IdVisitor : public SpatialIndex::IVisitor {
+public:
+    std::vector<SpatialIndex::id_type> hits;
+
+    void visitNode(const SpatialIndex::INode &n) {}
+    void visitData(const SpatialIndex::IData &d) { hits.push_back(d.getIdentifier()); }
+    void visitData(std::vector<const SpatialIndex::IData*> &v) {}
+};
+
+resque_join* create_join(int num_datasets, const std::vector<int> &predicates);
+void destroy_join(resque_join *j);
+
+// box may be NULL to take the envelope from the WKT text, and its
+// num_points 0 to count the vertices there; NULL (with j->error set) when
+// the WKT does not parse
+SpatialObject* make_object(resque_join *j, const std::string &record,
+        size_t wkt_pos, size_t wkt_len, const wkt_extent *box);
+// an object for a geometry built by the caller, which it now owns
+SpatialObject* make_object(resque_join *j, geos::geom::Geometry *geom);
+// 1 when added, 0 when a self join already holds the object, -1 for a bad
+// dataset id or an object of a spilled tile that could not be written;
+// obj is freed unless added. An object of a spilled tile goes straight to
+// its run files. -1 also when the object was added but the memory budget
+// ran out and the largest tile could not be spilled: that tile, which may
+// be obj's own, is dropped whole, its objects freed and its run files
+// removed, and the other tiles are kept.
+int add_object(resque_join *j, const std::string &tile, int database_id, int object_id,
+        SpatialObject *obj);
+void free_object(SpatialObject *obj);
+
+const geos::geom::Geometry* get_geometry(resque_join *j, SpatialObject *obj);
+const PointLocator* get_locator(resque_join *j, SpatialObject *obj);
+const EdgeIndex* get_edge_index(resque_join *j, SpatialObject *obj);
+bool join_objects(resque_join *j, SpatialObject *obj1, SpatialObject *obj2, const int jp);
+
+// joins one tile into j->results, in the order the pairs (tuples) are
+// reported; returns their number, -1 on error. A spilled tile returns 0
+// and is joined partition by partition from next_result(), or at once for
+// JOIN_COUNT.
+long join_tile(resque_join *j, const std::string &tile);
+// 1 with the next tuple of the last join or probe in ids, 0 after the last
+// one, -1 on error
+int next_result(resque_join *j, const int **ids);
+void clear_tiles(resque_join *j);
+
+// the objects of a two-way or self join tile taken as a uniform sample of
+// size_one and size_two objects (size_one for a self join); -1 on error
+int estimate_tile(resque_join *j, const std::string &tile, long size_one, long size_two,
+        TileEstimate &estimate);
+
+// JOIN_xxx of "pairs", "semi", "anti", "count" or "object-count", -1 when
+// unknown
+int get_join_mode(const char *name);
+
+// PLAN_xxx of "auto", "nested", "sweep" or "index", -1 when unknown
+int get_plan(const char *name);
+const char* plan_name(int plan);
+
+// false when a tile of the current join could not be spilled safely:
+// partitions cannot hold st_disjoint or multiway tuples, an object of a
+// semi, anti or object count join may need the whole tile, and the delta
+// of an incremental join stays in memory. A count join sums its cells.
+bool can_spill(resque_join *j);
+
+// joins the delta of a tile with itself and with the tile state, then adds
+// it to the state; as join_tile()
+long join_tile_incremental(resque_join *j, const std::string &tile);
+
+bool build_broadcast_index(resque_join *j);
+// the matches of obj against the broadcast objects, as one id tuples in
+// j->results; -1 on error
+long probe_broadcast(resque_join *j, SpatialObject *obj);
+
+#endif
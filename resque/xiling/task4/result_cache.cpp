@@ -0,0 +1,213 @@
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+#include "result_cache.h"
+
+using namespace std;
+
+#define FNV_PRIME 1099511628211ULL
+
+// two FNV-1a hashes with different offset bases make a 128 bit key
+static const uint64_t fnv_offset[2] = {14695981039346656037ULL, 1099511628211ULL * 31};
+
+static uint64_t fnv1a(uint64_t h, const char *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) data[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+static string hex(uint64_t v)
+{
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long) v);
+    return buf;
+}
+
+TileDigest::TileDigest()
+{
+    sum[0] = 0;
+    sum[1] = 0;
+    records = 0;
+}
+
+void TileDigest::add(int database_id, const char *record, size_t len)
+{
+    for (int k = 0; k < 2; k++) {
+        uint64_t h = fnv1a(fnv_offset[k], (const char*) &database_id, sizeof(database_id));
+        sum[k] += fnv1a(h, record, len);
+    }
+    records++;
+}
+
+ResultCache::ResultCache(const string &dir, uint64_t max_bytes)
+    : dir(dir), max_bytes(max_bytes), pending(NULL)
+{
+    // an existing directory is shared
+    mkdir(dir.c_str(), 0777);
+}
+
+ResultCache::~ResultCache()
+{
+    abort_entry();
+}
+
+string ResultCache::key(const string &params, const TileDigest &digest) const
+{
+    std::stringstream input;
+    input << params << '\n' << hex(digest.sum[0]) << hex(digest.sum[1]) << ' ' << digest.records;
+    string text = input.str();
+
+    return hex(fnv1a(fnv_offset[0], text.data(), text.length()))
+        + hex(fnv1a(fnv_offset[1], text.data(), text.length()));
+}
+
+string ResultCache::path(const string &key) const
+{
+    return dir + "/" + key + ".out";
+}
+
+bool ResultCache::fetch(const string &key, ostream &out, long &pairs)
+{
+    string file = path(key);
+    ifstream in(file.c_str(), ios::in | ios::binary);
+    if (!in) {
+        return false;
+    }
+
+    // a hit is recent use
+    utime(file.c_str(), NULL);
+
+    char buf[65536];
+    pairs = 0;
+    while (in) {
+        in.read(buf, sizeof(buf));
+        streamsize n = in.gcount();
+        pairs += count(buf, buf + n, '\n');
+        out.write(buf, n);
+    }
+    return true;
+}
+
+ostream* ResultCache::open_entry(const string &key)
+{
+    abort_entry();
+
+    // unique among the reducers sharing the directory
+    std::stringstream tmp;
+    tmp << dir << "/." << key << "." << getpid() << ".tmp";
+    pending_path = tmp.str();
+    pending_key = key;
+    pending = new ofstream(pending_path.c_str(), ios::out | ios::binary | ios::trunc);
+    if (!*pending) {
+        delete pending;
+        pending = NULL;
+        return NULL;
+    }
+    return pending;
+}
+
+bool ResultCache::commit_entry()
+{
+    if (pending == NULL) {
+        return false;
+    }
+    pending->close();
+    bool ok = !pending->fail() && rename(pending_path.c_str(), path(pending_key).c_str()) == 0;
+    delete pending;
+    pending = NULL;
+    if (!ok) {
+        unlink(pending_path.c_str());
+        return false;
+    }
+
+    evict();
+    return true;
+}
+
+void ResultCache::abort_entry()
+{
+    if (pending != NULL) {
+        delete pending;
+        pending = NULL;
+        unlink(pending_path.c_str());
+    }
+}
+
+// true for the temporary file .<key>.<pid>.tmp of an entry whose writer
+// is gone: its process no longer runs and the file has not been written
+// for CACHE_STALE_SECONDS, as a reducer on another host may share the
+// directory
+static bool stale_entry(const char *name, const struct stat &st)
+{
+    size_t len = strlen(name);
+    if (name[0] != '.' || len < 4 || strcmp(name + len - 4, ".tmp") != 0) {
+        return false;
+    }
+    const char *dot = strchr(name + 1, '.');
+    char *end;
+    long pid = dot != NULL ? strtol(dot + 1, &end, 10) : 0;
+    if (pid <= 0 || end != name + len - 4) {
+        return false;
+    }
+    return kill((pid_t) pid, 0) != 0 && errno == ESRCH
+        && time(NULL) - st.st_mtime > CACHE_STALE_SECONDS;
+}
+
+// Deletes the temporary files left by writers that died, then the least
+// recently used entries until the directory holds at most max_bytes.
+void ResultCache::evict()
+{
+    DIR *d = opendir(dir.c_str());
+    if (d == NULL) {
+        return;
+    }
+
+    vector<pair<time_t, string> > entries;
+    uint64_t total = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        size_t len = strlen(e->d_name);
+        string file = dir + "/" + e->d_name;
+        struct stat st;
+        if (stat(file.c_str(), &st) != 0) {
+            continue;
+        }
+        if (stale_entry(e->d_name, st)) {
+            unlink(file.c_str());
+            continue;
+        }
+        if (e->d_name[0] == '.' || len < 4 || strcmp(e->d_name + len - 4, ".out") != 0) {
+            continue;
+        }
+        entries.push_back(make_pair(st.st_mtime, file));
+        total += st.st_size;
+    }
+    closedir(d);
+
+    if (max_bytes == 0 || total <= max_bytes) {
+        return;
+    }
+
+    sort(entries.begin(), entries.end());
+    for (size_t i = 0; i < entries.size() && total > max_bytes; i++) {
+        struct stat st;
+        if (stat(entries[i].second.c_str(), &st) == 0 && unlink(entries[i].second.c_str()) == 0) {
+            total -= st.st_size;
+        }
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <stdint.h>
+
+// The on-disk result cache of resque. A tile's output is stored under a
+// key hashed from the join parameters and the records of the tile, so a
+// tile joined again with the same input and arguments is streamed from
+// the cache instead; tiles with the same records share one entry, within
+// a job or across the reducers of several, unless the caller puts the tile
+// into the parameters because the output names it. Entries are files
+// <key>.out in one directory; the least recently used ones are evicted
+// once the directory outgrows its size bound.
+
+// the age after which the temporary file of a writer that is gone is
+// deleted
+#define CACHE_STALE_SECONDS 3600
+
+// The records of a tile as a multiset: the hashes of the records are
+// summed, so the digest does not depend on the order the shuffle
+// delivers them in.
+struct TileDigest {
+    uint64_t sum[2];
+    long records;
+
+    TileDigest();
+    void add(int database_id, const char *record, size_t len);
+};
+
+class ResultCache {
+public:
+    // max_bytes 0 for no bound
+    ResultCache(const std::string &dir, uint64_t max_bytes);
+    ~ResultCache();
+
+    // the key of a tile joined with params, the normalized arguments
+    std::string key(const std::string &params, const TileDigest &digest) const;
+
+    // streams the entry of key to out; pairs is its number of tuples.
+    // false on a miss.
+    bool fetch(const std::string &key, std::ostream &out, long &pairs);
+
+    // an entry is written to a temporary file while the tile is joined
+    // and appears under its key on commit; NULL when it cannot be written
+    std::ostream* open_entry(const std::string &key);
+    bool commit_entry();
+    void abort_entry();
+
+private:
+    std::string path(const std::string &key) const;
+    void evict();
+
+    std::string dir;
+    uint64_t max_bytes;
+
+    std::ofstream *pending;
+    std::string pending_key;
+    std::string pending_path;
+};
+
+#endif
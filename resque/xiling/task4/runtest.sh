@@ -0,0 +1,691 @@
+#! /bin/bash
+
+dir=data
+
+if [ -e ${dir}/new_test_1.tsv ] && [ -e ${dir}/new_test_2.tsv ]
+then
+    echo "All testing infrastructure is present."
+else
+    echo "Test cases are missing... Can't do test without them."
+    exit 1
+fi
+
+# create the test files.
+make -f makefile
+
+# resque reads the hive reducer stream: tile id, a tab, then the record
+# with its columns separated by ctrl+b. The tile is the first column, or
+# the one given with -t for every record.
+function reducer_input() {
+    local tile=
+    if [ "$1" = "-t" ]
+    then
+        tile=$2
+        shift 2
+    fi
+    awk -F'\t' -v tile="${tile}" '{ line = $0; gsub(/\t/, "\002", line); print (tile == "" ? $1 : tile) "\t" line }' "$@"
+}
+
+
+# test resque self join
+
+echo -n "TEST: Resque Self Join --- "
+
+# the old way: dataset 1 joined with a copy of itself relabelled as dataset 2,
+# minus the (i, i) pairs, mapped back to dataset 1
+awk -F'\t' 'BEGIN { OFS = "\t" } { $2 = 2; print }' ${dir}/new_test_1.tsv > ${dir}/self_copy.tsv
+reducer_input ${dir}/new_test_1.tsv ${dir}/self_copy.tsv | ./resque st_intersects 10 10 \
+    | awk -F'\002' '{ n = split($2, r, "\t"); r[2] = 1; right = r[1]; for (i = 2; i <= n; i++) right = right "\t" r[i]; if ($1 != right) print $1 "\002" right }' \
+    | sort > ${dir}/self_join_standard.txt
+
+reducer_input ${dir}/new_test_1.tsv | ./resque --self-join --both-directions st_intersects 10 | sort > ${dir}/self_join_out.txt
+
+diff ${dir}/self_join_out.txt ${dir}/self_join_standard.txt >/dev/null 2>&1
+
+if [ $? -ne 0 ]
+then
+    echo "failed."
+else
+    echo "passed."
+    rm ${dir}/self_join_out.txt ${dir}/self_join_standard.txt ${dir}/self_copy.tsv
+fi
+
+
+# test the broadcast join
+
+echo -n "TEST: Resque Broadcast Join --- "
+
+# the reducer join of the two datasets with every record in one tile
+reducer_input -t 0 ${dir}/new_test_1.tsv ${dir}/new_test_2.tsv \
+    | ./resque st_intersects 10 10 | sort > ${dir}/broadcast_standard.txt
+
+./resque --broadcast ${dir}/new_test_1.tsv st_intersects 10 10 < ${dir}/new_test_2.tsv | sort > ${dir}/broadcast_out.txt
+
+diff ${dir}/broadcast_out.txt ${dir}/broadcast_standard.txt >/dev/null 2>&1
+
+if [ $? -ne 0 ]
+then
+    echo "failed."
+else
+    echo "passed."
+    rm ${dir}/broadcast_out.txt ${dir}/broadcast_standard.txt
+fi
+
+
+# test the point in polygon refinement, under every filter plan and on
+# several threads
+
+echo -n "TEST: Resque Point In Polygon --- "
+
+# the first vertex and the vertex mean of every dataset 1 polygon as
+# dataset 2, on a boundary and mostly inside, as a POINT and as a one
+# point MULTIPOINT which still goes through GEOS
+awk -F'\t' 'BEGIN { OFS = "\t" } {
+        n = split($11, c, /[(), ]+/); sx = 0; sy = 0
+        for (k = 2; k + 1 < n; k += 2) { sx += c[k]; sy += c[k + 1] }
+        $2 = 2; $11 = "POINT(" c[2] " " c[3] ")"; print
+        $3 += 1000; $11 = "POINT(" sx * 2 / (n - 2) " " sy * 2 / (n - 2) ")"; print
+    }' ${dir}/new_test_1.tsv > ${dir}/points.tsv
+sed 's/POINT(\([^)]*\))/MULTIPOINT((\1))/' ${dir}/points.tsv > ${dir}/multipoints.tsv
+
+rm -f ${dir}/points_out.txt ${dir}/points_standard.txt
+for predicate in st_intersects st_contains st_touches
+do
+    reducer_input -t 0 ${dir}/new_test_1.tsv ${dir}/multipoints.tsv | ./resque ${predicate} 10 10 \
+        | sed 's/MULTIPOINT((\([^)]*\)))/POINT(\1)/' > ${dir}/points_multi.txt
+    for args in "" "--plan nested" "--plan sweep" "--plan index" "--threads 4"
+    do
+        reducer_input -t 0 ${dir}/new_test_1.tsv ${dir}/points.tsv | ./resque ${args} ${predicate} 10 10 >> ${dir}/points_out.txt
+        cat ${dir}/points_multi.txt >> ${dir}/points_standard.txt
+    done
+done
+
+diff ${dir}/points_out.txt ${dir}/points_standard.txt >/dev/null 2>&1 && [ -s ${dir}/points_out.txt ]
+
+if [ $? -ne 0 ]
+then
+    echo "failed."
+else
+    echo "passed."
+    rm ${dir}/points.tsv ${dir}/multipoints.tsv ${dir}/points_multi.txt ${dir}/points_out.txt ${dir}/points_standard.txt
+fi
+
+
+# test the server mode: two requests on one process give the same pairs as
+# two separate runs, a request for a server of its own is refused, and a
+# shutdown ends the process cleanly
+
+echo -n "TEST: Resque Server --- "
+
+reducer_input ${dir}/new_test_1.tsv ${dir}/new_test_2.tsv > ${dir}/server_input.txt
+lines=$(wc -l < ${dir}/server_input.txt)
+
+(./resque st_intersects 10 10 < ${dir}/server_input.txt; ./resque st_contains 10 10 < ${dir}/server_input.txt) > ${dir}/server_standard.txt
+
+(echo "JOIN ${lines} st_intersects 10 10"; cat ${dir}/server_input.txt; \
+ echo "JOIN ${lines} st_contains 10 10"; cat ${dir}/server_input.txt; \
+ echo "JOIN 0 --server st_intersects 10 10"; echo "SHUTDOWN") \
+    | ./resque --server > ${dir}/server_reply.txt
+status=$?
+grep -v '^END \|^ERROR ' ${dir}/server_reply.txt > ${dir}/server_out.txt
+
+diff ${dir}/server_out.txt ${dir}/server_standard.txt >/dev/null 2>&1 && [ ${status} -eq 0 ] && \
+[ `grep -c '^ERROR ' ${dir}/server_reply.txt` -eq 1 ]
+
+if [ $? -ne 0 ]
+then
+    echo "failed."
+else
+    echo "passed."
+    rm ${dir}/server_input.txt ${dir}/server_reply.txt ${dir}/server_out.txt ${dir}/server_standard.txt
+fi
+
+
+# test the spill to disk: with a memory budget far below the size of the
+# tile, the tile is joined partition by partition from disk and gives the
+# same pairs, also when three copies of dataset 1 on each side make cells
+# too large for the budget, which are split again
+
+echo -n "TEST: Resque Memory Budget --- "
+
+# both datasets in one tile, and both as one dataset for the self join
+reducer_input -t 0 ${dir}/new_test_1.tsv ${dir}/new_test_2.tsv > ${dir}/spill_input.txt
+awk -F'\t' 'BEGIN { OFS = "\t" } { $2 = 1; if (FILENAME ~ /_2/) $3 += 1000; print }' ${dir}/new_test_1.tsv ${dir}/new_test_2.tsv \
+    | reducer_input -t 0 > ${dir}/spill_self.txt
+for copy in 0 1 2
+do
+    for db in 1 2
+    do
+        awk -F'\t' -v copy=${copy} -v db=${db} 'BEGIN { OFS = "\t" } { $2 = db; $3 = $3 + 1000 * copy; print }' ${dir}/new_test_1.tsv \
+            | reducer_input -t 0
+    done
+done > ${dir}/spill_dense.txt
+
+mkdir -p ${dir}/spill
+rm -f ${dir}/spill_out.txt ${dir}/spill_standard.txt
+for args in "st_intersects 10 10" "st_dwithin 10 10" "st_within 10 10"
+do
+    ./resque ${args} < ${dir}/spill_input.txt | sort >> ${dir}/spill_standard.txt
+    ./resque --memory-budget 0.05 --spill-dir ${dir}/spill ${args} < ${dir}/spill_input.txt | sort >> ${dir}/spill_out.txt
+done
+./resque --self-join --both-directions st_intersects 10 < ${dir}/spill_self.txt | sort >> ${dir}/spill_standard.txt
+./resque --memory-budget 0.05 --spill-dir ${dir}/spill --self-join --both-directions st_intersects 10 \
+    < ${dir}/spill_self.txt | sort >> ${dir}/spill_out.txt
+for args in "st_intersects 10 10" "st_dwithin 10 10" "--join-mode count st_intersects 10 10"
+do
+    ./resque ${args} < ${dir}/spill_dense.txt | sort >> ${dir}/spill_standard.txt
+    ./resque --memory-budget 0.01 --spill-dir ${dir}/spill ${args} < ${dir}/spill_dense.txt | sort >> ${dir}/spill_out.txt
+done
+
+diff ${dir}/spill_out.txt ${dir}/spill_standard.txt >/dev/null 2>&1 && [ -z "$(ls ${dir}/spill)" ]
+
+if [ $? -ne 0 ]
+then
+    echo "failed."
+else
+    echo "passed."
+    rm -r ${dir}/spill ${dir}/spill_input.txt ${dir}/spill_self.txt ${dir}/spill_dense.txt ${dir}/spill_out.txt ${dir}/spill_standard.txt
+fi
+
+
+# test the join plans: the plane sweep and the indexed join report the same
+# pairs as the nested loop, in the same order
+
+echo -n "TEST: Resque Join Plans --- "
+
+reducer_input -t 0 ${dir}/new_test_1.tsv ${dir}/new_test_2.tsv > ${dir}/plan_input.txt
+
+failed=0
+for args in "st_intersects 10 10" "st_dwithin 10 10" "st_contains 10 10" "--self-join --both-directions st_intersects 10"
+do
+    ./resque --plan nested ${args} < ${dir}/plan_input.txt > ${dir}/plan_standard.txt
+    for plan in sweep index auto
+    do
+        ./resque --plan ${plan} --plan-log ${dir}/plan_log.txt ${args} < ${dir}/plan_input.txt > ${dir}/plan_out.txt
+        diff ${dir}/plan_out.txt ${dir}/plan_standard.txt >/dev/null 2>&1 || failed=1
+    done
+done
+
+# one line per tile and run
+[ "$(wc -l < ${dir}/plan_log.txt)" -eq 12 ] || failed=1
+
+if [ ${failed} -ne 0 ]
+then
+    echo "failed."
+else
+    echo "passed."
+    rm ${dir}/plan_input.txt ${dir}/plan_standard.txt ${dir}/plan_out.txt ${dir}/plan_log.txt
+fi
+
+
+# test the parallel refinement: three copies of dataset 1 on each side
+# make a tile of enough candidate pairs, refined the same on four threads
+
+echo -n "TEST: Resque Parallel Refinement --- "
+
+for copy in 0 1 2
+do
+    for db in 1 2
+    do
+        awk -F'\t' -v copy=${copy} -v db=${db} 'BEGIN { OFS = "\t" } { $2 = db; $3 = $3 + 1000 * copy; print }' ${dir}/new_test_1.tsv \
+            | reducer_input -t 0
+    done
+done > ${dir}/parallel_input.txt
+
+failed=0
+for args in "st_intersects 10 10" "st_equals 10 10" "--self-join --both-directions st_intersects 10"
+do
+    ./resque ${args} < ${dir}/parallel_input.txt > ${dir}/parallel_standard.txt
+    ./resque --threads 4 ${args} < ${dir}/parallel_input.txt > ${dir}/parallel_out.txt
+    diff ${dir}/parallel_out.txt ${dir}/parallel_standard.txt >/dev/null 2>&1 || failed=1
+done
+
+if [ ${failed} -ne 0 ]
+then
+    echo "failed."
+else
+    echo "passed."
+    rm ${dir}/parallel_input.txt ${dir}/parallel_standard.txt ${dir}/parallel_out.txt
+fi
+
+
+# test the result cache: a second run streams every tile from the cache,
+# and a cache too small for one tile ends up empty, without the temporary
+# file of a writer that died long ago
+
+echo -n "TEST: Resque Result Cache --- "
+
+for tile in 0 1
+do
+    for db in 1 2
+    do
+        awk -F'\t' -v tile=${tile} -v db=${db} 'BEGIN { OFS = "\t" } { $2 = db; $3 = $3 + 1000 * tile; print }' ${dir}/new_test_${db}.tsv \
+            | reducer_input -t ${tile}
+    done
+done > ${dir}/cache_input.txt
+
+rm -rf ${dir}/cache
+./resque st_intersects 10 10 < ${dir}/cache_input.txt > ${dir}/cache_standard.txt
+./resque --cache-dir ${dir}/cache st_intersects 10 10 < ${dir}/cache_input.txt > ${dir}/cache_first.txt
+./resque --cache-dir ${dir}/cache st_intersects 10 10 < ${dir}/cache_input.txt > ${dir}/cache_second.txt
+entries=`ls ${dir}/cache | wc -l`
+touch -d '-2 hours' ${dir}/cache/.0123456789abcdef0123456789abcdef.999999999.tmp
+./resque --cache-dir ${dir}/cache --cache-size 0.000001 st_within 10 10 < ${dir}/cache_input.txt > /dev/null
+left=`ls -A ${dir}/cache | wc -l`
+
+# the count line of a tile names it, so two tiles with the same records
+# must not share it
+rm -rf ${dir}/cache
+for tile in 0 1
+do
+    reducer_input -t ${tile} ${dir}/new_test_1.tsv ${dir}/new_test_2.tsv
+done > ${dir}/cache_twins.txt
+./resque --join-mode count st_intersects 10 10 < ${dir}/cache_twins.txt > ${dir}/cache_count_standard.txt
+./resque --cache-dir ${dir}/cache --join-mode count st_intersects 10 10 < ${dir}/cache_twins.txt > ${dir}/cache_count.txt
+./resque --cache-dir ${dir}/cache --join-mode count st_intersects 10 10 < ${dir}/cache_twins.txt > ${dir}/cache_count_second.txt
+
+diff ${dir}/cache_first.txt ${dir}/cache_standard.txt >/dev/null 2>&1 && \
+diff ${dir}/cache_second.txt ${dir}/cache_standard.txt >/dev/null 2>&1 && \
+[ ${entries} -eq 2 ] && [ ${left} -eq 0 ] && \
+diff ${dir}/cache_count.txt ${dir}/cache_count_standard.txt >/dev/null 2>&1 && \
+diff ${dir}/cache_count_second.txt ${dir}/cache_count_standard.txt >/dev/null 2>&1
+
+if [ $? -ne 0 ]
+then
+    echo "failed."
+else
+    echo "passed."
+    rm -rf ${dir}/cache ${dir}/cache_input.txt ${dir}/cache_standard.txt ${dir}/cache_first.txt ${dir}/cache_second.txt \
+        ${dir}/cache_twins.txt ${dir}/cache_count_standard.txt ${dir}/cache_count.txt ${dir}/cache_count_second.txt
+fi
+
+
+# test the incremental join: the input joined in three batches against a
+# growing state gives the pairs of the whole input, and an object added
+# again replaces its copy in the state, so adding dataset 1 again and then
+# dataset 2 again gives every pair once more each time
+
+echo -n "TEST: Resque Incremental Join --- "
+
+reducer_input -t 0 ${dir}/new_test_1.tsv ${dir}/new_test_2.tsv > ${dir}/delta_input.txt
+
+failed=0
+for args in "st_intersects 10 10" "st_dwithin 10 10" "st_contains 10 10"
+do
+    rm -rf ${dir}/state
+    ./resque ${args} < ${dir}/delta_input.txt | sort > ${dir}/delta_standard.txt
+    for batch in 0 1 2
+    do
+        awk -v batch=${batch} 'NR % 3 == batch' ${dir}/delta_input.txt | ./resque --incremental ${dir}/state ${args}
+    done | sort > ${dir}/delta_out.txt
+    diff ${dir}/delta_out.txt ${dir}/delta_standard.txt >/dev/null 2>&1 || failed=1
+done
+
+rm -rf ${dir}/state
+./resque st_intersects 10 10 < ${dir}/delta_input.txt | sort > ${dir}/delta_standard.txt
+for batch in all 1 2
+do
+    awk -F'\002' -v batch=${batch} 'batch == "all" || $2 == batch' ${dir}/delta_input.txt \
+        | ./resque --incremental ${dir}/state st_intersects 10 10 | sort > ${dir}/delta_out.txt
+    diff ${dir}/delta_out.txt ${dir}/delta_standard.txt >/dev/null 2>&1 || failed=1
+done
+
+if [ ${failed} -ne 0 ]
+then
+    echo "failed."
+else
+    echo "passed."
+    rm -rf ${dir}/state ${dir}/delta_input.txt ${dir}/delta_standard.txt ${dir}/delta_out.txt
+fi
+
+
+# test the estimator: a tile smaller than the sample is estimated exactly
+
+echo -n "TEST: Resque Estimate --- "
+
+reducer_input -t 0 ${dir}/new_test_1.tsv ${dir}/new_test_2.tsv > ${dir}/estimate_input.txt
+
+failed=0
+for args in "st_intersects 10 10" "st_dwithin 10 10" "--self-join st_intersects 10"
+do
+    pairs=`./resque ${args} < ${dir}/estimate_input.txt | wc -l`
+    ./resque --estimate ${args} < ${dir}/estimate_input.txt > ${dir}/estimate_out.txt
+    estimated=`awk -F'\t' '$1 == "*" && NF == 10 { print $9 }' ${dir}/estimate_out.txt`
+    [ "${estimated}" = "${pairs}" ] || failed=1
+done
+
+if [ ${failed} -ne 0 ]
+then
+    echo "failed."
+else
+    echo "passed."
+    rm ${dir}/estimate_input.txt ${dir}/estimate_out.txt
+fi
+
+
+# test the statistics sidecar: a line per tile and dataset whose counts
+# and histograms add up to the input
+
+echo -n "TEST: Resque Tile Statistics --- "
+
+reducer_input ${dir}/new_test_1.tsv ${dir}/new_test_2.tsv > ${dir}/stats_input.txt
+
+./resque --stats ${dir}/stats.txt st_intersects 10 10 < ${dir}/stats_input.txt > /dev/null
+records=`wc -l < ${dir}/stats_input.txt`
+tiles=`cut -f1,2 ${dir}/new_test_1.tsv ${dir}/new_test_2.tsv | sort -u | wc -l`
+awk -F'\t' -v records=${records} -v tiles=${tiles} '
+    NF != 11 { bad = 1 }
+    { count += $3; n = split($11, h, ","); for (c = 1; c <= n; c++) cells += h[c] }
+    END { exit !(bad == 0 && NR == tiles && count == records && cells == records) }' ${dir}/stats.txt
+
+if [ $? -ne 0 ]
+then
+    echo "failed."
+else
+    echo "passed."
+    rm ${dir}/stats_input.txt ${dir}/stats.txt
+fi
+
+
+# test the load balancing manifest: skewed tiles, every one assigned once,
+# and no reducer busier than with hash partitioning
+
+echo -n "TEST: Reducer Load Balancing --- "
+
+cat ${dir}/new_test_1.tsv ${dir}/new_test_2.tsv | awk -F'\t' '{ line = $0; gsub(/\t/, "\002", line); print "tile" int(sqrt(NR * 7 % 200) * 3) "\t" line }' > ${dir}/balance_input.txt
+
+make -f makefile balance >/dev/null && \
+./resque --stats ${dir}/balance_stats.txt st_intersects 10 10 < ${dir}/balance_input.txt > /dev/null && \
+./balance --reducers 4 --output ${dir}/balance_manifest.txt ${dir}/balance_stats.txt 2> ${dir}/balance_report.txt
+status=$?
+
+tiles=`cut -f1 ${dir}/balance_input.txt | sort -u | wc -l`
+assigned=`cut -f1 ${dir}/balance_manifest.txt | sort -u | wc -l`
+routed=`cut -f3 ${dir}/balance_manifest.txt | sort -u | wc -l`
+[ ${status} -eq 0 ] && [ ${assigned} -eq ${tiles} ] && [ ${routed} -eq ${tiles} ] && \
+awk -F'\t' '{ exit !($2 <= $1 && $3 <= $2) }' ${dir}/balance_report.txt
+
+if [ $? -ne 0 ]
+then
+    echo "failed."
+else
+    echo "passed."
+    rm ${dir}/balance_input.txt ${dir}/balance_stats.txt ${dir}/balance_manifest.txt ${dir}/balance_report.txt
+fi
+
+
+# test the semi and anti joins: the semi join gives the distinct first
+# records of the pairs, the anti join every other record of dataset 1
+
+echo -n "TEST: Resque Semi and Anti Joins --- "
+
+reducer_input -t 0 ${dir}/new_test_1.tsv ${dir}/new_test_2.tsv > ${dir}/semi_input.txt
+awk -F'\t' 'BEGIN { OFS = "\t" } { $2 = 1; $3 = $3 + 1000; print }' ${dir}/new_test_2.tsv | reducer_input -t 0 ${dir}/new_test_1.tsv - > ${dir}/semi_self.txt
+
+failed=0
+for args in "st_intersects 10 10" "st_dwithin 10 10" "st_disjoint 10 10" "--self-join st_intersects 10"
+do
+    input=${dir}/semi_input.txt
+    pairs_args=${args}
+    if [ "${args}" = "--self-join st_intersects 10" ]
+    then
+        # an object matches whichever side of a pair it is on
+        input=${dir}/semi_self.txt
+        pairs_args="--self-join --both-directions st_intersects 10"
+    fi
+    ./resque ${pairs_args} < ${input} | awk -F'\002' '{ print $1 }' | sort -u > ${dir}/semi_standard.txt
+    cut -f2- ${input} | tr '\002' '\t' | awk -F'\t' '$2 == 1' | sort > ${dir}/semi_records.txt
+    ./resque --join-mode semi ${args} < ${input} | sort > ${dir}/semi_out.txt
+    ./resque --join-mode anti ${args} < ${input} | sort > ${dir}/anti_out.txt
+    diff ${dir}/semi_out.txt ${dir}/semi_standard.txt >/dev/null 2>&1 || failed=1
+    [ `sort -u ${dir}/semi_out.txt ${dir}/anti_out.txt | wc -l` -eq `cat ${dir}/semi_out.txt ${dir}/anti_out.txt | wc -l` ] || failed=1
+    # between them, every record of dataset 1
+    sort ${dir}/semi_out.txt ${dir}/anti_out.txt | diff - ${dir}/semi_records.txt >/dev/null 2>&1 || failed=1
+done
+
+if [ ${failed} -ne 0 ]
+then
+    echo "failed."
+else
+    echo "passed."
+    rm ${dir}/semi_input.txt ${dir}/semi_self.txt ${dir}/semi_standard.txt ${dir}/semi_records.txt ${dir}/semi_out.txt \
+        ${dir}/anti_out.txt
+fi
+
+
+# test the aggregate joins: the count of a tile and the matches of the
+# objects of dataset 1 add up to the pairs
+
+echo -n "TEST: Resque Count Joins --- "
+
+reducer_input -t 0 ${dir}/new_test_1.tsv ${dir}/new_test_2.tsv > ${dir}/count_input.txt
+objects=`cut -f3 ${dir}/new_test_1.tsv | sort -u | wc -l`
+
+failed=0
+for args in "st_intersects 10 10" "st_dwithin 10 10" "st_disjoint 10 10"
+do
+    pairs=`./resque ${args} < ${dir}/count_input.txt | wc -l`
+    ./resque --join-mode count --sum-area ${args} < ${dir}/count_input.txt > ${dir}/count_out.txt
+    ./resque --join-mode object-count --sum-area ${args} < ${dir}/count_input.txt > ${dir}/object_count_out.txt
+    awk -F'\t' -v pairs=${pairs} 'END { exit !(NR == 1 && $1 == 0 && $2 == pairs) }' ${dir}/count_out.txt || failed=1
+    awk -F'\t' -v pairs=${pairs} -v objects=${objects} '{ count += $(NF - 1) }
+        END { exit !(NR == objects && count == pairs) }' ${dir}/object_count_out.txt || failed=1
+    # the areas of the tile and of its objects agree
+    area=`cut -f3 ${dir}/count_out.txt`
+    awk -F'\t' -v area=${area} '{ sum += $NF }
+        END { d = sum - area; exit !(d < 1e-6 * (area + 1) && -d < 1e-6 * (area + 1)) }' ${dir}/object_count_out.txt || failed=1
+done
+
+if [ ${failed} -ne 0 ]
+then
+    echo "failed."
+else
+    echo "passed."
+    rm ${dir}/count_input.txt ${dir}/count_out.txt ${dir}/object_count_out.txt
+fi
+
+
+# test st_disjoint: every filter algorithm and the refinement threads give
+# the pairs of the nested loop, and the count join counts them
+
+echo -n "TEST: Resque Disjoint Join --- "
+
+reducer_input -t 0 ${dir}/new_test_1.tsv ${dir}/new_test_2.tsv > ${dir}/disjoint_input.txt
+
+failed=0
+for args in "st_disjoint 10 10" "--self-join st_disjoint 10" "--self-join --both-directions st_disjoint 10"
+do
+    ./resque --plan nested ${args} < ${dir}/disjoint_input.txt > ${dir}/disjoint_standard.txt
+    for options in "--plan sweep" "--plan index" "--threads 4"
+    do
+        ./resque ${options} ${args} < ${dir}/disjoint_input.txt > ${dir}/disjoint_out.txt
+        diff ${dir}/disjoint_out.txt ${dir}/disjoint_standard.txt >/dev/null 2>&1 || failed=1
+    done
+    pairs=`wc -l < ${dir}/disjoint_standard.txt`
+    count=`./resque --join-mode count ${args} < ${dir}/disjoint_input.txt | cut -f2`
+    [ "${count}" = "${pairs}" ] || failed=1
+done
+
+if [ ${failed} -ne 0 ]
+then
+    echo "failed."
+else
+    echo "passed."
+    rm ${dir}/disjoint_input.txt ${dir}/disjoint_standard.txt ${dir}/disjoint_out.txt
+fi
+
+
+# test st_equals: dataset 2 holds the polygons of dataset 1 with their
+# rings reversed and started elsewhere, each of which the hashed filter
+# must match with its original as the nested loop does
+
+echo -n "TEST: Resque Equals Join --- "
+
+awk -F'\t' 'BEGIN { OFS = "\t" } $11 ~ /^POLYGON\(\([^()]*\)\)$/ {
+        n = split(substr($11, 10, length($11) - 11), c, /, */)
+        for (k = 1; k < n; k++) r[k] = c[n - k]
+        s = NR % 3
+        ring = r[s + 1]
+        for (k = 2; k < n; k++) ring = ring ", " r[(s + k - 1) % (n - 1) + 1]
+        $2 = 2; $3 = $3 + 1000; $11 = "POLYGON((" ring ", " r[s + 1] "))"
+        print }' ${dir}/new_test_1.tsv > ${dir}/equals_2.tsv
+reducer_input -t 0 ${dir}/new_test_1.tsv ${dir}/equals_2.tsv > ${dir}/equals_input.txt
+polygons=`wc -l < ${dir}/equals_2.tsv`
+
+failed=0
+for args in "st_equals 10 10" "--self-join --both-directions st_equals 10"
+do
+    ./resque --plan nested ${args} < ${dir}/equals_input.txt > ${dir}/equals_standard.txt
+    ./resque --plan-log ${dir}/equals_plans.txt ${args} < ${dir}/equals_input.txt > ${dir}/equals_out.txt
+    diff ${dir}/equals_out.txt ${dir}/equals_standard.txt >/dev/null 2>&1 || failed=1
+    [ `cut -f2 ${dir}/equals_plans.txt` = "hash" ] || failed=1
+    rm ${dir}/equals_plans.txt
+done
+[ `./resque st_equals 10 10 < ${dir}/equals_input.txt | wc -l` -ge ${polygons} ] || failed=1
+
+if [ ${failed} -ne 0 ]
+then
+    echo "failed."
+else
+    echo "passed."
+    rm ${dir}/equals_2.tsv ${dir}/equals_input.txt ${dir}/equals_standard.txt ${dir}/equals_out.txt
+fi
+
+
+# test st_contains and st_within: dataset 2 adds the centres of the boxes
+# of dataset 1 as points; the range tree filter must find the pairs the
+# nested loop finds, with either side the smaller one
+
+echo -n "TEST: Resque Containment Join --- "
+
+awk -F'\t' 'BEGIN { OFS = "\t" } $11 ~ /^POLYGON\(\(/ {
+        n = split(substr($11, 10), c, /[ ,()]+/)
+        minx = maxx = c[1]; miny = maxy = c[2]
+        for (k = 3; k < n; k += 2) {
+            if (c[k] < minx) minx = c[k]; if (c[k] > maxx) maxx = c[k]
+            if (c[k + 1] < miny) miny = c[k + 1]; if (c[k + 1] > maxy) maxy = c[k + 1]
+        }
+        $2 = 2; $3 = $3 + 1000; $11 = "POINT(" (minx + maxx) / 2 " " (miny + maxy) / 2 ")"
+        print }' ${dir}/new_test_1.tsv > ${dir}/contains_2.tsv
+reducer_input -t 0 ${dir}/new_test_1.tsv ${dir}/new_test_2.tsv ${dir}/contains_2.tsv > ${dir}/contains_input.txt
+
+failed=0
+found=0
+for args in "st_contains 10 10" "st_within 10 10" "--self-join st_contains 10" "--self-join st_within 10"
+do
+    ./resque --plan nested ${args} < ${dir}/contains_input.txt > ${dir}/contains_standard.txt
+    ./resque --plan-log ${dir}/contains_plans.txt ${args} < ${dir}/contains_input.txt > ${dir}/contains_out.txt
+    diff ${dir}/contains_out.txt ${dir}/contains_standard.txt >/dev/null 2>&1 || failed=1
+    [ `cut -f2 ${dir}/contains_plans.txt` = "range" ] || failed=1
+    found=$((found + `wc -l < ${dir}/contains_out.txt`))
+    rm ${dir}/contains_plans.txt
+done
+[ ${found} -gt 0 ] || failed=1
+
+if [ ${failed} -ne 0 ]
+then
+    echo "failed."
+else
+    echo "passed."
+    rm ${dir}/contains_2.tsv ${dir}/contains_input.txt ${dir}/contains_standard.txt ${dir}/contains_out.txt
+fi
+
+
+# test st_touches and st_adjacent on a checkerboard: the squares of
+# dataset 2 (with an extra vertex on an edge) touch their neighbours of
+# dataset 1 along shared edges, and the squares shifted half a square
+# overlap two of them; the pairs are known, as is whether the edge index
+# gets the answer right
+
+echo -n "TEST: Resque Touches Join --- "
+
+awk -v n=12 'BEGIN { OFS = "\t"
+        for (i = 0; i < n; i++) for (j = 0; j < n; j++) {
+            x = 2 * i; y = 2 * j; id = i * n + j
+            if ((i + j) % 2 == 0) {
+                print "board", 1, id, 0, 0, 0, 0, 0, 0, 0, "POLYGON((" x " " y ", " x + 2 " " y ", " x + 2 " " y + 2 ", " x " " y + 2 ", " x " " y "))"
+                print "board", 2, 1000 + id, 0, 0, 0, 0, 0, 0, 0, "POLYGON((" x + 1 " " y + 1 ", " x + 3 " " y + 1 ", " x + 3 " " y + 3 ", " x + 1 " " y + 3 ", " x + 1 " " y + 1 "))"
+                for (k = 0; k < 4; k++) {
+                    a = i + (k == 0) - (k == 1); b = j + (k == 2) - (k == 3)
+                    if (a >= 0 && a < n && b >= 0 && b < n) {
+                        print id, a * n + b > "'${dir}'/touches_standard.txt"
+                        print id, a * n + b > "'${dir}'/adjacent_standard.txt"
+                    }
+                }
+                print id, 1000 + id > "'${dir}'/adjacent_standard.txt"
+                if (i > 0 && j > 0) print id, 1000 + id - n - 1 > "'${dir}'/adjacent_standard.txt"
+            }
+            else {
+                print "board", 2, id, 0, 0, 0, 0, 0, 0, 0, "POLYGON((" x " " y ", " x + 1 " " y ", " x + 2 " " y ", " x + 2 " " y + 2 ", " x " " y + 2 ", " x " " y "))"
+            }
+        } }' > ${dir}/touches.tsv
+reducer_input -t 0 ${dir}/touches.tsv > ${dir}/touches_input.txt
+
+failed=0
+for predicate in touches adjacent
+do
+    sort ${dir}/${predicate}_standard.txt > ${dir}/touches_sorted.txt
+    for threads in 1 4
+    do
+        ./resque --threads ${threads} st_${predicate} 10 10 < ${dir}/touches_input.txt \
+            | awk -F'\002' '{ split($1, a, "\t"); split($2, b, "\t"); print a[3] "\t" b[3] }' \
+            | sort > ${dir}/touches_out.txt
+        diff ${dir}/touches_out.txt ${dir}/touches_sorted.txt >/dev/null 2>&1 || failed=1
+    done
+done
+
+if [ ${failed} -ne 0 ]
+then
+    echo "failed."
+else
+    echo "passed."
+    rm ${dir}/touches.tsv ${dir}/touches_input.txt ${dir}/touches_standard.txt ${dir}/adjacent_standard.txt ${dir}/touches_sorted.txt ${dir}/touches_out.txt
+fi
+
+
+# test the parallel input: eight copies of the datasets in two tiles make
+# an input of more than one block, and a copy replaces the objects of the
+# one four copies before it in its tile, so the records must be stored in
+# input order on four threads as on one
+
+echo -n "TEST: Resque Parallel Input --- "
+
+for copy in 0 1 2 3 4 5 6 7
+do
+    awk -F'\t' -v copy=${copy} 'BEGIN { OFS = "\t" } { $3 = $3 + 1000 * (copy % 4); $4 = copy; print }' \
+        ${dir}/new_test_1.tsv ${dir}/new_test_2.tsv | reducer_input -t $((copy % 2))
+done > ${dir}/pinput.txt
+
+failed=0
+for args in "st_intersects 10 10" "--join-mode count st_intersects 10 10" "--self-join st_intersects 10" "--estimate st_intersects 10 10"
+do
+    ./resque ${args} < ${dir}/pinput.txt > ${dir}/pinput_standard.txt
+    ./resque --threads 4 ${args} < ${dir}/pinput.txt > ${dir}/pinput_out.txt
+    diff ${dir}/pinput_out.txt ${dir}/pinput_standard.txt >/dev/null 2>&1 || failed=1
+done
+[ `wc -c < ${dir}/pinput.txt` -gt 1048576 ] || failed=1
+
+if [ ${failed} -ne 0 ]
+then
+    echo "failed."
+else
+    echo "passed."
+    rm ${dir}/pinput.txt ${dir}/pinput_standard.txt ${dir}/pinput_out.txt
+fi
+
+
+# test the libresque C API
+
+echo -n "TEST: libresque C API --- "
+
+make -f makefile libresque_test >/dev/null && ./libresque_test >/dev/null
+
+if [ $? -ne 0 ]
+then
+    echo "failed."
+else
+    echo "passed."
+fi
+
+
+make clean
@@ -0,0 +1,91 @@
+#! /usr/bin/python
+
+# Joins every tile of a reducer input file twice: once with a fresh resque
+# process per tile, the way SpatialOperator runs it today, and once as
+# requests to a single resque --server process. Prints both wall clock
+# times and checks that the two produce the same pairs.
+#
+# usage: server_bench.py reducer_input [predicate shape_idx 1 shape_idx 2 ...]
+#        (default: st_intersects 10 10)
+
+import subprocess
+import sys
+import time
+
+RESQUE = "./resque"
+
+
+def read_tiles(path):
+    tiles = {}
+    order = []
+    with open(path) as f:
+        for line in f:
+            key = line.split("\t", 1)[0]
+            if key not in tiles:
+                tiles[key] = []
+                order.append(key)
+            tiles[key].append(line if line.endswith("\n") else line + "\n")
+    return [(key, tiles[key]) for key in order]
+
+
+def run_processes(tiles, args):
+    out = []
+    for key, lines in tiles:
+        p = subprocess.Popen([RESQUE] + args, stdin=subprocess.PIPE,
+                             stdout=subprocess.PIPE, universal_newlines=True)
+        stdout, _ = p.communicate("".join(lines))
+        out.extend(stdout.splitlines())
+    return out
+
+
+def run_server(tiles, args):
+    p = subprocess.Popen([RESQUE, "--server"], stdin=subprocess.PIPE,
+                         stdout=subprocess.PIPE, universal_newlines=True)
+    out = []
+    for key, lines in tiles:
+        p.stdin.write("JOIN %d %s\n" % (len(lines), " ".join(args)))
+        p.stdin.writelines(lines)
+        p.stdin.flush()
+        while True:
+            reply = p.stdout.readline()
+            if reply == "" or reply.startswith("ERROR"):
+                raise RuntimeError("tile %s: %s" % (key, reply.strip()))
+            if reply.startswith("END "):
+                break
+            out.append(reply.rstrip("\n"))
+    p.stdin.write("QUIT\n")
+    p.stdin.close()
+    p.wait()
+    return out
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.stderr.write("usage: server_bench.py reducer_input [predicate shape_idx ...]\n")
+        sys.exit(1)
+
+    tiles = read_tiles(sys.argv[1])
+    args = sys.argv[2:] or ["st_intersects", "10", "10"]
+
+    start = time.time()
+    by_process = run_processes(tiles, args)
+    process_time = time.time() - start
+
+    start = time.time()
+    by_server = run_server(tiles, args)
+    server_time = time.time() - start
+
+    print("tiles:              %d" % len(tiles))
+    print("process per tile:   %.3f s" % process_time)
+    print("persistent server:  %.3f s" % server_time)
+    if server_time > 0:
+        print("speedup:            %.1fx" % (process_time / server_time))
+
+    if sorted(by_process) != sorted(by_server):
+        print("MISMATCH: %d pairs per process, %d pairs from the server"
+              % (len(by_process), len(by_server)))
+        sys.exit(1)
+    print("pairs:              %d (identical)" % len(by_server))
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,65 @@
+#include <algorithm>
+#include <iostream>
+
+#include "tile_stats.h"
+
+using namespace std;
+
+TileStats::TileStats()
+    : count(0), vertices(0), boxed(0), area(0.0)
+{
+    extent.min_x = extent.min_y = extent.max_x = extent.max_y = 0.0;
+    extent.num_points = 0;
+}
+
+void TileStats::add(const wkt_extent *box, size_t num_points)
+{
+    count++;
+    vertices += num_points;
+    if (box == NULL) {
+        return;
+    }
+
+    if (boxed++ == 0) {
+        extent = *box;
+    }
+    else {
+        extent.min_x = min(extent.min_x, box->min_x);
+        extent.min_y = min(extent.min_y, box->min_y);
+        extent.max_x = max(extent.max_x, box->max_x);
+        extent.max_y = max(extent.max_y, box->max_y);
+    }
+    area += (box->max_x - box->min_x) * (box->max_y - box->min_y);
+    centers.push_back(make_pair((box->min_x + box->max_x) / 2, (box->min_y + box->max_y) / 2));
+}
+
+// a center on the upper edge of the extent goes to the last cell
+static int stats_cell(double v, double lo, double hi)
+{
+    if (hi <= lo) {
+        return 0;
+    }
+    int cell = (int) ((v - lo) / (hi - lo) * STATS_GRID);
+    return max(0, min(STATS_GRID - 1, cell));
+}
+
+void TileStats::write(ostream &out, const string &tile, int database_id) const
+{
+    long histogram[STATS_GRID * STATS_GRID] = {0};
+    for (size_t i = 0; i < centers.size(); i++) {
+        int cx = stats_cell(centers[i].first, extent.min_x, extent.max_x);
+        int cy = stats_cell(centers[i].second, extent.min_y, extent.max_y);
+        histogram[cy * STATS_GRID + cx]++;
+    }
+
+    double extent_area = (extent.max_x - extent.min_x) * (extent.max_y - extent.min_y);
+    out << tile << '\t' << database_id << '\t' << count << '\t' << vertices
+        << '\t' << (count > 0 ? (double) vertices / count : 0.0)
+        << '\t' << extent.min_x << '\t' << extent.min_y
+        << '\t' << extent.max_x << '\t' << extent.max_y
+        << '\t' << (extent_area > 0 ? area / extent_area : 0.0) << '\t';
+    for (int c = 0; c < STATS_GRID * STATS_GRID; c++) {
+        out << (c != 0 ? "," : "") << histogram[c];
+    }
+    out << '\n';
+}
@@ -0,0 +1,37 @@
+#ifndef TILE_STATS_H
+#define TILE_STATS_H
+
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "wkt_envelope.h"
+
+// The statistics sidecar of resque. For every tile and dataset of its
+// input resque can write one tab separated line
+//
+//     tile dataset count vertices avg_vertices min_x min_y max_x max_y coverage histogram
+//
+// with coverage the summed box area over the area of the extent, and the
+// histogram the box centers counted on a STATS_GRID x STATS_GRID grid over
+// the extent, row by row from min_y, separated by commas. Planners and
+// partitioners read it instead of scanning the WKT again.
+
+#define STATS_GRID 4
+
+struct TileStats {
+    long count;
+    long vertices;
+    long boxed;             // objects with a box; EMPTY geometries have none
+    wkt_extent extent;
+    double area;
+    std::vector<std::pair<double, double> > centers;
+
+    TileStats();
+    // box NULL when the object has none
+    void add(const wkt_extent *box, size_t num_points);
+    void write(std::ostream &out, const std::string &tile, int database_id) const;
+};
+
+#endif